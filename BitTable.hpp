@@ -86,6 +86,21 @@ public:
 		Reset() ;
 	}
 
+	// Initialize with size s, but keep the array if it has the right length already.
+	void Reinit( int s )
+	{
+		if ( s == 0 )
+			s = UNIT_SIZE ;
+		int newASize = ( s & UNIT_MASK ) ? s / UNIT_SIZE + 1 : s / UNIT_SIZE ;
+		if ( tab == NULL || newASize != asize )
+		{
+			Init( s ) ;
+			return ;
+		}
+		size = s ;
+		Reset() ;
+	}
+
 	void Release()
 	{
 		if ( tab != NULL )
@@ -363,12 +378,33 @@ public:
 		//else
 		//	k = size / UNIT_SIZE ;	
 
-		for ( i = 0 ; i < asize ; ++i )	
+		for ( i = 0 ; i < asize ; ++i )
 			if ( tab[i] != in.tab[i] )
 				return false ;
 		return true ;
 	}
-	
+
+	// Test whether the bits in [s,e] of the two bit tables are the same. Only the words covering [s,e] are visited.
+	bool IsEqualInRange( const BitTable &in, unsigned int s, unsigned int e ) const
+	{
+		if ( in.size != size )
+			return false ;
+		int i ;
+		int sind = s / UNIT_SIZE ;
+		int eind = e / UNIT_SIZE ;
+		UINT64 smask = ( ~(UINT64)0 ) << (UINT64)( s & UNIT_MASK ) ;
+		UINT64 emask = ( ~(UINT64)0 ) >> (UINT64)( UNIT_MASK - ( e & UNIT_MASK ) ) ;
+
+		if ( sind == eind )
+			return ( ( tab[sind] ^ in.tab[sind] ) & smask & emask ) == 0 ;
+		if ( ( tab[sind] ^ in.tab[sind] ) & smask )
+			return false ;
+		for ( i = sind + 1 ; i < eind ; ++i )
+			if ( tab[i] != in.tab[i] )
+				return false ;
+		return ( ( tab[eind] ^ in.tab[eind] ) & emask ) == 0 ;
+	}
+
 	// Return the location of the first difference. -1 if the same.
 	int GetFirstDifference( const BitTable &in ) const
 	{
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include <algorithm>
 #include <vector>
@@ -10,12 +12,19 @@
 #include "blocks.hpp"
 #include "stats.hpp"
 #include "SubexonGraph.hpp"
+#include "SubexonFile.hpp"
+#include "SubexonDepthMatrix.hpp"
 
 char usage[] = "combineSubexons [options]\n"
 	       "Required options:\n"
 	       "\t-s STRING: the path to the predicted subexon information. Can use multiple -s to specify multiple subexon prediction files\n" 
 	       "\t\tor\n"
-	       "\t--ls STRING: the path to file of the list of the predicted subexon information.\n" ;
+	       "\t--ls STRING: the path to file of the list of the predicted subexon information.\n"
+	       "Other options:\n"
+	       "\t-p INT: number of threads. The samples are read and the chromosomes are combined in parallel (default: 1)\n"
+	       "\t--depthMatrix STRING: also write the average depth of each sample on each combined subexon to the given file, for classes --depthMatrix (default: not used)\n"
+	       "\t--stream: read the sorted subexon files one chromosome at a time instead of all at once, for large cohorts (default: not used)\n"
+	       "\t--maxMemory INT: with --stream, the memory in MB for the subexons of the chromosomes loaded together; a larger chromosome is loaded alone (default: 4096)\n" ;
 
 struct _overhang
 {
@@ -481,7 +490,7 @@ void CleanUpSubexonConnections( std::vector<struct _subexon> &subexons )
 			for ( k = i ; k >= 0 ; --k )
 				if ( subexons[k].chrId != subexons[i].chrId || subexons[k].end <= subexons[i].prev[0] )
 					break ;
-			if ( subexons[k].chrId != subexons[i].chrId )
+			if ( k < 0 || subexons[k].chrId != subexons[i].chrId )
 				++k ;
 			m = 0 ;
 			for ( j = 0 ; j < subexons[i].prevCnt ; ++j )
@@ -517,57 +526,285 @@ void CleanUpSubexonConnections( std::vector<struct _subexon> &subexons )
 	}
 }
 
-int main( int argc, char *argv[] )
+struct _sampleSubexon // a subexon of a sample, kept in memory between the passes.
 {
-	int i, j, k ;
-	FILE *fp ;
-	std::vector<char *> files ;
+	int start, end ;
+	char leftType, rightType ;
+	char leftStrand, rightStrand ;
+	int prevCnt, nextCnt ;
+	int64_t adjOffset ; // the prev and next coordinates in _sampleData.adj
+	double avgDepth ;
+	double leftRatio, rightRatio ;
+	double leftClassifier, rightClassifier ;
+} ;
 
-	Blocks regions ;
-	Alignments alignments ;
+struct _gammaMixture // the fitted parameters of a mixture of two gamma distributions.
+{
+	double pi ;
+	double k[2], theta[2] ;
+} ;
 
-	if ( argc == 1 )
+struct _sampleStats // the fitted parameters from the header of a sample's subexon file.
+{
+	struct _gammaMixture irRatio, irCov ;
+	struct _gammaMixture overhangRatio, overhangCov ;
+	bool hasIrRatio, hasIrCov, hasOverhangRatio, hasOverhangCov ;
+} ;
+
+struct _chromRange
+{
+	int chrId ;
+	int begin, end ; // [begin, end) in _sampleData.subexons
+} ;
+
+struct _sampleData
+{
+	struct _sampleStats stats ;
+	std::vector<struct _sampleSubexon> subexons ;
+	std::vector<int> adj ;
+	std::vector<struct _chromRange> chromRanges ; // sorted by chrId
+} ;
+
+bool CompSampleSubexonChrId( const std::pair<int, int> &a, const std::pair<int, int> &b )
+{
+	return a.first < b.first ;
+}
+
+// Parse the line like "#fitted_ir_parameter_ratio: pi: 0.5 k0: 1 theta0: 1 k1: 1 theta1: 1".
+void ParseGammaMixture( const char *line, struct _gammaMixture &m )
+{
+	char buffer2[200] ;
+	sscanf( line, "%199s %199s %lf %199s %lf %199s %lf %199s %lf %199s %lf", 
+			buffer2, buffer2, &m.pi, buffer2, &m.k[0], buffer2, &m.theta[0],
+			buffer2, &m.k[1], buffer2, &m.theta[1] ) ;	
+}
+
+void ParseSampleStats( SubexonFile &subexonFile, struct _sampleStats &stats )
+{
+	int i ;
+	char buffer2[200] ;
+	int headerCnt = subexonFile.GetHeaderLineCount() ;
+	stats.hasIrRatio = stats.hasIrCov = stats.hasOverhangRatio = stats.hasOverhangCov = false ;
+	for ( i = 0 ; i < headerCnt ; ++i )
 	{
-		printf( "%s", usage ) ;
-		return 0 ;
+		const char *line = subexonFile.GetHeaderLine( i ) ;
+		if ( sscanf( line, "%199s", buffer2 ) != 1 )
+			continue ;
+		if ( !strcmp( buffer2, "#fitted_ir_parameter_ratio:" ) )
+		{
+			ParseGammaMixture( line, stats.irRatio ) ;
+			stats.hasIrRatio = true ;
+		}
+		else if ( !strcmp( buffer2, "#fitted_ir_parameter_cov:" ) )
+		{
+			ParseGammaMixture( line, stats.irCov ) ;
+			stats.hasIrCov = true ;
+		}
+		else if ( !strcmp( buffer2, "#fitted_overhang_parameter_ratio:" ) )
+		{
+			ParseGammaMixture( line, stats.overhangRatio ) ;
+			stats.hasOverhangRatio = true ;
+		}	
+		else if ( !strcmp( buffer2, "#fitted_overhang_parameter_cov:" ) )
+		{
+			ParseGammaMixture( line, stats.overhangCov ) ;
+			stats.hasOverhangCov = true ;
+		}
 	}
+}
 
-	for ( i = 1 ; i < argc ; ++i )
+// Append a subexon to the sample's memory.
+void AddSampleSubexon( struct _sampleData &sample, struct _subexon &se )
+{
+	struct _sampleSubexon ss ;
+	ss.start = se.start ;
+	ss.end = se.end ;
+	ss.leftType = se.leftType ;
+	ss.rightType = se.rightType ;
+	ss.leftStrand = se.leftStrand ;
+	ss.rightStrand = se.rightStrand ;
+	ss.prevCnt = se.prevCnt ;
+	ss.nextCnt = se.nextCnt ;
+	ss.adjOffset = sample.adj.size() ;
+	ss.avgDepth = se.avgDepth ;
+	ss.leftRatio = se.leftRatio ;
+	ss.rightRatio = se.rightRatio ;
+	ss.leftClassifier = se.leftClassifier ;
+	ss.rightClassifier = se.rightClassifier ;
+	sample.adj.insert( sample.adj.end(), se.prev, se.prev + se.prevCnt ) ;
+	sample.adj.insert( sample.adj.end(), se.next, se.next + se.nextCnt ) ;
+	sample.subexons.push_back( ss ) ;
+}
+
+// The memory held by the sample's subexons.
+int64_t GetSampleMemory( struct _sampleData &sample )
+{
+	return sample.subexons.size() * sizeof( struct _sampleSubexon ) + sample.adj.size() * sizeof( int ) ;
+}
+
+// Read the whole subexon file of a sample into memory.
+void LoadSample( char *file, Alignments &alignments, struct _sampleData &sample )
+{
+	int i ;
+	SubexonFile subexonFile ;
+	if ( !subexonFile.Open( file ) )
 	{
-		if ( !strcmp( argv[i], "-s" ) )
+		fprintf( stderr, "Could not open file %s.\n", file ) ;
+		exit( 1 ) ;
+	}
+	ParseSampleStats( subexonFile, sample.stats ) ;
+
+	struct _subexon se ;
+	std::vector< std::pair<int, int> > chrIds ; // the chromosome and the index of each subexon.
+	bool sorted = true ;
+	while ( subexonFile.Next( se, alignments, true ) )
+	{
+		if ( chrIds.size() > 0 && chrIds.back().first > se.chrId )
+			sorted = false ;
+		chrIds.push_back( std::pair<int, int>( se.chrId, sample.subexons.size() ) ) ;
+		AddSampleSubexon( sample, se ) ;
+		delete[] se.prev ;
+		delete[] se.next ;
+	}
+	subexonFile.Close() ;
+
+	int cnt = chrIds.size() ;
+	if ( !sorted )
+	{
+		// Keep the order within a chromosome.
+		std::stable_sort( chrIds.begin(), chrIds.end(), CompSampleSubexonChrId ) ;
+		std::vector<struct _sampleSubexon> subexons( cnt ) ;
+		for ( i = 0 ; i < cnt ; ++i )
+			subexons[i] = sample.subexons[ chrIds[i].second ] ;
+		sample.subexons.swap( subexons ) ;
+	}
+	for ( i = 0 ; i < cnt ; ++i )
+	{
+		if ( i == 0 || chrIds[i].first != chrIds[i - 1].first )
 		{
-			files.push_back( argv[i + 1] ) ;
-			++i ;
-			continue ;
+			struct _chromRange r ;
+			r.chrId = chrIds[i].first ;
+			r.begin = i ;
+			sample.chromRanges.push_back( r ) ;
 		}
-		else if ( !strcmp( argv[i], "--ls" ) )
-		{
-			FILE *fpLs = fopen( argv[i + 1], "r" ) ;
-			char buffer[1024] ;
-			while ( fgets( buffer, sizeof( buffer ), fpLs ) != NULL )
-			{
-				int len = strlen( buffer ) ;
-				if ( buffer[len - 1] == '\n' )
-				{
-					buffer[len - 1] = '\0' ;
-					--len ;
+		sample.chromRanges.back().end = i + 1 ;
+	}
+}
 
-				}
-				char *fileName = strdup( buffer ) ;
-				files.push_back( fileName ) ;
-			}
+struct _loadSampleThreadArg
+{
+	std::vector<char *> *files ;
+	std::vector<struct _sampleData> *samples ;
+	Alignments *alignments ;
+	int *nextJob ;
+	pthread_mutex_t *lock ;
+} ;
+
+void *LoadSample_Thread( void *pArg )
+{
+	struct _loadSampleThreadArg &arg = *( (struct _loadSampleThreadArg *)pArg ) ;
+	int fileCnt = arg.files->size() ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextJob ) ;
+		++*( arg.nextJob ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= fileCnt )
+			break ;
+		LoadSample( ( *arg.files )[k], *arg.alignments, ( *arg.samples )[k] ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// The subexons of sample on chromosome chrId are [begin, end).
+void GetSampleChromRange( struct _sampleData &sample, int chrId, int &begin, int &end )
+{
+	int l = 0, r = (int)sample.chromRanges.size() - 1 ;
+	begin = end = 0 ;
+	while ( l <= r )
+	{
+		int m = ( l + r ) / 2 ;
+		if ( sample.chromRanges[m].chrId == chrId )
+		{
+			begin = sample.chromRanges[m].begin ;
+			end = sample.chromRanges[m].end ;
+			return ;
 		}
+		else if ( sample.chromRanges[m].chrId < chrId )
+			l = m + 1 ;
+		else
+			r = m - 1 ;
 	}
-	int fileCnt = files.size() ;
-	// Obtain the chromosome ids through bam file.
-	fp = fopen( files[0], "r" ) ;		
-	if ( fgets( buffer, sizeof( buffer ), fp ) != NULL )
+}
+
+// The prev and next point into the sample's memory, so they should not be released.
+void GetSampleSubexon( struct _sampleData &sample, int i, int chrId, struct _subexon &se )
+{
+	struct _sampleSubexon &ss = sample.subexons[i] ;
+	se.chrId = chrId ;
+	se.start = ss.start ;
+	se.end = ss.end ;
+	se.leftType = ss.leftType ;
+	se.rightType = ss.rightType ;
+	se.leftStrand = ss.leftStrand ;
+	se.rightStrand = ss.rightStrand ;
+	se.avgDepth = ss.avgDepth ;
+	se.leftRatio = ss.leftRatio ;
+	se.rightRatio = ss.rightRatio ;
+	se.leftClassifier = ss.leftClassifier ;
+	se.rightClassifier = ss.rightClassifier ;
+	se.lcCnt = se.rcCnt = 0 ;
+	se.prevCnt = ss.prevCnt ;
+	se.nextCnt = ss.nextCnt ;
+	se.prev = ss.prevCnt > 0 ? &sample.adj[ ss.adjOffset ] : NULL ;
+	se.next = ss.nextCnt > 0 ? &sample.adj[ ss.adjOffset + ss.prevCnt ] : NULL ;
+}
+
+// Write the average depth of each sample on the combined subexons of a chromosome, as a chunk of the depth matrix.
+// The combined subexons are sorted, so each sample only goes through its subexons once.
+void WriteDepthChunk( int chrId, std::vector<struct _sampleData> &samples, std::vector<int> &starts, std::vector<int> &ends,
+	Alignments &alignments, FILE *fpDepth )
+{
+	int i, k, m ;
+	int fileCnt = samples.size() ;
+	int rowCnt = starts.size() ;
+	std::vector<int> sampleBegin( fileCnt ), sampleEnd( fileCnt ) ;
+	double *depth = new double[ fileCnt ] ;
+
+	SubexonDepthMatrixWriter::WriteChunkRows( fpDepth, alignments.GetChromName( chrId ), starts, ends ) ;
+	for ( k = 0 ; k < fileCnt ; ++k )
+		GetSampleChromRange( samples[k], chrId, sampleBegin[k], sampleEnd[k] ) ;
+	for ( i = 0 ; i < rowCnt ; ++i )
 	{
-		int len = strlen( buffer ) ;
-		buffer[len - 1] = '\0' ;
-		alignments.Open( buffer + 1 ) ;
+		for ( k = 0 ; k < fileCnt ; ++k )
+		{
+			std::vector<struct _sampleSubexon> &ss = samples[k].subexons ;
+			while ( sampleBegin[k] < sampleEnd[k] && ss[ sampleBegin[k] ].end < starts[i] )
+				++sampleBegin[k] ;
+			depth[k] = 0 ;
+			for ( m = sampleBegin[k] ; m < sampleEnd[k] && ss[m].start <= ends[i] ; ++m )
+			{
+				int s = ss[m].start > starts[i] ? ss[m].start : starts[i] ;
+				int e = ss[m].end < ends[i] ? ss[m].end : ends[i] ;
+				depth[k] += ( e - s + 1 ) * ss[m].avgDepth ;
+			}
+			depth[k] /= ( ends[i] - starts[i] + 1 ) ;
+		}
+		SubexonDepthMatrixWriter::WriteChunkDepth( fpDepth, depth, fileCnt ) ;
 	}
-	fclose( fp ) ;
+	delete[] depth ;
+}
+
+// Combine the subexons of the samples on one chromosome. The chromosomes are independent
+// of each other, so they can run in parallel.
+// The chunk of the depth matrix is written to fpDepth if it is not NULL.
+void CombineChrom( int chrId, std::vector<struct _sampleData> &samples, double avgIrPiRatio, double avgOverhangPiRatio,
+	Alignments &alignments, FILE *fpOut, FILE *fpDepth )
+{
+	int i, j, k, m ;
+	int fileCnt = samples.size() ;
+	Blocks regions ;
 
 	// Collect the split sites of subexons.
 	std::vector<struct _subexonSplit> subexonSplits ;
@@ -578,17 +815,14 @@ int main( int argc, char *argv[] )
 
 	for ( k = 0 ; k < fileCnt ; ++k )
 	{
-		fp = fopen( files[k], "r" ) ;		
 		struct _subexon se ;
 		struct _subexonSplit sp ;
-		char chrName[50] ;
 		int origSize = subexonSplits.size() ;
-		while ( fgets( buffer, sizeof( buffer), fp  ) != NULL )
+		int begin, end ;
+		GetSampleChromRange( samples[k], chrId, begin, end ) ;
+		for ( m = begin ; m < end ; ++m )
 		{
-			if ( buffer[0] == '#' )
-				continue ;
-
-			SubexonGraph::InputSubexon( buffer, alignments, se, false) ;
+			GetSampleSubexon( samples[k], m, chrId, se ) ;
 			// Record all the intron rentention, overhang from the samples
 			if ( ( se.leftType == 2 && se.rightType == 1 ) 
 				|| ( se.leftType == 2 && se.rightType == 0 )
@@ -662,8 +896,6 @@ int main( int argc, char *argv[] )
 		CoalesceIntervals( introns ) ;
 		CoalesceSubexonSplits( subexonSplits, origSize ) ;
 		CleanIntervalIrOverhang( intervalIrOverhang ) ;
-		
-		fclose( fp ) ;
 	}
 
 	CoalesceDifferentStrandSubexonSplits( subexonSplits ) ;
@@ -1137,54 +1369,6 @@ int main( int argc, char *argv[] )
 		}
 	}
 	
-	// Go through all the files to get some statistics number
-	double avgIrPiRatio = 0 ;
-	double avgIrPiCov = 0 ;
-	double irPiRatio, irKRatio[2], irThetaRatio[2] ; // Some statistical results
-	double irPiCov, irKCov[2], irThetaCov[2] ;
-	
-	double avgOverhangPiRatio = 0 ;
-	double avgOverhangPiCov = 0 ;
-	double overhangPiRatio, overhangKRatio[2], overhangThetaRatio[2] ; // Some statistical results
-	double overhangPiCov, overhangKCov[2], overhangThetaCov[2] ;
-	
-	for ( k = 0 ; k < fileCnt ; ++k )
-	{
-		fp = fopen( files[k], "r" ) ;		
-		
-		while ( fgets( buffer, sizeof( buffer), fp  ) != NULL )
-		{
-			if ( buffer[0] == '#' )
-			{
-				char buffer2[100] ;
-				sscanf( buffer, "%s", buffer2 ) ;	
-				if ( !strcmp( buffer2, "#fitted_ir_parameter_ratio:" ) )
-				{
-					// TODO: ignore certain samples if the coverage seems wrong.
-					sscanf( buffer, "%s %s %lf %s %lf %s %lf %s %lf %s %lf", 
-								buffer2, buffer2, &irPiRatio, buffer2, &irKRatio[0], buffer2, &irThetaRatio[0],
-								buffer2, &irKRatio[1], buffer2, &irThetaRatio[1] ) ;	
-					avgIrPiRatio += irPiRatio ;
-				}
-				else if ( !strcmp( buffer2, "#fitted_ir_parameter_cov:" ) )
-				{
-				}
-				else if ( !strcmp( buffer2, "#fitted_overhang_parameter_ratio:" ) )
-				{
-					sscanf( buffer, "%s %s %lf %s %lf %s %lf %s %lf %s %lf", 
-								buffer2, buffer2, &overhangPiRatio, buffer2, &overhangKRatio[0], buffer2, &overhangThetaRatio[0],
-								buffer2, &overhangKRatio[1], buffer2, &overhangThetaRatio[1] ) ;	
-					avgOverhangPiRatio += overhangPiRatio ;
-				}
-			}
-			else
-				break ;
-		}
-		fclose( fp ) ;
-	}
-	avgIrPiRatio /= fileCnt ;
-	avgOverhangPiRatio /= fileCnt ;
-
 	// Go through all the files to put statistical results into each subexon.
 	std::vector< struct _subexon > sampleSubexons ;
 	int subexonCnt = subexons.size() ;
@@ -1192,65 +1376,20 @@ int main( int argc, char *argv[] )
 	{
 		//if ( k == 220 )
 		//	exit( 1 ) ;
-		fp = fopen( files[k], "r" ) ;		
-		struct _subexon se ;
-		struct _subexonSplit sp ;
-		char chrName[50] ;
-		
+		struct _sampleStats &stats = samples[k].stats ;
 		sampleSubexons.clear() ;
 
 		int tag = 0 ;
-		while ( fgets( buffer, sizeof( buffer), fp  ) != NULL )
-		{
-			if ( buffer[0] == '#' )
-			{
-				char buffer2[200] ;
-				sscanf( buffer, "%s", buffer2 ) ;	
-				if ( !strcmp( buffer2, "#fitted_ir_parameter_ratio:" ) )
-				{
-					sscanf( buffer, "%s %s %lf %s %lf %s %lf %s %lf %s %lf", 
-								buffer2, buffer2, &irPiRatio, buffer2, &irKRatio[0], buffer2, &irThetaRatio[0],
-								buffer2, &irKRatio[1], buffer2, &irThetaRatio[1] ) ;	
-				}
-				else if ( !strcmp( buffer2, "#fitted_ir_parameter_cov:" ) )
-				{
-					sscanf( buffer, "%s %s %lf %s %lf %s %lf %s %lf %s %lf", 
-								buffer2, buffer2, &irPiCov, buffer2, &irKCov[0], buffer2, &irThetaCov[0],
-								buffer2, &irKCov[1], buffer2, &irThetaCov[1] ) ;	
-				}
-				else if ( !strcmp( buffer2, "#fitted_overhang_parameter_ratio:" ) )
-				{
-					sscanf( buffer, "%s %s %lf %s %lf %s %lf %s %lf %s %lf", 
-								buffer2, buffer2, &overhangPiRatio, buffer2, &overhangKRatio[0], buffer2, &overhangThetaRatio[0],
-								buffer2, &overhangKRatio[1], buffer2, &overhangThetaRatio[1] ) ;	
-				}	
-				else if ( !strcmp( buffer2, "#fitted_overhang_parameter_cov:" ) )
-				{
-					sscanf( buffer, "%s %s %lf %s %lf %s %lf %s %lf %s %lf", 
-								buffer2, buffer2, &overhangPiCov, buffer2, &overhangKCov[0], buffer2, &overhangThetaCov[0],
-								buffer2, &overhangKCov[1], buffer2, &overhangThetaCov[1] ) ;	
-				}
-				continue ;
-			}
-			else 
-				break ;
-
-			//SubexonGraph::InputSubexon( buffer, alignments, se, true ) ;
-			//sampleSubexons.push_back( se ) ;
-		}
 		
 		//int sampleSubexonCnt = sampleSubexons.size() ;
 		int intervalCnt = seIntervals.size() ;
 		//for ( i = 0 ; i < sampleSubexonCnt ; ++i )	
-		int iterCnt = 0 ;
-		while ( 1 )
+		struct _subexon se ;
+		int begin, end ;
+		GetSampleChromRange( samples[k], chrId, begin, end ) ;
+		for ( m = begin ; m < end ; ++m )
 		{
-			if ( iterCnt > 0 && fgets( buffer, sizeof( buffer), fp  ) == NULL)
-				break ;
-			++iterCnt ;
-
-			struct _subexon se ;
-			SubexonGraph::InputSubexon( buffer, alignments, se, true ) ;
+			GetSampleSubexon( samples[k], m, chrId, se ) ;
 
 			while ( tag < intervalCnt )	
 			{
@@ -1378,8 +1517,8 @@ int main( int argc, char *argv[] )
 								++intronicInfos[idx].leftOverhang.validCnt ;
 
 								double update = GetUpdateMixtureGammaClassifier( se.leftRatio, se.avgDepth, 
-										overhangPiRatio, overhangKRatio, overhangThetaRatio, 
-										overhangPiCov, overhangKCov, overhangThetaCov, false ) ;
+										stats.overhangRatio.pi, stats.overhangRatio.k, stats.overhangRatio.theta, 
+										stats.overhangCov.pi, stats.overhangCov.k, stats.overhangCov.theta, false ) ;
 								intronicInfos[idx].leftOverhang.classifier += update ;				
 							}
 						}
@@ -1387,8 +1526,8 @@ int main( int argc, char *argv[] )
 						{
 							++intronicInfos[idx].leftOverhang.validCnt ;
 							double update = GetUpdateMixtureGammaClassifier( 1.0, se.avgDepth, 
-									overhangPiRatio, overhangKRatio, overhangThetaRatio, 
-									overhangPiCov, overhangKCov, overhangThetaCov, true ) ;
+									stats.overhangRatio.pi, stats.overhangRatio.k, stats.overhangRatio.theta, 
+									stats.overhangCov.pi, stats.overhangCov.k, stats.overhangCov.theta, true ) ;
 							intronicInfos[idx].leftOverhang.classifier += update ;			
 							
 							int seIdx = intronicInfos[idx].leftSubexonIdx ;
@@ -1414,8 +1553,8 @@ int main( int argc, char *argv[] )
 								++intronicInfos[idx].rightOverhang.validCnt ;
 
 								double update = GetUpdateMixtureGammaClassifier( se.rightRatio, se.avgDepth, 
-										overhangPiRatio, overhangKRatio, overhangThetaRatio, 
-										overhangPiCov, overhangKCov, overhangThetaCov, false ) ;
+										stats.overhangRatio.pi, stats.overhangRatio.k, stats.overhangRatio.theta, 
+										stats.overhangCov.pi, stats.overhangCov.k, stats.overhangCov.theta, false ) ;
 								intronicInfos[idx].rightOverhang.classifier += update ;				
 							}
 						}
@@ -1424,8 +1563,8 @@ int main( int argc, char *argv[] )
 							++intronicInfos[idx].rightOverhang.validCnt ;
 
 							double update = GetUpdateMixtureGammaClassifier( 1, se.avgDepth, 
-									overhangPiRatio, overhangKRatio, overhangThetaRatio, 
-									overhangPiCov, overhangKCov, overhangThetaCov, true ) ;
+									stats.overhangRatio.pi, stats.overhangRatio.k, stats.overhangRatio.theta, 
+									stats.overhangCov.pi, stats.overhangCov.k, stats.overhangCov.theta, true ) ;
 							intronicInfos[idx].rightOverhang.classifier += update ;				
 
 							int seIdx = intronicInfos[idx].rightSubexonIdx ;
@@ -1447,8 +1586,8 @@ int main( int argc, char *argv[] )
 							if ( ratio > 0 && se.avgDepth > 1 )
 							{
 								double update = GetUpdateMixtureGammaClassifier( ratio, se.avgDepth,
-										irPiRatio, irKRatio, irThetaRatio,
-										irPiCov, irKCov, irThetaCov, true ) ;
+										stats.irRatio.pi, stats.irRatio.k, stats.irRatio.theta,
+										stats.irCov.pi, stats.irCov.k, stats.irCov.theta, true ) ;
 								//if ( intronicInfos[idx].start == 37617368 )
 								//	printf( "hi %lf %d %d: %d %d\n", update, se.start, se.end, intronicInfos[idx].start, intronicInfos[idx].end ) ;
 								intronicInfos[idx].irClassifier += update ;
@@ -1457,19 +1596,19 @@ int main( int argc, char *argv[] )
 						}
 						else if ( se.leftType == 1 || se.rightType == 2 )
 						{
-							//intronicInfos[idx].irClassifier += LogGammaDensity( 4.0, irKRatio[1], irThetaRatio[1] )
-							//                                         - LogGammaDensity( 4.0, irKRatio[0], irThetaRatio[0] ) ;
+							//intronicInfos[idx].irClassifier += LogGammaDensity( 4.0, stats.irRatio.k[1], stats.irRatio.theta[1] )
+							//                                         - LogGammaDensity( 4.0, stats.irRatio.k[0], stats.irRatio.theta[0] ) ;
 							/*if ( se.start == 37617368 )
 							{
-								printf( "%lf: %lf %lf\n", se.avgDepth, MixtureGammaAssignment( ( irKCov[0] - 1 ) * irThetaCov[0], irPiRatio, irKCov, irThetaCov ),
-									MixtureGammaAssignment( TransformCov( 4.0 ), irPiRatio, irKCov, irThetaCov ) ) ;
+								printf( "%lf: %lf %lf\n", se.avgDepth, MixtureGammaAssignment( ( stats.irCov.k[0] - 1 ) * stats.irCov.theta[0], stats.irRatio.pi, stats.irCov.k, stats.irCov.theta ),
+									MixtureGammaAssignment( TransformCov( 4.0 ), stats.irRatio.pi, stats.irCov.k, stats.irCov.theta ) ) ;
 							}*/
 							if ( se.avgDepth > 1 )
 							{
 								// let the depth be the threshold to determine.
 								double update = GetUpdateMixtureGammaClassifier( 4.0, se.avgDepth,
-										irPiRatio, irKRatio, irThetaRatio,
-										irPiCov, irKCov, irThetaCov, true ) ;
+										stats.irRatio.pi, stats.irRatio.k, stats.irRatio.theta,
+										stats.irCov.pi, stats.irCov.k, stats.irCov.theta, true ) ;
 								//if ( intronicInfos[idx].start == 36266630 )
 								//	printf( "hi %lf %d %d: %d %d\n", update, se.start, se.end, intronicInfos[idx].start, intronicInfos[idx].end ) ;
 								intronicInfos[idx].irClassifier += update ;
@@ -1489,13 +1628,7 @@ int main( int argc, char *argv[] )
 					}
 				}
 			}
-
-			//if ( se.nextCnt > 0 )
-				delete[] se.next ;
-			//if ( se.prevCnt > 0 )
-				delete[] se.prev ;
 		}
-		fclose( fp ) ;
 		
 		/*for ( i = 0 ; i < sampleSubexonCnt ; ++i )
 		{
@@ -1590,6 +1723,7 @@ int main( int argc, char *argv[] )
 	}
 	
 	// Output the result.
+	std::vector<int> rowStarts, rowEnds ; // the output subexons, for the depth matrix.
 	for ( i = 0 ; i < intervalCnt ; ++i )
 	{
 		if ( seIntervals[i].type == 0 )
@@ -1601,8 +1735,10 @@ int main( int argc, char *argv[] )
 			ls = StrandNumToSymbol( se.leftStrand ) ;
 			rs = StrandNumToSymbol( se.rightStrand ) ;
 
-			printf( "%s %d %d %d %d %c %c -1 -1 -1 %lf %lf ", alignments.GetChromName( se.chrId ), se.start, se.end,
+			fprintf( fpOut, "%s %d %d %d %d %c %c -1 -1 -1 %lf %lf ", alignments.GetChromName( se.chrId ), se.start, se.end,
 					se.leftType, se.rightType, ls, rs, se.leftClassifier, se.rightClassifier ) ;
+			rowStarts.push_back( se.start ) ;
+			rowEnds.push_back( se.end ) ;
 			if ( i > 0 && seIntervals[i - 1].chrId == seIntervals[i].chrId 
 				&& seIntervals[i - 1].end + 1 == seIntervals[i].start 
 				&& !( seIntervals[i - 1].type == 0 && 
@@ -1611,16 +1747,16 @@ int main( int argc, char *argv[] )
 					&& intronicInfos[ seIntervals[i - 1].idx ].rightOverhang.cnt == 0 ) 
 				&& ( se.prevCnt == 0 || se.start - 1 != se.prev[ se.prevCnt - 1 ] ) ) // The connection showed up in the subexon file.
 			{
-				printf( "%d ", se.prevCnt + 1 ) ;
+				fprintf( fpOut, "%d ", se.prevCnt + 1 ) ;
 				for ( j = 0 ; j < se.prevCnt ; ++j )
-					printf( "%d ", se.prev[j] ) ;
-				printf( "%d ", se.start - 1 ) ;
+					fprintf( fpOut, "%d ", se.prev[j] ) ;
+				fprintf( fpOut, "%d ", se.start - 1 ) ;
 			}
 			else
 			{
-				printf( "%d ", se.prevCnt ) ;
+				fprintf( fpOut, "%d ", se.prevCnt ) ;
 				for ( j = 0 ; j < se.prevCnt ; ++j )
-					printf( "%d ", se.prev[j] ) ;
+					fprintf( fpOut, "%d ", se.prev[j] ) ;
 			}
 
 			if ( i < intervalCnt - 1 && seIntervals[i].chrId == seIntervals[i + 1].chrId 
@@ -1631,50 +1767,619 @@ int main( int argc, char *argv[] )
 					&& intronicInfos[ seIntervals[i + 1].idx ].leftOverhang.cnt == 0 ) 
 				&& ( se.nextCnt == 0 || se.end + 1 != se.next[0] ) )
 			{
-				printf( "%d %d ", se.nextCnt + 1, se.end + 1 ) ;
+				fprintf( fpOut, "%d %d ", se.nextCnt + 1, se.end + 1 ) ;
 			}
 			else
-				printf( "%d ", se.nextCnt ) ;
+				fprintf( fpOut, "%d ", se.nextCnt ) ;
 			for ( j = 0 ; j < se.nextCnt ; ++j )
-				printf( "%d ", se.next[j] ) ;
-			printf( "\n" ) ;
+				fprintf( fpOut, "%d ", se.next[j] ) ;
+			fprintf( fpOut, "\n" ) ;
 		}
 		else if ( seIntervals[i].type == 1 )
 		{
 			struct _intronicInfo &ii = intronicInfos[ seIntervals[i].idx ] ;
 			if ( ii.irCnt > 0 )
 			{
-				printf( "%s %d %d 2 1 . . -1 -1 -1 %lf %lf 1 %d 1 %d\n",
+				fprintf( fpOut, "%s %d %d 2 1 . . -1 -1 -1 %lf %lf 1 %d 1 %d\n",
 					alignments.GetChromName( ii.chrId ), ii.start, ii.end, 
 					ii.irClassifier, ii.irClassifier,
 					seIntervals[i - 1].end, seIntervals[i + 1].start ) ;
+				rowStarts.push_back( ii.start ) ;
+				rowEnds.push_back( ii.end ) ;
 			}
 			else
 			{
 				// left overhang.
 				if ( ii.leftOverhang.cnt > 0 )
 				{
-					printf( "%s %d %d 2 0 . . -1 -1 -1 %lf %lf 1 %d 0\n",
+					fprintf( fpOut, "%s %d %d 2 0 . . -1 -1 -1 %lf %lf 1 %d 0\n",
 						alignments.GetChromName( ii.chrId ), ii.start, 
 						ii.start + ( ii.leftOverhang.length /  ii.leftOverhang.cnt ) - 1,
 						ii.leftOverhang.classifier, ii.leftOverhang.classifier,
 						ii.start - 1 ) ; 
+					rowStarts.push_back( ii.start ) ;
+					rowEnds.push_back( ii.start + ( ii.leftOverhang.length /  ii.leftOverhang.cnt ) - 1 ) ;
 				}
 
 				// right overhang.
 				if ( ii.rightOverhang.cnt > 0 )
 				{
-					printf( "%s %d %d 0 1 . . -1 -1 -1 %lf %lf 0 1 %d\n",
+					fprintf( fpOut, "%s %d %d 0 1 . . -1 -1 -1 %lf %lf 0 1 %d\n",
 						alignments.GetChromName( ii.chrId ), 
 						ii.end - ( ii.rightOverhang.length / ii.rightOverhang.cnt ) + 1, ii.end,
 						ii.rightOverhang.classifier, ii.rightOverhang.classifier,
 						ii.end + 1 ) ;
+					rowStarts.push_back( ii.end - ( ii.rightOverhang.length / ii.rightOverhang.cnt ) + 1 ) ;
+					rowEnds.push_back( ii.end ) ;
 				}
 
 			}
 		}
 	}
 
-	return 0 ;
+	for ( i = 0 ; i < subexonCnt ; ++i )
+	{
+		delete[] subexons[i].prev ;
+		delete[] subexons[i].next ;
+	}
+
+	if ( fpDepth != NULL )
+		WriteDepthChunk( chrId, samples, rowStarts, rowEnds, alignments, fpDepth ) ;
 }
 
+struct _combineChromThreadArg
+{
+	std::vector<struct _sampleData> **chromSamples ; // the samples holding each chromosome.
+	int *chroms ; // the chromosomes in the order of the output.
+	int64_t *chromSize ; // the subexon count of each chromosome.
+	int chromCnt ;
+	int window ; // only the chromosomes in [nextOut, nextOut + window) can be combined.
+	bool *started ;
+	bool *done ;
+	int *nextOut ; // the next chromosome to write.
+	int *startedCnt ;
+	FILE **chromOut ;
+	FILE **chromDepth ; // NULL if the depth matrix is not written.
+	FILE *fpOut ;
+	SubexonDepthMatrixWriter *depthWriter ;
+	double avgIrPiRatio, avgOverhangPiRatio ;
+	Alignments *alignments ;
+	pthread_mutex_t *lock ;
+	pthread_cond_t *cond ;
+} ;
+
+void *CombineChrom_Thread( void *pArg )
+{
+	struct _combineChromThreadArg &arg = *( (struct _combineChromThreadArg *)pArg ) ;
+	int i ;
+	while ( 1 )
+	{
+		// Take the chromosome with most subexons in the window. The window keeps the number of 
+		// temporary files bounded, since a chromosome's file is closed once it is written.
+		int c = -1 ;
+		pthread_mutex_lock( arg.lock ) ;
+		while ( *( arg.startedCnt ) < arg.chromCnt )
+		{
+			int to = *( arg.nextOut ) + arg.window ;
+			if ( to > arg.chromCnt )
+				to = arg.chromCnt ;
+			for ( i = *( arg.nextOut ) ; i < to ; ++i )
+				if ( !arg.started[i] && ( c == -1 || arg.chromSize[i] > arg.chromSize[c] ) )
+					c = i ;
+			if ( c != -1 )
+				break ;
+			pthread_cond_wait( arg.cond, arg.lock ) ;
+		}
+		if ( c != -1 )
+		{
+			arg.started[c] = true ;
+			++*( arg.startedCnt ) ;
+		}
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( c == -1 )
+			break ;
+
+		arg.chromOut[c] = tmpfile() ;
+		if ( arg.chromOut[c] == NULL )
+		{
+			fprintf( stderr, "Could not create a temporary file.\n" ) ;
+			exit( 1 ) ;
+		}
+		if ( arg.chromDepth != NULL )
+		{
+			arg.chromDepth[c] = tmpfile() ;
+			if ( arg.chromDepth[c] == NULL )
+			{
+				fprintf( stderr, "Could not create a temporary file.\n" ) ;
+				exit( 1 ) ;
+			}
+		}
+		CombineChrom( arg.chroms[c], *arg.chromSamples[c], arg.avgIrPiRatio, arg.avgOverhangPiRatio, 
+			*arg.alignments, arg.chromOut[c], arg.chromDepth != NULL ? arg.chromDepth[c] : NULL ) ;
+
+		// Write the finished chromosomes that are next in the output.
+		pthread_mutex_lock( arg.lock ) ;
+		arg.done[c] = true ;
+		while ( *( arg.nextOut ) < arg.chromCnt && arg.done[ *( arg.nextOut ) ] )
+		{
+			int j = *( arg.nextOut ) ;
+			char buffer[65536] ;
+			size_t size ;
+			rewind( arg.chromOut[j] ) ;
+			while ( ( size = fread( buffer, 1, sizeof( buffer ), arg.chromOut[j] ) ) > 0 )
+				fwrite( buffer, 1, size, arg.fpOut ) ;
+			fclose( arg.chromOut[j] ) ;
+			if ( arg.chromDepth != NULL )
+			{
+				arg.depthWriter->AppendChunk( arg.chromDepth[j] ) ;
+				fclose( arg.chromDepth[j] ) ;
+			}
+			++*( arg.nextOut ) ;
+		}
+		pthread_cond_broadcast( arg.cond ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// Combine the chromosomes and write them to fpOut in the order of chroms.
+// The depth matrix chunks go to depthWriter if it is not NULL.
+void CombineChroms( std::vector<int> &chroms, std::vector< std::vector<struct _sampleData> * > &chromSamples, 
+	std::vector<int64_t> &chromSize, double avgIrPiRatio, double avgOverhangPiRatio, Alignments &alignments, 
+	int numThreads, FILE *fpOut, SubexonDepthMatrixWriter *depthWriter )
+{
+	int i ;
+	int chromCnt = chroms.size() ;
+	if ( numThreads <= 1 || chromCnt <= 1 )
+	{
+		for ( i = 0 ; i < chromCnt ; ++i )
+		{
+			FILE *fpDepth = NULL ;
+			if ( depthWriter != NULL )
+			{
+				fpDepth = tmpfile() ;
+				if ( fpDepth == NULL )
+				{
+					fprintf( stderr, "Could not create a temporary file.\n" ) ;
+					exit( 1 ) ;
+				}
+			}
+			CombineChrom( chroms[i], *chromSamples[i], avgIrPiRatio, avgOverhangPiRatio, alignments, fpOut, fpDepth ) ;
+			if ( depthWriter != NULL )
+			{
+				depthWriter->AppendChunk( fpDepth ) ;
+				fclose( fpDepth ) ;
+			}
+		}
+		return ;
+	}
+
+	// Each thread combines a whole chromosome, and the outputs are written in the order of the chromosomes.
+	FILE **chromOut = new FILE*[ chromCnt ] ;
+	FILE **chromDepth = depthWriter != NULL ? new FILE*[ chromCnt ] : NULL ;
+	bool *started = new bool[ chromCnt ] ;
+	bool *done = new bool[ chromCnt ] ;
+	int nextOut = 0 ;
+	int startedCnt = 0 ;
+	for ( i = 0 ; i < chromCnt ; ++i )
+	{
+		chromOut[i] = NULL ;
+		started[i] = done[i] = false ;
+	}
+
+	int threadCnt = numThreads < chromCnt ? numThreads : chromCnt ;
+	pthread_t *threads = new pthread_t[ threadCnt ] ;
+	pthread_attr_t attr ;
+	pthread_mutex_t lock ;
+	pthread_cond_t cond ;
+	pthread_attr_init( &attr ) ;
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE ) ;
+	pthread_mutex_init( &lock, NULL ) ;
+	pthread_cond_init( &cond, NULL ) ;
+	struct _combineChromThreadArg arg ;
+	arg.chromSamples = &chromSamples[0] ;
+	arg.chroms = &chroms[0] ;
+	arg.chromSize = &chromSize[0] ;
+	arg.chromCnt = chromCnt ;
+	arg.window = 4 * threadCnt ;
+	arg.started = started ;
+	arg.done = done ;
+	arg.nextOut = &nextOut ;
+	arg.startedCnt = &startedCnt ;
+	arg.chromOut = chromOut ;
+	arg.chromDepth = chromDepth ;
+	arg.fpOut = fpOut ;
+	arg.depthWriter = depthWriter ;
+	arg.avgIrPiRatio = avgIrPiRatio ;
+	arg.avgOverhangPiRatio = avgOverhangPiRatio ;
+	arg.alignments = &alignments ;
+	arg.lock = &lock ;
+	arg.cond = &cond ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_create( &threads[i], &attr, CombineChrom_Thread, (void *)&arg ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_join( threads[i], NULL ) ;
+
+	pthread_attr_destroy( &attr ) ;
+	pthread_mutex_destroy( &lock ) ;
+	pthread_cond_destroy( &cond ) ;
+	delete[] threads ;
+	delete[] chromOut ;
+	if ( chromDepth != NULL )
+		delete[] chromDepth ;
+	delete[] started ;
+	delete[] done ;
+}
+
+struct _sampleStream // reads the subexon file of a sample one chromosome at a time.
+{
+	SubexonFile file ;
+	struct _subexon next ; // the first subexon not taken yet.
+	bool hasNext ;
+} ;
+
+void AdvanceSampleStream( struct _sampleStream &stream, Alignments &alignments )
+{
+	stream.hasNext = stream.file.Next( stream.next, alignments, true ) ;
+}
+
+// Take the subexons on chromosome chrId from the stream into sample. 
+void ReadSampleStreamChrom( struct _sampleStream &stream, int chrId, Alignments &alignments, struct _sampleData &sample )
+{
+	sample.subexons.clear() ;
+	sample.adj.clear() ;
+	sample.chromRanges.clear() ;
+	while ( stream.hasNext && stream.next.chrId == chrId )
+	{
+		AddSampleSubexon( sample, stream.next ) ;
+		delete[] stream.next.prev ;
+		delete[] stream.next.next ;
+		AdvanceSampleStream( stream, alignments ) ;
+	}
+	if ( sample.subexons.size() > 0 )
+	{
+		struct _chromRange r ;
+		r.chrId = chrId ;
+		r.begin = 0 ;
+		r.end = sample.subexons.size() ;
+		sample.chromRanges.push_back( r ) ;
+	}
+}
+
+struct _readSampleStreamThreadArg
+{
+	std::vector<struct _sampleStream *> *streams ;
+	std::vector<struct _sampleData> *samples ;
+	int chrId ;
+	Alignments *alignments ;
+	int *nextJob ;
+	pthread_mutex_t *lock ;
+} ;
+
+void *ReadSampleStreamChrom_Thread( void *pArg )
+{
+	struct _readSampleStreamThreadArg &arg = *( (struct _readSampleStreamThreadArg *)pArg ) ;
+	int fileCnt = arg.streams->size() ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextJob ) ;
+		++*( arg.nextJob ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= fileCnt )
+			break ;
+		ReadSampleStreamChrom( *( *arg.streams )[k], arg.chrId, *arg.alignments, ( *arg.samples )[k] ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// Read chromosome chrId from every sample, in parallel over the samples.
+void ReadSampleStreamsChrom( std::vector<struct _sampleStream *> &streams, int chrId, Alignments &alignments, 
+	std::vector<struct _sampleData> &samples, int numThreads )
+{
+	int i ;
+	int fileCnt = streams.size() ;
+	int threadCnt = numThreads < fileCnt ? numThreads : fileCnt ;
+	if ( threadCnt <= 1 )
+	{
+		for ( i = 0 ; i < fileCnt ; ++i )
+			ReadSampleStreamChrom( *streams[i], chrId, alignments, samples[i] ) ;
+		return ;
+	}
+
+	int nextJob = 0 ;
+	pthread_t *threads = new pthread_t[ threadCnt ] ;
+	pthread_attr_t attr ;
+	pthread_mutex_t lock ;
+	pthread_attr_init( &attr ) ;
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE ) ;
+	pthread_mutex_init( &lock, NULL ) ;
+	struct _readSampleStreamThreadArg arg ;
+	arg.streams = &streams ;
+	arg.samples = &samples ;
+	arg.chrId = chrId ;
+	arg.alignments = &alignments ;
+	arg.nextJob = &nextJob ;
+	arg.lock = &lock ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_create( &threads[i], &attr, ReadSampleStreamChrom_Thread, (void *)&arg ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &attr ) ;
+	pthread_mutex_destroy( &lock ) ;
+	delete[] threads ;
+}
+
+int main( int argc, char *argv[] )
+{
+	int i, k ;
+	int numThreads = 1 ;
+	bool stream = false ;
+	int64_t maxMemory = 4096 ; // in MB
+	char *depthMatrixFile = NULL ;
+	std::vector<char *> files ;
+
+	Alignments alignments ;
+
+	if ( argc == 1 )
+	{
+		printf( "%s", usage ) ;
+		return 0 ;
+	}
+
+	for ( i = 1 ; i < argc ; ++i )
+	{
+		if ( !strcmp( argv[i], "-s" ) )
+		{
+			files.push_back( argv[i + 1] ) ;
+			++i ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--ls" ) )
+		{
+			FILE *fpLs = fopen( argv[i + 1], "r" ) ;
+			char buffer[1024] ;
+			while ( fgets( buffer, sizeof( buffer ), fpLs ) != NULL )
+			{
+				int len = strlen( buffer ) ;
+				if ( buffer[len - 1] == '\n' )
+				{
+					buffer[len - 1] = '\0' ;
+					--len ;
+
+				}
+				char *fileName = strdup( buffer ) ;
+				files.push_back( fileName ) ;
+			}
+		}
+		else if ( !strcmp( argv[i], "-p" ) )
+		{
+			numThreads = atoi( argv[i + 1] ) ;
+			if ( numThreads < 1 )
+				numThreads = 1 ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--stream" ) )
+		{
+			stream = true ;
+		}
+		else if ( !strcmp( argv[i], "--maxMemory" ) )
+		{
+			maxMemory = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--depthMatrix" ) )
+		{
+			depthMatrixFile = argv[i + 1] ;
+			++i ;
+		}
+	}
+	int fileCnt = files.size() ;
+	// Obtain the chromosome ids through bam file.
+	SubexonFile subexonFile ;
+	if ( !subexonFile.Open( files[0] ) )
+	{
+		fprintf( stderr, "Could not open file %s.\n", files[0] ) ;
+		exit( 1 ) ;
+	}
+	if ( subexonFile.GetHeaderLineCount() > 0 )
+	{
+		strcpy( buffer, subexonFile.GetHeaderLine( 0 ) + 1 ) ;
+		alignments.Open( buffer ) ;
+	}
+	subexonFile.Close() ;
+
+	std::vector<struct _sampleData> samples( fileCnt ) ;
+	std::vector<struct _sampleStream *> streams ;
+	if ( stream )
+	{
+		// Only the headers are read now.
+		streams.resize( fileCnt ) ;
+		for ( k = 0 ; k < fileCnt ; ++k )
+		{
+			streams[k] = new struct _sampleStream ;
+			if ( !streams[k]->file.Open( files[k] ) )
+			{
+				fprintf( stderr, "Could not open file %s.\n", files[k] ) ;
+				exit( 1 ) ;
+			}
+			ParseSampleStats( streams[k]->file, samples[k].stats ) ;
+			AdvanceSampleStream( *streams[k], alignments ) ;
+		}
+	}
+	else
+	{
+		// Read each subexon file once, in parallel.
+		int threadCnt = numThreads < fileCnt ? numThreads : fileCnt ;
+		if ( threadCnt <= 1 )
+		{
+			for ( k = 0 ; k < fileCnt ; ++k )
+				LoadSample( files[k], alignments, samples[k] ) ;
+		}
+		else
+		{
+			int nextJob = 0 ;
+			pthread_t *threads = new pthread_t[ threadCnt ] ;
+			pthread_attr_t attr ;
+			pthread_mutex_t lock ;
+			pthread_attr_init( &attr ) ;
+			pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE ) ;
+			pthread_mutex_init( &lock, NULL ) ;
+			struct _loadSampleThreadArg arg ;
+			arg.files = &files ;
+			arg.samples = &samples ;
+			arg.alignments = &alignments ;
+			arg.nextJob = &nextJob ;
+			arg.lock = &lock ;
+			for ( i = 0 ; i < threadCnt ; ++i )
+				pthread_create( &threads[i], &attr, LoadSample_Thread, (void *)&arg ) ;
+			for ( i = 0 ; i < threadCnt ; ++i )
+				pthread_join( threads[i], NULL ) ;
+			pthread_attr_destroy( &attr ) ;
+			pthread_mutex_destroy( &lock ) ;
+			delete[] threads ;
+		}
+	}
+
+	// Go through all the files to get some statistics number
+	double avgIrPiRatio = 0 ;
+	double avgOverhangPiRatio = 0 ;
+	struct _sampleStats current ; // the parameters of the last sample that has them.
+	memset( &current, 0, sizeof( current ) ) ;
+	for ( k = 0 ; k < fileCnt ; ++k )
+	{
+		struct _sampleStats &stats = samples[k].stats ;
+		if ( stats.hasIrRatio )
+		{
+			avgIrPiRatio += stats.irRatio.pi ;
+			current.irRatio = stats.irRatio ;
+		}
+		if ( stats.hasOverhangRatio )
+		{
+			avgOverhangPiRatio += stats.overhangRatio.pi ;
+			current.overhangRatio = stats.overhangRatio ;
+		}
+	}
+	avgIrPiRatio /= fileCnt ;
+	avgOverhangPiRatio /= fileCnt ;
+	// A sample missing some parameters uses the ones read before it, as when the files were read in turn.
+	for ( k = 0 ; k < fileCnt ; ++k )
+	{
+		struct _sampleStats &stats = samples[k].stats ;
+		if ( stats.hasIrRatio )
+			current.irRatio = stats.irRatio ;
+		else
+			stats.irRatio = current.irRatio ;
+		if ( stats.hasIrCov )
+			current.irCov = stats.irCov ;
+		else
+			stats.irCov = current.irCov ;
+		if ( stats.hasOverhangRatio )
+			current.overhangRatio = stats.overhangRatio ;
+		else
+			stats.overhangRatio = current.overhangRatio ;
+		if ( stats.hasOverhangCov )
+			current.overhangCov = stats.overhangCov ;
+		else
+			stats.overhangCov = current.overhangCov ;
+	}
+
+	FILE *fpDepth = NULL ;
+	SubexonDepthMatrixWriter *depthWriter = NULL ;
+	if ( depthMatrixFile != NULL )
+	{
+		fpDepth = fopen( depthMatrixFile, "w" ) ;
+		if ( fpDepth == NULL )
+		{
+			fprintf( stderr, "Could not open file %s.\n", depthMatrixFile ) ;
+			exit( 1 ) ;
+		}
+		depthWriter = new SubexonDepthMatrixWriter ;
+		depthWriter->Open( fpDepth, fileCnt ) ;
+	}
+
+	if ( stream )
+	{
+		// k-way merge the sorted files by chromosome. The chromosomes are loaded until they
+		// fill maxMemory or the threads, and then combined; a chromosome is loaded alone if it needs more.
+		int lastChrom = -1 ;
+		while ( 1 )
+		{
+			std::vector<int> chroms ;
+			std::vector< std::vector<struct _sampleData> * > chromSamples ;
+			std::vector<int64_t> chromSize ;
+			int64_t memory = 0 ;
+			while ( chroms.size() == 0 || ( memory < maxMemory * 1024 * 1024 && (int)chroms.size() < numThreads ) )
+			{
+				int c = -1 ;
+				for ( k = 0 ; k < fileCnt ; ++k )
+					if ( streams[k]->hasNext && ( c == -1 || streams[k]->next.chrId < c ) )
+						c = streams[k]->next.chrId ;
+				if ( c == -1 )
+					break ;
+				if ( c <= lastChrom )
+				{
+					fprintf( stderr, "The subexon files are not sorted by chromosome in the same order; run without --stream.\n" ) ;
+					exit( 1 ) ;
+				}
+				lastChrom = c ;
+
+				std::vector<struct _sampleData> *cs = new std::vector<struct _sampleData>( fileCnt ) ;
+				for ( k = 0 ; k < fileCnt ; ++k )
+					( *cs )[k].stats = samples[k].stats ;
+				ReadSampleStreamsChrom( streams, c, alignments, *cs, numThreads ) ;
+				int64_t size = 0 ;
+				for ( k = 0 ; k < fileCnt ; ++k )
+				{
+					size += ( *cs )[k].subexons.size() ;
+					memory += GetSampleMemory( ( *cs )[k] ) ;
+				}
+				chroms.push_back( c ) ;
+				chromSamples.push_back( cs ) ;
+				chromSize.push_back( size ) ;
+			}
+			if ( chroms.size() == 0 )
+				break ;
+
+			CombineChroms( chroms, chromSamples, chromSize, avgIrPiRatio, avgOverhangPiRatio, alignments, numThreads, stdout, 
+			depthWriter ) ;
+			int size = chromSamples.size() ;
+			for ( i = 0 ; i < size ; ++i )
+				delete chromSamples[i] ;
+		}
+		for ( k = 0 ; k < fileCnt ; ++k )
+			delete streams[k] ;
+	}
+	else
+	{
+		// Collect the chromosomes showing up in any sample.
+		int chrCnt = alignments.GetChromCount() ;
+		std::vector<int64_t> chrSize( chrCnt, 0 ) ;
+		for ( k = 0 ; k < fileCnt ; ++k )
+		{
+			int size = samples[k].chromRanges.size() ;
+			for ( i = 0 ; i < size ; ++i )
+				chrSize[ samples[k].chromRanges[i].chrId ] += samples[k].chromRanges[i].end - samples[k].chromRanges[i].begin ;
+		}
+		std::vector<int> chroms ;
+		std::vector< std::vector<struct _sampleData> * > chromSamples ;
+		std::vector<int64_t> chromSize ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+			if ( chrSize[i] > 0 )
+			{
+				chroms.push_back( i ) ;
+				chromSamples.push_back( &samples ) ;
+				chromSize.push_back( chrSize[i] ) ;
+			}
+		CombineChroms( chroms, chromSamples, chromSize, avgIrPiRatio, avgOverhangPiRatio, alignments, numThreads, stdout, 
+			depthWriter ) ;
+	}
+
+	if ( depthWriter != NULL )
+	{
+		depthWriter->Close() ;
+		fclose( fpDepth ) ;
+		delete depthWriter ;
+	}
+	return 0 ;
+}
@@ -359,6 +359,14 @@ public:
 		pAlignments = c.pAlignments ;
 	}
 
+	// Hand the constraints over to c without copying the bit tables. We get the ones c held,
+	// which are released when we build the next constraints.
+	void Swap( Constraints &c )
+	{
+		constraints.swap( c.constraints ) ;
+		matePairs.swap( c.matePairs ) ;
+	}
+
 	void DownsampleConstraintsFrom( Constraints &c, int stride = 10 )
 	{
 		int i ;
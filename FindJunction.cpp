@@ -9,27 +9,47 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
 
 #include "sam.h"
 
 #define LINE_SIZE 4097
 #define QUEUE_SIZE 10001
 #define HASH_MAX 1000003
+#define MAX_CIGAR_SEG 1000
 
-struct _readTree
+// A read registered on a junction, or a contradicted read.
+struct _readNode
 {
-	char id[256] ;
+	uint64_t fingerprint ; // the hash of the read id and pos.
+	int idOffset ; // where the read id is in the registry.
 	int leftAnchor, rightAnchor ;
 	int pos ;
 	//bool secondary ;
 	bool valid ;
 	int editDistance ;
 	int NH, cnt ; // if cnt < NH, then it has real secondary match for this splice junction 
-	struct _readTree *left, *right ;
 
 	int flag ;// The flag from sam head.
 } ;
 
+// The reads in an open-addressing hash on the fingerprints. The nodes and the read ids are 
+// kept in arrays of the registry, and released together by ClearReadRegistry.
+struct _readRegistry
+{
+	struct _readNode *nodes ;
+	int nodeCnt, nodeCap ;
+	int *slots ; // the index in nodes plus 1, 0 for empty. 
+	int slotCap ; // a power of 2
+	char *ids ;
+	int idLen, idCap ;
+} ;
+
 // The structure of a junction
 struct _junction
 {
@@ -40,30 +60,33 @@ struct _junction
 	int leftAnchor, rightAnchor ; // The longest left and right anchor
 	int oppositeAnchor ; // The longest anchor of the shorter side.
 	int uniqEditDistance, secEditDistance ;
-	struct _readTree head ;
+	struct _readRegistry reads ;
 } ;
 
-char line[LINE_SIZE] ;
-char col[11][LINE_SIZE] ; // The option fields is not needed.
-char strand ; // Extract XS field
-char noncanonStrandInfo ;
+// The state of the current read and chromosome is per thread, since -p finds the junctions 
+// of different chromosomes in parallel.
+__thread char line[LINE_SIZE] ;
+__thread char col[11][LINE_SIZE] ; // The option fields is not needed.
+__thread char strand ; // Extract XS field
+__thread char noncanonStrandInfo ;
 //bool secondary ;
-int NH ;
-int editDistance ;
-int mateStart ;
+__thread int NH ;
+__thread int editDistance ;
+__thread int mateStart ;
 int filterYS ;
-int samFlag ;
+__thread int samFlag ;
 
-struct _junction junctionQueue[QUEUE_SIZE] ; // Expected only a few junctions in it for each read. This queue is sorted.
+__thread struct _junction junctionQueue[QUEUE_SIZE] ; // Expected only a few junctions in it for each read. This queue is sorted.
 
-int qHead, qTail ;
+__thread int qHead, qTail ;
+__thread FILE *fpOut ; // where the junctions go.
 
 bool flagPrintJunction ;
 bool flagPrintAll ;
 bool flagStrict ; 
-int junctionCnt ;
+__thread int junctionCnt ;
 bool anchorBoth ; 
-bool validRead ;
+__thread bool validRead ;
 
 int flank ;
 struct _cigarSeg
@@ -72,7 +95,10 @@ struct _cigarSeg
 	char type ;
 } ;
 
-struct _readTree *contradictedReads ;
+__thread struct _readRegistry contradictedReads ;
+__thread uint64_t readIdHash ; // the hash of col[0]
+__thread struct _cigarSeg cigarSeg[MAX_CIGAR_SEG + 1] ; // The cigar of current read. 
+__thread int ccnt ; // cigarSeg cnt
 
 char nucToNum[26] = { 0, 4, 1, 4, 4, 4, 2, 
 	4, 4, 4, 4, 4, 4, 4,
@@ -84,20 +110,24 @@ void PrintHelp()
 	printf( 
 		"Prints reads from the SAM/BAM file that containing junctions.\n" 
 		"Usage: ./a.out input [option]>output\n"
+		"       ./a.out --lb list [option]\n"
 		"Options:\n"
 	    "\t-j xx [-B]: Output the junctions using 1-based coordinates. The format is \"reference id\" start end \"# of read\" strand.(They are sorted)\n and the xx is an integer means the maximum unqualified anchor length for a splice junction(default=8). If -B, the splice junction must be supported by a read whose both anchors are longer than xx.\n"
 	    "\t-a: Output all the junctions, and use non-positive support number to indicate unqualified junctions.\n"
 	    "\t-y: If the bits from YS field of bam matches the argument, we filter the alignment (default: 4).\n"
+	    "\t-p: Number of threads. The chromosomes are processed in parallel if the BAM file is indexed (default: 1).\n"
+	    "\t--lb: Each line of the list is an alignment file and its output file. The samples are processed in parallel with -p, the largest first.\n"
 	      ) ;
 }
 
-void GetJunctionInfo( struct _junction &junc, struct _readTree *p )
+void GetJunctionInfo( struct _junction &junc )
 {
-	if ( p == NULL )
-		return ;
-
-	if ( p->valid )
+	int i ;
+	for ( i = 0 ; i < junc.reads.nodeCnt ; ++i )
 	{
+		struct _readNode *p = &junc.reads.nodes[i] ;
+		if ( !p->valid )
+			continue ;
 		//if ( junc.start == 22381343 + 1 && junc.end == 22904987 - 1 )
 		//	printf( "%s %d %d %d\n", p->id, p->leftAnchor, p->rightAnchor, p->flag ) ;
 		
@@ -141,19 +171,14 @@ void GetJunctionInfo( struct _junction &junc, struct _readTree *p )
 				junc.oppositeAnchor = r ;
 		}
 	}
-	GetJunctionInfo( junc, p->left ) ;
-	GetJunctionInfo( junc, p->right ) ;
 }
 
-void PrintJunctionReads( struct _junction &junc, struct _readTree *p )
+void PrintJunctionReads( struct _junction &junc )
 {
-	if ( p == NULL )
-		return ;
-
-	if ( p->valid )
-		printf( "%s\n", p->id ) ;
-	PrintJunctionReads( junc, p->left ) ;
-	PrintJunctionReads( junc, p->right ) ;
+	int i ;
+	for ( i = 0 ; i < junc.reads.nodeCnt ; ++i )
+		if ( junc.reads.nodes[i].valid )
+			fprintf( fpOut, "%s\n", junc.reads.ids + junc.reads.nodes[i].idOffset ) ;
 }
 
 void PrintJunction( char *chrome, struct _junction &junc )
@@ -166,7 +191,7 @@ void PrintJunction( char *chrome, struct _junction &junc )
 	junc.secReadCnt = 0 ;
 	junc.uniqEditDistance = 0 ;
 	junc.secEditDistance = 0 ;
-	GetJunctionInfo( junc, &junc.head ) ;
+	GetJunctionInfo( junc ) ;
 
 	sum = junc.readCnt + junc.secReadCnt ;
 
@@ -194,137 +219,146 @@ void PrintJunction( char *chrome, struct _junction &junc )
 			junc.secReadCnt = 0 ;
 	}*/
 
-	printf( "%s %d %d %d %c %d %d %d %d\n", chrome, junc.start - 1, junc.end + 1, sum, junc.strand, 
+	fprintf( fpOut, "%s %d %d %d %c %d %d %d %d\n", chrome, junc.start - 1, junc.end + 1, sum, junc.strand, 
 		junc.readCnt, junc.secReadCnt, junc.uniqEditDistance, junc.secEditDistance ) ;
-	//PrintJunctionReads( junc, &junc.head ) ;
+	//PrintJunctionReads( junc ) ;
 }
 
-void ClearReadTree( struct _readTree *p )
+// FNV-1a hash of the read id.
+uint64_t ReadIdHash( const char *id )
 {
-	if ( p == NULL )
-		return ;
-	ClearReadTree( p->left ) ;
-	ClearReadTree( p->right ) ;
-	free( p ) ;
+	uint64_t h = 14695981039346656037ULL ;
+	for ( ; *id ; ++id )
+	{
+		h ^= (unsigned char)*id ;
+		h *= 1099511628211ULL ;
+	}
+	return h ;
 }
 
-// Insert to the read tree
-bool InsertReadTree( struct _readTree *p, char *id, int l, int r )
+uint64_t ReadFingerprint( uint64_t idHash, int pos )
 {
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 )
-	{
-		p->cnt += 1 ;
-		return true ;
-	}
-	else if ( tmp < 0 )
-	{
-		if ( p->left )
-			return InsertReadTree( p->left, id, l, r ) ;
-		else
-		{
-			p->left = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->left->id, id ) ;
-			p->left->leftAnchor = l ;
-			p->left->rightAnchor = r ;
-			//p->left->secondary = secondary ;
-			p->left->editDistance = editDistance ;
-			p->left->left = p->left->right = NULL ;
-			p->left->valid = validRead ;
-			p->left->cnt = 1 ;
-			p->left->NH = NH ;
-			p->left->flag = samFlag ;
-			return false ;
-		}
-	}
-	else
-	{
-		if ( p->right )
-			return InsertReadTree( p->right, id, l, r ) ;
-		else
-		{
-			p->right = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->right->id, id ) ;
-			p->right->leftAnchor = l ;
-			p->right->rightAnchor = r ;
-			//p->right->secondary = secondary ;
-			p->right->editDistance = editDistance ;
-			p->right->left = p->right->right = NULL ;
-			p->right->valid = validRead ;
-			p->right->cnt = 1 ;
-			p->right->NH = NH ;
-			p->right->flag = samFlag ;
-			return false ;
-		}
-	}
+	uint64_t h = idHash ^ ( (uint64_t)(unsigned int)pos * 0x9E3779B97F4A7C15ULL ) ;
+	h ^= h >> 29 ;
+	return h ;
 }
 
+void InitReadRegistry( struct _readRegistry &reg )
+{
+	reg.nodes = NULL ;
+	reg.nodeCnt = reg.nodeCap = 0 ;
+	reg.slots = NULL ;
+	reg.slotCap = 0 ;
+	reg.ids = NULL ;
+	reg.idLen = reg.idCap = 0 ;
+}
 
-bool SearchContradictedReads( struct _readTree *p, char *id, int pos )
+void ClearReadRegistry( struct _readRegistry &reg )
 {
-	if ( p == NULL )
-		return false ;
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 && p->pos == pos )
-		return true ;
-	else if ( tmp <= 0 )
-		return SearchContradictedReads( p->left, id, pos ) ;
-	else
-		return SearchContradictedReads( p->right, id, pos ) ;
+	free( reg.nodes ) ;
+	free( reg.slots ) ;
+	free( reg.ids ) ;
+	InitReadRegistry( reg ) ;
 }
 
-bool InsertContradictedReads( struct _readTree *p, char *id, int pos )
+// Return the slot holding the read, or the empty slot where it should go.
+int SearchReadSlot( struct _readRegistry &reg, uint64_t fingerprint, char *id, int pos )
 {
-	if ( p == NULL )
+	int mask = reg.slotCap - 1 ;
+	int i = fingerprint & mask ;
+	while ( reg.slots[i] )
 	{
-		contradictedReads = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-		strcpy( contradictedReads->id, id ) ;
-		contradictedReads->pos = pos ;
-		contradictedReads->left = contradictedReads->right = NULL ;
-		return false ;
+		struct _readNode &n = reg.nodes[ reg.slots[i] - 1 ] ;
+		if ( n.fingerprint == fingerprint && n.pos == pos && !strcmp( reg.ids + n.idOffset, id ) )
+			break ;
+		i = ( i + 1 ) & mask ;
 	}
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 && p->pos == pos )
-		return true ;
-	else if ( tmp <= 0 )
+	return i ;
+}
+
+struct _readNode *SearchReadRegistry( struct _readRegistry &reg, char *id, int pos )
+{
+	if ( reg.nodeCnt == 0 )
+		return NULL ;
+	int i = SearchReadSlot( reg, ReadFingerprint( readIdHash, pos ), id, pos ) ;
+	if ( reg.slots[i] )
+		return &reg.nodes[ reg.slots[i] - 1 ] ;
+	return NULL ;
+}
+
+// Add the read to the registry if it is not there.
+// Return the node of the read, and set found to whether it was already there. 
+struct _readNode *InsertReadRegistry( struct _readRegistry &reg, char *id, int pos, bool &found )
+{
+	int i ;
+	uint64_t fingerprint = ReadFingerprint( readIdHash, pos ) ;
+	if ( 2 * ( reg.nodeCnt + 1 ) > reg.slotCap )
 	{
-		if ( p->left )
-			return InsertContradictedReads( p->left, id, pos ) ;
-		else
+		// Rehash into a larger table.
+		int slotCap = reg.slotCap ? 2 * reg.slotCap : 16 ;
+		free( reg.slots ) ;
+		reg.slotCap = slotCap ;
+		reg.slots = (int *)calloc( slotCap, sizeof( int ) ) ;
+		for ( i = 0 ; i < reg.nodeCnt ; ++i )
 		{
-			p->left = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->left->id, id ) ;
-			p->left->pos = pos ;
-			p->left->left = p->left->right = NULL ;
-			return false ;
+			int k = reg.nodes[i].fingerprint & ( slotCap - 1 ) ;
+			while ( reg.slots[k] )
+				k = ( k + 1 ) & ( slotCap - 1 ) ;
+			reg.slots[k] = i + 1 ;
 		}
 	}
-	else
+
+	i = SearchReadSlot( reg, fingerprint, id, pos ) ;
+	if ( reg.slots[i] )
 	{
-		if ( p->right )
-			return InsertContradictedReads( p->right, id, pos ) ;
-		else
-		{
-			p->right = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->right->id, id ) ;
-			p->right->pos = pos ;
-			p->right->left = p->right->right = NULL ;
-			return false ;
-		}
+		found = true ;
+		return &reg.nodes[ reg.slots[i] - 1 ] ;
 	}
+
+	found = false ;
+	if ( reg.nodeCnt >= reg.nodeCap )
+	{
+		reg.nodeCap = reg.nodeCap ? 2 * reg.nodeCap : 8 ;
+		reg.nodes = (struct _readNode *)realloc( reg.nodes, sizeof( struct _readNode ) * reg.nodeCap ) ;
+	}
+	int len = strlen( id ) + 1 ;
+	if ( reg.idLen + len > reg.idCap )
+	{
+		reg.idCap = reg.idCap ? 2 * reg.idCap : 256 ;
+		if ( reg.idCap < reg.idLen + len )
+			reg.idCap = reg.idLen + len ;
+		reg.ids = (char *)realloc( reg.ids, reg.idCap ) ;
+	}
+	struct _readNode &n = reg.nodes[ reg.nodeCnt ] ;
+	n.fingerprint = fingerprint ;
+	n.idOffset = reg.idLen ;
+	n.pos = pos ;
+	memcpy( reg.ids + reg.idLen, id, len ) ;
+	reg.idLen += len ;
+	reg.slots[i] = reg.nodeCnt + 1 ;
+	++reg.nodeCnt ;
+	return &n ;
 }
 
-struct _readTree *GetReadTreeNode( struct _readTree *p, char *id )
+// Insert the read of current alignment to the junction 
+bool InsertJunctionRead( struct _junction &junc, char *id, int l, int r )
 {
-	if ( p == NULL )
-		return NULL ;
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 )
-		return p ;
-	else if ( tmp < 0 )
-		return GetReadTreeNode( p->left, id ) ;
-	else
-		return GetReadTreeNode( p->right, id ) ;
+	bool found ;
+	struct _readNode *p = InsertReadRegistry( junc.reads, id, -1, found ) ;
+	if ( found )
+	{
+		p->cnt += 1 ;
+		return true ;
+	}
+	p->leftAnchor = l ;
+	p->rightAnchor = r ;
+	//p->secondary = secondary ;
+	p->editDistance = editDistance ;
+	p->valid = validRead ;
+	p->cnt = 1 ;
+	p->NH = NH ;
+	p->flag = samFlag ;
+	return false ;
 }
 
 // Insert the new junction into the queue, 
@@ -370,15 +404,8 @@ void InsertQueue( int start, int end, int l, int r )
 	junctionQueue[i].leftAnchor = l ;
 	junctionQueue[i].rightAnchor = r ;
 	
-	strcpy( junctionQueue[i].head.id, col[0] ) ;
-	junctionQueue[i].head.valid = validRead ;
-	junctionQueue[i].head.leftAnchor = l ;
-	junctionQueue[i].head.rightAnchor = r ;
-	junctionQueue[i].head.left = junctionQueue[i].head.right = NULL ;
-	//junctionQueue[i].head.secondary = secondary ;
-	junctionQueue[i].head.NH = NH ;
-	junctionQueue[i].head.cnt = 1 ;
-	junctionQueue[i].head.editDistance = editDistance ;
+	InitReadRegistry( junctionQueue[i].reads ) ;
+	InsertJunctionRead( junctionQueue[i], col[0], l, r ) ;
 
 	++qTail ;
 	if ( qTail >= QUEUE_SIZE )
@@ -396,12 +423,12 @@ bool SearchQueue( int start, int end, int prune, int l, int r )
 	i = qHead ;
 	while ( i != qTail )
 	{
-		struct _readTree *rt ;
+		struct _readNode *rt ;
 		if ( ( junctionQueue[i].start == start && junctionQueue[i].end < end ) ||
 			( junctionQueue[i].start > start && junctionQueue[i].end == end ) )
 		{
 			// This alignment is false ;
-			rt = GetReadTreeNode( &junctionQueue[i].head, col[0] ) ;
+			rt = SearchReadRegistry( junctionQueue[i].reads, col[0], -1 ) ;
 			// the commented out logic because it is handled by contradicted reads
 			if ( rt != NULL ) //&& ( rt->flag & 0x40 ) != ( samFlag & 0x40 ) )
 			{
@@ -424,7 +451,7 @@ bool SearchQueue( int start, int end, int prune, int l, int r )
 			( junctionQueue[i].start < start && junctionQueue[i].end == end ) )
 		{
 			// This other alignment is false ;
-			rt = GetReadTreeNode( &junctionQueue[i].head, col[0] ) ;
+			rt = SearchReadRegistry( junctionQueue[i].reads, col[0], -1 ) ;
 			//if ( rt != NULL )
 			if ( rt != NULL ) //&& ( rt->flag & 0x40 ) != ( samFlag & 0x40 ) )
 			{
@@ -457,7 +484,7 @@ bool SearchQueue( int start, int end, int prune, int l, int r )
 			{
 				junctionQueue[i].strand = strand ;
 			}
-			InsertReadTree( &junctionQueue[i].head, col[0], l, r ) ; 
+			InsertJunctionRead( junctionQueue[i], col[0], l, r ) ; 
 			return true ;
 		}
 		
@@ -465,8 +492,7 @@ bool SearchQueue( int start, int end, int prune, int l, int r )
 		{
 			// pop
 			PrintJunction( col[2], junctionQueue[i] ) ;
-			ClearReadTree( junctionQueue[i].head.left ) ;
-			ClearReadTree( junctionQueue[i].head.right ) ;
+			ClearReadRegistry( junctionQueue[i].reads ) ;
 			++qHead ;
 			if ( qHead >= QUEUE_SIZE )
 				qHead = 0 ;
@@ -480,22 +506,13 @@ bool SearchQueue( int start, int end, int prune, int l, int r )
 	return false ;
 }
 
-// Compute the junctions based on the CIGAR  
-bool CompareJunctions( int startLocation, char *cigar )
+// Parse the cigar string into cigarSeg
+void ParseCigar( char *cigar )
 {
-	int currentLocation = startLocation ; // Current location on the reference genome
-	int i, j ;
-	int num ;
-	int newJuncCnt = 0 ; // The # of junctions in the read, and the # of new junctions among them.
-	
-	struct _cigarSeg cigarSeg[1000] ; // A segment of the cigar.
-	int ccnt = 0 ; // cigarSeg cnt
-
-	j = 0 ;
-	num = 0 ;
-	validRead = true ;
-
-	for ( i = 0 ; cigar[i] ; ++i )
+	int i ;
+	int num = 0 ;
+	ccnt = 0 ;
+	for ( i = 0 ; cigar[i] && ccnt < MAX_CIGAR_SEG ; ++i )
 	{
 		if ( cigar[i] >= '0' && cigar[i] <= '9' )
 		{
@@ -509,6 +526,32 @@ bool CompareJunctions( int startLocation, char *cigar )
 			num = 0 ;
 		}
 	}
+	cigarSeg[ccnt].type = '\0' ;
+}
+
+// Convert the binary cigar of a BAM record into cigarSeg 
+void ParseBamCigar( bam1_core_t *c, uint32_t *cigar )
+{
+	int k ;
+	ccnt = 0 ;
+	for ( k = 0 ; k < c->n_cigar && ccnt < MAX_CIGAR_SEG ; ++k )
+	{
+		cigarSeg[ccnt].len = cigar[k] >> BAM_CIGAR_SHIFT ;
+		cigarSeg[ccnt].type = bam_cigar_opchr( cigar[k] ) ;
+		++ccnt ;
+	}
+	cigarSeg[ccnt].type = '\0' ;
+}
+
+// Compute the junctions based on the CIGAR in cigarSeg
+bool CompareJunctions( int startLocation )
+{
+	int currentLocation = startLocation ; // Current location on the reference genome
+	int i, j ;
+	int newJuncCnt = 0 ; // The # of junctions in the read, and the # of new junctions among them.
+	
+	j = 0 ;
+	validRead = true ;
 
 	// Filter low complex alignment.
 	// Only applies this to alignments does not have a strand information.
@@ -618,7 +661,8 @@ bool CompareJunctions( int startLocation, char *cigar )
 				}*/
 					// ignore this read
 					//return false ;
-					InsertContradictedReads( contradictedReads, col[0], mateStart ) ;
+					bool found ;
+					InsertReadRegistry( contradictedReads, col[0], mateStart, found ) ;
 					validRead = false ;
 					break ;
 				}
@@ -632,7 +676,7 @@ bool CompareJunctions( int startLocation, char *cigar )
 		{
 			if ( mateStart < junctionQueue[i].start && junctionQueue[i].start <= startLocation 
 				&& startLocation <= junctionQueue[i].end 
-				&& SearchContradictedReads( contradictedReads, col[0], startLocation ) )
+				&& SearchReadRegistry( contradictedReads, col[0], startLocation ) != NULL )
 			{
 				validRead = false ;
 				break ;
@@ -717,178 +761,53 @@ bool CompareJunctions( int startLocation, char *cigar )
 		return false ;
 }
 
-void cigar2string( bam1_core_t *c, uint32_t *in_cigar, char *out_cigar )
-{
-	int k, op, l ;
-	char opcode ;
-
-	*out_cigar = '\0' ;
-	for ( k = 0 ; k < c->n_cigar ; ++k )
-	{
-		op = in_cigar[k] & BAM_CIGAR_MASK ;
-		l = in_cigar[k] >> BAM_CIGAR_SHIFT ;
-		switch (op)
-		{
-			case BAM_CMATCH: opcode = 'M' ; break ;
-			case BAM_CINS: opcode = 'I' ; break ;
-			case BAM_CDEL: opcode = 'D' ; break ;
-			case BAM_CREF_SKIP: opcode = 'N' ; break ;
-			case BAM_CSOFT_CLIP: opcode = 'S' ; break ;
-			case BAM_CHARD_CLIP: opcode = 'H' ; break ;
-			case BAM_CPAD: opcode = 'P' ; break ;
-		}
-		sprintf( out_cigar + strlen( out_cigar ), "%d%c", l, opcode ) ;
-	}
-}
-
-
-
-int main( int argc, char *argv[] ) 
+// Find the junctions from the BAM records of fpsam (the region of iter if it is not NULL), 
+// or from the SAM text in fp if fpsam is NULL. 
+void FindJunctions( samfile_t *fpsam, bam_iter_t iter, FILE *fp, bool hasMateReadIdSuffix, bool flagRemove, FILE *out )
 {
-	FILE *fp ;
- 	samfile_t *fpsam ;
-	bam1_t *b = NULL ;
-	bool useSam = true ;
-
- 	int i, len ;
- 	int startLocation ; 
-	bool flagRemove = false ;
+	int i ;
+	int startLocation ;
 	char prevChrome[103] ;
+	bam1_t *b = NULL ;
 
-	anchorBoth = false ;	
-	
-	flagPrintJunction = false ;
-	flagPrintAll = false ;
-	flagStrict = false ;
-	junctionCnt = 0 ;
-	bool hasMateReadIdSuffix = false ;
-
+	if ( fpsam )
+		b = bam_init1() ;
 	strcpy( prevChrome, "" ) ;
-	flagRemove = true ;
-	flagPrintJunction = true ;
-	flank = 8 ;
-	filterYS = 4 ;
-
-	contradictedReads = NULL ;
-	
-	// processing the argument list
-	for ( i = 1 ; i < argc ; ++i )
-	{
-		if ( !strcmp( argv[i], "-h" ) )
-		{
-			PrintHelp() ;
-			return 0 ;
-		}
-		else if ( !strcmp( argv[i], "-r" ) )
-		{
-			flagRemove = true ;
-		}
-		else if ( !strcmp( argv[i], "-j" ) )
-		{
-			strcpy( prevChrome, "" ) ;
-			flagRemove = true ;
-			flagPrintJunction = true ;
-			flank = atoi( argv[i + 1] ) ;
-			if ( i + 2 < argc && !strcmp( argv[i+2], "-B" ) )
-			{
-				anchorBoth = true ;
-				++i ;		
-			}
-			++i ;
-		}
-		else if ( !strcmp( argv[i], "-a" ) )
-		{
-			flagPrintAll = true ;
-		}
-		else if ( !strcmp( argv[i], "--strict" ) )
-		{
-			flagStrict = true ;
-		}
-		else if ( !strcmp( argv[i], "-y" ) )
-		{
-			filterYS = atoi( argv[i + 1] ) ;
-			++i ;
-		}
-		else if ( !strcmp( argv[i], "--hasMateIdSuffix" ) )
-		{
-			hasMateReadIdSuffix = true ;
-			++i ;
-		}
-		else if ( i > 1 )
-		{
-			printf( "Unknown option %s\n", argv[i] ) ;
-			exit( 1 ) ;
-		}
-	}
-	if ( argc == 1 )
-	{
-		PrintHelp() ;
-		return 0 ;
-	}
-
-	len = strlen( argv[1] ) ;
-	if ( argv[1][len-3] == 'b' || argv[1][len-3] == 'B' )
-	{	
-		if ( !( fpsam = samopen( argv[1], "rb", 0 ) ) )
-			return 0 ;
-
-		if ( !fpsam->header )
-		{
-			//samclose( fpsam ) ;
-			//fpsam = samopen( argv[1], "r", 0 ) ;
-			//if ( !fpsam->header )
-			//{
-			useSam = false ;
-			fp = fopen( argv[1], "r" ) ;
-			//}
-		}
-	}
-	else
-	{
-		useSam = false ;
-		fp = NULL ;
-		if ( !strcmp( argv[1], "-" ) )
-			fp = stdin ;
-		else
-			fp = fopen( argv[1], "r" ) ;
-		if ( fp == NULL )
-		{
-			printf( "Could not open file %s\n", argv[1] ) ;
-			return 0 ;
-		}
-	}
+	fpOut = out ;
+	qHead = qTail = 0 ;
+	InitReadRegistry( contradictedReads ) ;
 
 	while ( 1 )
 	{
 		int flag = 0 ;
-		if ( useSam )
+		if ( fpsam )
 		{
-			if ( b )
-				bam_destroy1( b ) ;
-			b = bam_init1() ;
-			if ( samread( fpsam, b ) <= 0 )
+			if ( ( iter ? bam_iter_read( fpsam->x.bam, iter, b ) : samread( fpsam, b ) ) <= 0 )
 				break ;
+			if ( b->core.l_qseq < 20 )
+				continue ;
+			
+			// Most reads are not spliced, so look at the binary cigar before decoding anything else.
+			uint32_t *cigar = bam1_cigar( b ) ;
+			for ( i = 0 ; i < b->core.n_cigar ; ++i )
+				if ( bam_cigar_op( cigar[i] ) == BAM_CREF_SKIP )
+					break ;
+			if ( i >= b->core.n_cigar )
+				continue ;
+			ParseBamCigar( &(b->core), cigar ) ;
+
 			if ( b->core.tid >= 0 )
 				strcpy( col[2], fpsam->header->target_name[b->core.tid] ) ;
 			else
 				strcpy( col[2], "-1" ) ;
-			cigar2string( &(b->core), bam1_cigar( b ), col[5] ) ;
 			strcpy( col[0], bam1_qname( b ) ) ;	
 			flag = b->core.flag ;	
 			if ( bam_aux_get( b, "NH" ) )
 			{	
-				/*if ( bam_aux2i( bam_aux_get(b, "NH" ) ) >= 2 )
-				{
-					secondary = true ;
-				}
-				else
-					secondary = false ;*/
-
 				NH = bam_aux2i( bam_aux_get( b, "NH" ) ) ;
 			}
 			else
 			{
-				//secondary = false ;
 				NH = 1 ;
 			}
 
@@ -908,29 +827,7 @@ int main( int argc, char *argv[] )
 				col[6][0] = '=' ;
 			else
 				col[6][0] = '*' ;		
-
-			if ( b->core.l_qseq < 20 )
-				continue ;
-			
-			for ( i = 0 ; i < b->core.l_qseq ; ++i )
-			{
-				int bit = bam1_seqi( bam1_seq( b ), i ) ;
-				switch ( bit )
-				{
-					case 1: col[9][i] = 'A' ; break ;
-					case 2: col[9][i] = 'C' ; break ;
-					case 4: col[9][i] = 'G' ; break ;
-					case 8: col[9][i] = 'T' ; break ;
-					case 15: col[9][i] = 'N' ; break ;
-					default: col[9][i] = 'A' ; break ;
-				}	
-			}
-			col[9][i] = '\0' ;
-
-			/*if ( flag & 0x100 )
-				secondary = true ;
-			else 
-				secondary = false ;*/
+			// The read sequence is decoded later, only if the low complexity filter needs it.
 		}
 		else
 		{
@@ -985,14 +882,15 @@ int main( int argc, char *argv[] )
 			else 
 				secondary = false ;*/
 			
+			for ( i = 0 ; col[5][i] ; ++i )
+				if ( col[5][i] == 'N' )
+					break ;
+
+			if ( !col[5][i] )
+				continue ;
+			ParseCigar( col[5] ) ;
 		}
 		samFlag = flag ;
-		for ( i = 0 ; col[5][i] ; ++i )
-			if ( col[5][i] == 'N' )
-				break ;
-
-		if ( !col[5][i] )
-			continue ;
 		
 		// remove .1, .2 or /1, /2 suffix
 		if ( hasMateReadIdSuffix )
@@ -1006,7 +904,7 @@ int main( int argc, char *argv[] )
 			}
 		}
 
-		if ( useSam )
+		if ( fpsam )
 		{
 			if ( bam_aux_get( b, "XS" ) )
 			{
@@ -1026,6 +924,24 @@ int main( int argc, char *argv[] )
 				noncanonStrandInfo = -1 ;
 			}
 			startLocation = b->core.pos + 1 ;
+
+			if ( strand == '?' && noncanonStrandInfo == -1 )
+			{
+				for ( i = 0 ; i < b->core.l_qseq ; ++i )
+				{
+					int bit = bam1_seqi( bam1_seq( b ), i ) ;
+					switch ( bit )
+					{
+						case 1: col[9][i] = 'A' ; break ;
+						case 2: col[9][i] = 'C' ; break ;
+						case 4: col[9][i] = 'G' ; break ;
+						case 8: col[9][i] = 'T' ; break ;
+						case 15: col[9][i] = 'N' ; break ;
+						default: col[9][i] = 'A' ; break ;
+					}	
+				}
+				col[9][i] = '\0' ;
+			}
 		}
 		else
 		{
@@ -1048,6 +964,8 @@ int main( int argc, char *argv[] )
 			startLocation = atoi( col[3] ) ;  
 		}
 		
+		readIdHash = ReadIdHash( col[0] ) ;
+		
 		// Found the junctions from the read.
 		if ( strcmp( prevChrome, col[2] ) )
 		{
@@ -1065,26 +983,32 @@ int main( int argc, char *argv[] )
 			}
 
 			// new chromosome
-			ClearReadTree( contradictedReads ) ;
-			contradictedReads = NULL ;
+			for ( i = qHead ; i != qTail ; )
+			{
+				ClearReadRegistry( junctionQueue[i].reads ) ;
+				++i ;
+				if ( i >= QUEUE_SIZE )
+					i = 0 ;
+			}
+			ClearReadRegistry( contradictedReads ) ;
 			qHead = qTail = 0 ;
 			strcpy( prevChrome, col[2] ) ;
 		}
 
 		if ( flagRemove )
 		{
-			if ( CompareJunctions( startLocation, col[5] ) )
+			if ( CompareJunctions( startLocation ) )
 			{
 				// Test whether this read has new junctions
 				//++junctionCnt ;
 				if ( !flagPrintJunction )
-					printf( "%s", line ) ;
+					fprintf( fpOut, "%s", line ) ;
 			}
 		}
 		else
 		{
 			++junctionCnt ;
-			printf( "%s", line ) ;
+			fprintf( fpOut, "%s", line ) ;
 		}
 		//printf( "hi2 %s\n", col[0] ) ;
 	}
@@ -1100,8 +1024,402 @@ int main( int argc, char *argv[] )
 			if ( i >= QUEUE_SIZE )
 				i = 0 ;
 		}
-	}	
+	}
+
+	for ( i = qHead ; i != qTail ; )
+	{
+		ClearReadRegistry( junctionQueue[i].reads ) ;
+		++i ;
+		if ( i >= QUEUE_SIZE )
+			i = 0 ;
+	}
+	ClearReadRegistry( contradictedReads ) ;
+	if ( b )
+		bam_destroy1( b ) ;
+}
+
+struct _findJunctionsThreadArg
+{
+	char *file ;
+	bam_index_t *index ;
+	int *chrOrder ; // the chromosomes from the longest one.
+	int chrCnt ;
+	int *nextChr ;
+	char **chrOut ; // the output of each chromosome that is found but not written yet.
+	size_t *chrOutSize ;
+	bool *chrDone ;
+	int *nextOut ; // the next chromosome to write in the order of the header.
+	FILE *out ;
+	bool hasMateReadIdSuffix ;
+	bool flagRemove ;
+	pthread_mutex_t *lock ;
+} ;
+
+void *FindJunctions_Thread( void *pArg )
+{
+	struct _findJunctionsThreadArg &arg = *( (struct _findJunctionsThreadArg *)pArg ) ;
+	samfile_t *fpsam = samopen( arg.file, "rb", 0 ) ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextChr ) ;
+		++*( arg.nextChr ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= arg.chrCnt )
+			break ;
+		
+		// The output of a chromosome is kept in memory, so no file descriptor is held for each chromosome.
+		int tid = arg.chrOrder[k] ;
+		char *buffer = NULL ;
+		size_t size = 0 ;
+		FILE *fpOut = open_memstream( &buffer, &size ) ;
+		if ( fpOut == NULL )
+		{
+			fprintf( stderr, "Could not allocate the output buffer.\n" ) ;
+			exit( 1 ) ;
+		}
+		bam_iter_t iter = bam_iter_query( arg.index, tid, 0, 1 << 29 ) ;
+		FindJunctions( fpsam, iter, NULL, arg.hasMateReadIdSuffix, arg.flagRemove, fpOut ) ;
+		bam_iter_destroy( iter ) ;
+		fclose( fpOut ) ;
+
+		// Write the finished chromosomes that are next in the order of the header.
+		pthread_mutex_lock( arg.lock ) ;
+		arg.chrOut[tid] = buffer ;
+		arg.chrOutSize[tid] = size ;
+		arg.chrDone[tid] = true ;
+		while ( *( arg.nextOut ) < arg.chrCnt && arg.chrDone[ *( arg.nextOut ) ] )
+		{
+			int j = *( arg.nextOut ) ;
+			fwrite( arg.chrOut[j], 1, arg.chrOutSize[j], arg.out ) ;
+			free( arg.chrOut[j] ) ;
+			arg.chrOut[j] = NULL ;
+			++*( arg.nextOut ) ;
+		}
+		pthread_mutex_unlock( arg.lock ) ;
+	}
+	samclose( fpsam ) ;
+	pthread_exit( NULL ) ;
+}
+
+__thread samfile_t *gFpsam ; // the file whose chromosomes are being sorted.
+bool CompChrByLength( int a, int b )
+{
+	return gFpsam->header->target_len[a] > gFpsam->header->target_len[b] ;
+}
+
+// Find the junctions of one alignment file and write them to out.
+void FindJunctionsInFile( char *file, int numThreads, bool hasMateReadIdSuffix, bool flagRemove, FILE *out )
+{
+	FILE *fp = NULL ;
+ 	samfile_t *fpsam ;
+	bool useSam = true ;
+	int i, len ;
+
+	len = strlen( file ) ;
+	if ( file[len-3] == 'b' || file[len-3] == 'B' )
+	{	
+		if ( !( fpsam = samopen( file, "rb", 0 ) ) )
+		{
+			fprintf( stderr, "Could not open file %s\n", file ) ;
+			return ;
+		}
+
+		if ( !fpsam->header )
+		{
+			//samclose( fpsam ) ;
+			//fpsam = samopen( file, "r", 0 ) ;
+			//if ( !fpsam->header )
+			//{
+			useSam = false ;
+			fp = fopen( file, "r" ) ;
+			//}
+			if ( fp == NULL )
+			{
+				fprintf( stderr, "Could not open file %s\n", file ) ;
+				samclose( fpsam ) ;
+				return ;
+			}
+		}
+	}
+	else
+	{
+		useSam = false ;
+		fp = NULL ;
+		if ( !strcmp( file, "-" ) )
+			fp = stdin ;
+		else
+			fp = fopen( file, "r" ) ;
+		if ( fp == NULL )
+		{
+			fprintf( stderr, "Could not open file %s\n", file ) ;
+			return ;
+		}
+	}
+
+	bam_index_t *index = NULL ;
+	if ( useSam && numThreads > 1 && ( fpsam->type & 1 ) && fpsam->header->n_targets > 1 )
+		index = bam_index_load( file ) ;
+
+	if ( index != NULL )
+	{
+		// Each thread finds the junctions of a whole chromosome through the index, 
+		// and the outputs are concatenated in the order of the header.
+		int chrCnt = fpsam->header->n_targets ;
+		int *chrOrder = new int[chrCnt] ;
+		char **chrOut = new char*[chrCnt] ;
+		size_t *chrOutSize = new size_t[chrCnt] ;
+		bool *chrDone = new bool[chrCnt] ;
+		int nextChr = 0 ;
+		int nextOut = 0 ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+		{
+			chrOrder[i] = i ;
+			chrOut[i] = NULL ;
+			chrDone[i] = false ;
+		}
+		gFpsam = fpsam ;
+		std::sort( chrOrder, chrOrder + chrCnt, CompChrByLength ) ;
+
+		pthread_t *threads = new pthread_t[ numThreads ] ;
+		struct _findJunctionsThreadArg *args = new struct _findJunctionsThreadArg[ numThreads ] ;
+		pthread_attr_t attr ;
+		pthread_mutex_t lock ;
+		pthread_attr_init( &attr ) ;
+		pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE ) ;
+		pthread_mutex_init( &lock, NULL ) ;
+		for ( i = 0 ; i < numThreads ; ++i )
+		{
+			args[i].file = file ;
+			args[i].index = index ;
+			args[i].chrOrder = chrOrder ;
+			args[i].chrCnt = chrCnt ;
+			args[i].nextChr = &nextChr ;
+			args[i].chrOut = chrOut ;
+			args[i].chrOutSize = chrOutSize ;
+			args[i].chrDone = chrDone ;
+			args[i].nextOut = &nextOut ;
+			args[i].out = out ;
+			args[i].hasMateReadIdSuffix = hasMateReadIdSuffix ;
+			args[i].flagRemove = flagRemove ;
+			args[i].lock = &lock ;
+			pthread_create( &threads[i], &attr, FindJunctions_Thread, (void *)( args + i ) ) ;
+		}
+		for ( i = 0 ; i < numThreads ; ++i )
+			pthread_join( threads[i], NULL ) ;
+
+		pthread_attr_destroy( &attr ) ;
+		pthread_mutex_destroy( &lock ) ;
+		bam_index_destroy( index ) ;
+		delete[] threads ;
+		delete[] args ;
+		delete[] chrOrder ;
+		delete[] chrOut ;
+		delete[] chrOutSize ;
+		delete[] chrDone ;
+	}
+	else
+	{
+		if ( useSam && numThreads > 1 && ( fpsam->type & 1 ) )
+			bgzf_mt( fpsam->x.bam, numThreads, 16 ) ;
+		FindJunctions( useSam ? fpsam : NULL, NULL, fp, hasMateReadIdSuffix, flagRemove, out ) ;
+	}
+
+	if ( useSam )
+		samclose( fpsam ) ;
+	else if ( fp != stdin )
+		fclose( fp ) ;
+}
+
+struct _sampleJob
+{
+	char alignment[1024] ;
+	char output[1024] ;
+	off_t size ;
+} ;
+
+bool CompSampleJobBySize( const struct _sampleJob &a, const struct _sampleJob &b )
+{
+	return a.size > b.size ;
+}
+
+struct _findJunctionsSampleThreadArg
+{
+	struct _sampleJob *jobs ;
+	int jobCnt ;
+	int *nextJob ;
+	int numThreads ; // the threads for each sample.
+	bool hasMateReadIdSuffix ;
+	bool flagRemove ;
+	pthread_mutex_t *lock ;
+} ;
+
+void *FindJunctionsSample_Thread( void *pArg )
+{
+	struct _findJunctionsSampleThreadArg &arg = *( (struct _findJunctionsSampleThreadArg *)pArg ) ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextJob ) ;
+		++*( arg.nextJob ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= arg.jobCnt )
+			break ;
+
+		FILE *out = fopen( arg.jobs[k].output, "w" ) ;
+		if ( out == NULL )
+		{
+			fprintf( stderr, "Could not open file %s\n", arg.jobs[k].output ) ;
+			exit( 1 ) ;
+		}
+		FindJunctionsInFile( arg.jobs[k].alignment, arg.numThreads, arg.hasMateReadIdSuffix, arg.flagRemove, out ) ;
+		fclose( out ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// Process the samples listed in file, one "alignment output" pair each line. 
+// The largest alignment files are started first so a deep sample does not hold up the others at the end.
+void FindJunctionsInList( char *file, int numThreads, bool hasMateReadIdSuffix, bool flagRemove )
+{
+	int i ;
+	FILE *fp = fopen( file, "r" ) ;
+	if ( fp == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", file ) ;
+		exit( 1 ) ;
+	}
+	std::vector<struct _sampleJob> jobs ;
+	struct _sampleJob job ;
+	while ( fscanf( fp, "%1023s %1023s", job.alignment, job.output ) == 2 )
+	{
+		struct stat st ;
+		job.size = stat( job.alignment, &st ) == 0 ? st.st_size : 0 ;
+		jobs.push_back( job ) ;
+	}
+	fclose( fp ) ;
+	if ( jobs.size() == 0 )
+		return ;
+	std::stable_sort( jobs.begin(), jobs.end(), CompSampleJobBySize ) ;
+	
+	int jobCnt = jobs.size() ;
+	int threadCnt = numThreads < jobCnt ? numThreads : jobCnt ;
+	if ( threadCnt < 1 )
+		threadCnt = 1 ;
+	int nextJob = 0 ;
+	pthread_t *threads = new pthread_t[ threadCnt ] ;
+	pthread_attr_t attr ;
+	pthread_mutex_t lock ;
+	struct _findJunctionsSampleThreadArg arg ;
+	arg.jobs = &jobs[0] ;
+	arg.jobCnt = jobCnt ;
+	arg.nextJob = &nextJob ;
+	arg.numThreads = numThreads / threadCnt ; // the spare threads work within each sample.
+	arg.hasMateReadIdSuffix = hasMateReadIdSuffix ;
+	arg.flagRemove = flagRemove ;
+	arg.lock = &lock ;
+
+	pthread_attr_init( &attr ) ;
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE ) ;
+	pthread_mutex_init( &lock, NULL ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_create( &threads[i], &attr, FindJunctionsSample_Thread, (void *)&arg ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &attr ) ;
+	pthread_mutex_destroy( &lock ) ;
+	delete[] threads ;
+}
+
+int main( int argc, char *argv[] ) 
+{
+	int i ;
+	bool flagRemove = false ;
+	char *sampleList = NULL ;
+
+	anchorBoth = false ;	
+	
+	flagPrintJunction = false ;
+	flagPrintAll = false ;
+	flagStrict = false ;
+	junctionCnt = 0 ;
+	bool hasMateReadIdSuffix = false ;
+	int numThreads = 1 ;
+
+	flagRemove = true ;
+	flagPrintJunction = true ;
+	flank = 8 ;
+	filterYS = 4 ;
 	
+	// processing the argument list
+	for ( i = 1 ; i < argc ; ++i )
+	{
+		if ( !strcmp( argv[i], "-h" ) )
+		{
+			PrintHelp() ;
+			return 0 ;
+		}
+		else if ( !strcmp( argv[i], "-r" ) )
+		{
+			flagRemove = true ;
+		}
+		else if ( !strcmp( argv[i], "-j" ) )
+		{
+			flagRemove = true ;
+			flagPrintJunction = true ;
+			flank = atoi( argv[i + 1] ) ;
+			if ( i + 2 < argc && !strcmp( argv[i+2], "-B" ) )
+			{
+				anchorBoth = true ;
+				++i ;		
+			}
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "-a" ) )
+		{
+			flagPrintAll = true ;
+		}
+		else if ( !strcmp( argv[i], "--strict" ) )
+		{
+			flagStrict = true ;
+		}
+		else if ( !strcmp( argv[i], "-y" ) )
+		{
+			filterYS = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "-p" ) )
+		{
+			numThreads = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--lb" ) )
+		{
+			sampleList = argv[i + 1] ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--hasMateIdSuffix" ) )
+		{
+			hasMateReadIdSuffix = true ;
+			++i ;
+		}
+		else if ( i > 1 )
+		{
+			printf( "Unknown option %s\n", argv[i] ) ;
+			exit( 1 ) ;
+		}
+	}
+	if ( argc == 1 )
+	{
+		PrintHelp() ;
+		return 0 ;
+	}
+
+	if ( sampleList != NULL )
+		FindJunctionsInList( sampleList, numThreads, hasMateReadIdSuffix, flagRemove ) ;
+	else
+		FindJunctionsInFile( argv[1], numThreads, hasMateReadIdSuffix, flagRemove, stdout ) ;
+
 	//fprintf( stderr, "The number of junctions: %d\n", junctionCnt ) ;
 	return 0 ;
 }
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 #include <vector>
 #include <algorithm>
 
@@ -8,15 +9,22 @@
 #define MAX(x, y) (((x)<(y))?(y):(x))
 #define MIN(x, y) (((x)<(y))?(x):(y))
 
+#define MAX_OPEN_RUNS 256
+
 char usage[] = "Usage: ./trust-splice splice_file_list one_bam_file [OPTIONS]\n"
+		"       ./trust-splice --filter filter_list [OPTIONS]\n"
+		"\t\teach line of filter_list is \"raw_splice trusted_splice output\": keep the introns of raw_splice in trusted_splice, with the trusted strand\n"
 		"Options:\n"
-		"\t-a FLOAT: average number of supported reads from the samples (default: 0.5)\n" ;
+		"\t-a FLOAT: average number of supported reads from the samples (default: 0.5)\n"
+		"\t-p INT: number of threads for --filter (default: 1)\n"
+		"\t--add FILE: add the samples in splice_file_list to the intron accumulator FILE, and output the trusted introns of all its samples (default: not used)\n" ;
 
 struct _intron
 {
 	int chrId ;
 	int start, end ;
 	double support ;
+	double smallCohortSupport ; // the support when there are no more than 5 samples, where a single read counts 1.
 	int uniqSupport ;
 	int secSupport ;
 	char strand ;
@@ -55,25 +63,36 @@ bool CompSites( struct _site a, struct _site b )
 	return false ;
 }
 
+bool IsSameIntron( const struct _intron &a, const struct _intron &b )
+{
+	return a.chrId == b.chrId && a.start == b.start && a.end == b.end ;
+}
+
+// Add the support of b to a, b is from the same or a later sample.
+void AddIntron( struct _intron &a, const struct _intron &b )
+{
+	a.support += b.support ;
+	a.smallCohortSupport += b.smallCohortSupport ;
+	a.uniqSupport += b.uniqSupport ;
+	a.secSupport += b.secSupport ;
+	a.sampleSupport += b.sampleSupport ;
+
+	if ( a.strand == '?' )
+		a.strand = b.strand ;	
+}
+
+// The introns need to be sorted.
 void CoalesceIntrons( std::vector<struct _intron> &introns )
 {
-	std::sort( introns.begin(), introns.end(), CompIntrons ) ;
 	int size = introns.size() ;
 	int i, k ;
+	if ( size == 0 )
+		return ;
 	k = 0 ;
 	for ( i = 1 ; i < size ; ++i )
 	{
-		if ( introns[i].chrId == introns[k].chrId && introns[i].start == introns[k].start 
-			&& introns[i].end == introns[k].end )
-		{
-			introns[k].support += introns[i].support ;
-			introns[k].uniqSupport += introns[i].uniqSupport ;
-			introns[k].secSupport += introns[i].secSupport ;
-			introns[k].sampleSupport += introns[i].sampleSupport ;
-
-			if ( introns[k].strand == '?' )
-				introns[k].strand = introns[i].strand ;	
-		}
+		if ( IsSameIntron( introns[i], introns[k] ) )
+			AddIntron( introns[k], introns[i] ) ;
 		else
 		{
 			++k ;
@@ -83,6 +102,252 @@ void CoalesceIntrons( std::vector<struct _intron> &introns )
 	introns.resize( k + 1 ) ;
 }
 
+// Read a splice file into a temporary file of sorted and coalesced introns, 
+// so the samples can be merged by streaming instead of re-sorting the accumulated introns.
+// junc already writes the introns sorted, so the sort is only needed for other inputs.
+FILE *BuildIntronRun( char *spliceFile, Alignments &alignments )
+{
+	FILE *fp ;
+	char chrName[1024], strand[3] ;
+	int start, end, uniqSupport, secSupport, uniqEditDistance, secEditDistance ;
+	double support ;
+	std::vector<struct _intron> introns ;
+	bool sorted = true ;
+
+	fp = fopen( spliceFile, "r" ) ;	
+	if ( fp == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", spliceFile ) ;
+		exit( 1 ) ;
+	}
+	while (  fscanf( fp, "%s %d %d %lf %s %d %d %d %d", chrName, &start, &end, &support,
+				strand, &uniqSupport, &secSupport, &uniqEditDistance, &secEditDistance ) != EOF )
+	{
+
+		if ( support <= 0 )
+			support = 0.1 ;
+
+		struct _intron ni ;
+		ni.chrId = alignments.GetChromIdFromName( chrName ) ;
+		ni.start = start ;
+		ni.end = end ;
+		ni.support = ( support == 1 ) ? 0.75 : support ;
+		ni.smallCohortSupport = support ;
+		ni.strand = strand[0] ;
+		ni.uniqSupport = uniqSupport ;
+		ni.secSupport = secSupport ;
+		ni.sampleSupport = 1 ;
+		ni.editDist = uniqEditDistance + secEditDistance ;
+		if ( introns.size() > 0 && CompIntrons( ni, introns.back() ) )
+			sorted = false ;
+		introns.push_back( ni ) ;
+	}
+	fclose( fp ) ;
+
+	if ( !sorted )
+		std::stable_sort( introns.begin(), introns.end(), CompIntrons ) ;
+	CoalesceIntrons( introns ) ;
+
+	FILE *run = tmpfile() ;
+	if ( run == NULL )
+	{
+		fprintf( stderr, "Could not create a temporary file.\n" ) ;
+		exit( 1 ) ;
+	}
+	if ( introns.size() > 0 )
+		fwrite( &introns[0], sizeof( struct _intron ), introns.size(), run ) ;
+	rewind( run ) ;
+	return run ;
+}
+
+// The accumulator keeps the merged introns of the samples seen so far, so new samples can be added 
+// without reading the old splice files again.
+// Format: "PSIACC01", sample count, chromosome count, the chromosome names (length and characters), 
+// intron count and the introns.
+const char ACCUMULATOR_MAGIC[] = "PSIACC01" ;
+
+FILE *LoadIntronAccumulator( const char *file, Alignments &alignments, int &sampleCnt )
+{
+	int i ;
+	char magic[8] ;
+	int chrCnt ;
+	int64_t intronCnt ;
+	FILE *fp = fopen( file, "rb" ) ;
+	FILE *run = NULL ;
+
+	sampleCnt = 0 ;
+	if ( fp == NULL )
+		return NULL ;
+	if ( fread( magic, 1, 8, fp ) != 8 || memcmp( magic, ACCUMULATOR_MAGIC, 8 )
+		|| fread( &sampleCnt, sizeof( sampleCnt ), 1, fp ) != 1 
+		|| fread( &chrCnt, sizeof( chrCnt ), 1, fp ) != 1 )
+	{
+		fprintf( stderr, "%s is not an intron accumulator.\n", file ) ;
+		exit( 1 ) ;
+	}
+
+	// The chromosome ids follow the header of the given alignment file, which may be in a different order.
+	std::vector<int> chrIdMap( chrCnt ) ;
+	char chrName[1024] ;
+	for ( i = 0 ; i < chrCnt ; ++i )
+	{
+		int len ;
+		if ( fread( &len, sizeof( len ), 1, fp ) != 1 || len < 0 || len >= (int)sizeof( chrName ) 
+			|| fread( chrName, 1, len, fp ) != (size_t)len )
+		{
+			fprintf( stderr, "%s is truncated.\n", file ) ;
+			exit( 1 ) ;
+		}
+		chrName[len] = '\0' ;
+		chrIdMap[i] = alignments.GetChromIdFromName( chrName ) ;
+	}
+
+	if ( fread( &intronCnt, sizeof( intronCnt ), 1, fp ) != 1 )
+	{
+		fprintf( stderr, "%s is truncated.\n", file ) ;
+		exit( 1 ) ;
+	}
+	std::vector<struct _intron> introns( intronCnt ) ;
+	if ( intronCnt > 0 && fread( &introns[0], sizeof( struct _intron ), intronCnt, fp ) != (size_t)intronCnt )
+	{
+		fprintf( stderr, "%s is truncated.\n", file ) ;
+		exit( 1 ) ;
+	}
+	fclose( fp ) ;
+
+	bool sorted = true ;
+	for ( i = 0 ; i < intronCnt ; ++i )
+	{
+		introns[i].chrId = chrIdMap[ introns[i].chrId ] ;
+		if ( i > 0 && CompIntrons( introns[i], introns[i - 1] ) )
+			sorted = false ;
+	}
+	if ( !sorted )
+		std::sort( introns.begin(), introns.end(), CompIntrons ) ;
+
+	run = tmpfile() ;
+	if ( run == NULL )
+	{
+		fprintf( stderr, "Could not create a temporary file.\n" ) ;
+		exit( 1 ) ;
+	}
+	if ( intronCnt > 0 )
+		fwrite( &introns[0], sizeof( struct _intron ), intronCnt, run ) ;
+	rewind( run ) ;
+	return run ;
+}
+
+void SaveIntronAccumulator( const char *file, Alignments &alignments, int sampleCnt, 
+	const std::vector<struct _intron> &introns )
+{
+	int i ;
+	char tmpFile[2048] ;
+	int chrCnt = alignments.GetChromCount() ;
+	int64_t intronCnt = introns.size() ;
+
+	// Write to a temporary file first so an interrupted update keeps the old accumulator.
+	snprintf( tmpFile, sizeof( tmpFile ), "%s.tmp", file ) ;
+	FILE *fp = fopen( tmpFile, "wb" ) ;
+	if ( fp == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", tmpFile ) ;
+		exit( 1 ) ;
+	}
+	fwrite( ACCUMULATOR_MAGIC, 1, 8, fp ) ;
+	fwrite( &sampleCnt, sizeof( sampleCnt ), 1, fp ) ;
+	fwrite( &chrCnt, sizeof( chrCnt ), 1, fp ) ;
+	for ( i = 0 ; i < chrCnt ; ++i )
+	{
+		char *name = alignments.GetChromName( i ) ;
+		int len = strlen( name ) ;
+		fwrite( &len, sizeof( len ), 1, fp ) ;
+		fwrite( name, 1, len, fp ) ;
+	}
+	fwrite( &intronCnt, sizeof( intronCnt ), 1, fp ) ;
+	if ( intronCnt > 0 )
+		fwrite( &introns[0], sizeof( struct _intron ), intronCnt, fp ) ;
+	if ( fclose( fp ) != 0 || rename( tmpFile, file ) != 0 )
+	{
+		fprintf( stderr, "Could not write file %s\n", file ) ;
+		exit( 1 ) ;
+	}
+}
+
+struct _intronRunHead
+{
+	struct _intron intron ;
+	int runId ;
+} ;
+
+// The heap order: the smallest intron at the top, and the earlier sample first for the same intron.
+bool CompIntronRunHeads( const struct _intronRunHead &a, const struct _intronRunHead &b )
+{
+	if ( CompIntrons( b.intron, a.intron ) )
+		return true ;
+	else if ( CompIntrons( a.intron, b.intron ) )
+		return false ;
+	return a.runId > b.runId ;
+}
+
+// K-way merge of the runs in sample order, and close them. The merged introns go to fpOut if it is not NULL,
+// otherwise to merged.
+void MergeIntronRuns( FILE **runs, int runCnt, FILE *fpOut, std::vector<struct _intron> &merged )
+{
+	int i ;
+	std::vector<struct _intronRunHead> heap ;
+	struct _intronRunHead h ;
+	struct _intron cur ;
+	bool hasCur = false ;
+
+	for ( i = 0 ; i < runCnt ; ++i )
+	{
+		if ( fread( &h.intron, sizeof( struct _intron ), 1, runs[i] ) == 1 )
+		{
+			h.runId = i ;
+			heap.push_back( h ) ;
+		}
+	}
+	std::make_heap( heap.begin(), heap.end(), CompIntronRunHeads ) ;
+
+	while ( heap.size() > 0 )
+	{
+		std::pop_heap( heap.begin(), heap.end(), CompIntronRunHeads ) ;
+		h = heap.back() ;
+		heap.pop_back() ;
+
+		if ( hasCur && IsSameIntron( cur, h.intron ) )
+			AddIntron( cur, h.intron ) ;
+		else
+		{
+			if ( hasCur )
+			{
+				if ( fpOut != NULL )
+					fwrite( &cur, sizeof( cur ), 1, fpOut ) ;
+				else
+					merged.push_back( cur ) ;
+			}
+			cur = h.intron ;
+			hasCur = true ;
+		}
+
+		if ( fread( &h.intron, sizeof( struct _intron ), 1, runs[ h.runId ] ) == 1 )
+		{
+			heap.push_back( h ) ;
+			std::push_heap( heap.begin(), heap.end(), CompIntronRunHeads ) ;
+		}
+	}
+	if ( hasCur )
+	{
+		if ( fpOut != NULL )
+			fwrite( &cur, sizeof( cur ), 1, fpOut ) ;
+		else
+			merged.push_back( cur ) ;
+	}
+
+	for ( i = 0 ; i < runCnt ; ++i )
+		fclose( runs[i] ) ;
+}
+
 void CoalesceSites( std::vector<struct _site> &sites )
 {
 	std::sort( sites.begin(), sites.end(), CompSites ) ;
@@ -105,21 +370,254 @@ void CoalesceSites( std::vector<struct _site> &sites )
 	sites.resize( k + 1 ) ;
 }
 
+struct _trustedSplice
+{
+	int chrId ;
+	int start, end ;
+	char strand ;
+} ;
+
+// The trusted introns of one file, sorted for binary search.
+struct _trustedSet
+{
+	std::string file ;
+	std::map<std::string, int> chrIds ;
+	std::vector<struct _trustedSplice> splices ;
+} ;
+
+bool CompTrustedSplices( const struct _trustedSplice &a, const struct _trustedSplice &b )
+{
+	if ( a.chrId != b.chrId )
+		return a.chrId < b.chrId ;
+	else if ( a.start != b.start )
+		return a.start < b.start ;
+	return a.end < b.end ;
+}
+
+void LoadTrustedSet( const char *file, struct _trustedSet &set )
+{
+	char line[2048] ;
+	char chrName[1024], strand[3] ;
+	int start, end ;
+	FILE *fp = fopen( file, "r" ) ;
+	if ( fp == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", file ) ;
+		exit( 1 ) ;
+	}
+	set.file = file ;
+	while ( fgets( line, sizeof( line ), fp ) != NULL )
+	{
+		if ( sscanf( line, "%s %d %d %*s %2s", chrName, &start, &end, strand ) < 4 )
+			continue ;
+		std::map<std::string, int>::iterator it = set.chrIds.find( chrName ) ;
+		struct _trustedSplice ts ;
+		if ( it == set.chrIds.end() )
+		{
+			ts.chrId = set.chrIds.size() ;
+			set.chrIds[ chrName ] = ts.chrId ;
+		}
+		else
+			ts.chrId = it->second ;
+		ts.start = start ;
+		ts.end = end ;
+		ts.strand = strand[0] ;
+		set.splices.push_back( ts ) ;
+	}
+	fclose( fp ) ;
+
+	// The later line wins for a repeated intron.
+	std::stable_sort( set.splices.begin(), set.splices.end(), CompTrustedSplices ) ;
+	int size = set.splices.size() ;
+	int i, k ;
+	k = 0 ;
+	for ( i = 0 ; i < size ; ++i )
+	{
+		if ( k > 0 && !CompTrustedSplices( set.splices[k - 1], set.splices[i] ) )
+			set.splices[k - 1] = set.splices[i] ;
+		else
+		{
+			set.splices[k] = set.splices[i] ;
+			++k ;
+		}
+	}
+	set.splices.resize( k ) ;
+}
+
+// Return the trusted strand of the intron, or 0 if it is not trusted.
+char SearchTrustedSet( const struct _trustedSet &set, const char *chrName, int start, int end )
+{
+	std::map<std::string, int>::const_iterator it = set.chrIds.find( chrName ) ;
+	if ( it == set.chrIds.end() )
+		return 0 ;
+	struct _trustedSplice key ;
+	key.chrId = it->second ;
+	key.start = start ;
+	key.end = end ;
+	std::vector<struct _trustedSplice>::const_iterator p = 
+		std::lower_bound( set.splices.begin(), set.splices.end(), key, CompTrustedSplices ) ;
+	if ( p == set.splices.end() || CompTrustedSplices( key, *p ) )
+		return 0 ;
+	return p->strand ;
+}
+
+// Keep the introns of the raw splice file that are trusted, and use the trusted strand.
+void FilterSpliceFile( const char *rawSplice, const struct _trustedSet &set, const char *output )
+{
+	char line[2048] ;
+	char chrName[1024], strand[3] ;
+	int start, end, uniqSupport, secSupport, uniqEditDistance, secEditDistance ;
+	double support ;
+	FILE *fp = fopen( rawSplice, "r" ) ;
+	FILE *fpOut = fopen( output, "w" ) ;
+	if ( fp == NULL || fpOut == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", fp == NULL ? rawSplice : output ) ;
+		exit( 1 ) ;
+	}
+	while ( fgets( line, sizeof( line ), fp ) != NULL )
+	{
+		if ( sscanf( line, "%s %d %d %lf %2s %d %d %d %d", chrName, &start, &end, &support, strand, 
+			&uniqSupport, &secSupport, &uniqEditDistance, &secEditDistance ) < 9 )
+			continue ;
+		char trustedStrand = SearchTrustedSet( set, chrName, start, end ) ;
+		if ( trustedStrand == 0 )
+			continue ;
+
+		if ( support <= 0 )
+			fprintf( fpOut, "%s %d %d 1 %c 1 0 0 0\n", chrName, start, end, trustedStrand ) ;
+		else if ( strand[0] == trustedStrand && strand[1] == '\0' )
+			fputs( line, fpOut ) ;
+		else
+		{
+			// Only the strand changes, so the other fields are copied as they are.
+			char *p = line ;
+			int i ;
+			for ( i = 0 ; i < 4 ; ++i )
+			{
+				while ( *p == ' ' || *p == '\t' )
+					++p ;
+				while ( *p != ' ' && *p != '\t' && *p != '\0' )
+					++p ;
+			}
+			while ( *p == ' ' || *p == '\t' )
+				++p ;
+			char *rest = p ;
+			while ( *rest != ' ' && *rest != '\t' && *rest != '\n' && *rest != '\0' )
+				++rest ;
+			fprintf( fpOut, "%.*s%c%s", (int)( p - line ), line, trustedStrand, rest ) ;
+		}
+	}
+	fclose( fp ) ;
+	fclose( fpOut ) ;
+}
+
+struct _filterJob
+{
+	char rawSplice[1024] ;
+	char output[1024] ;
+	int setId ;
+} ;
+
+struct _filterSpliceThreadArg
+{
+	struct _filterJob *jobs ;
+	int jobCnt ;
+	struct _trustedSet *sets ;
+	int *nextJob ;
+	pthread_mutex_t *lock ;
+} ;
+
+void *FilterSplice_Thread( void *pArg )
+{
+	struct _filterSpliceThreadArg &arg = *( (struct _filterSpliceThreadArg *)pArg ) ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextJob ) ;
+		++*( arg.nextJob ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= arg.jobCnt )
+			break ;
+		FilterSpliceFile( arg.jobs[k].rawSplice, arg.sets[ arg.jobs[k].setId ], arg.jobs[k].output ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// Filter all the samples in the list. Each trusted splice file is loaded once, 
+// even if it is shared by the samples of a group.
+void FilterSplices( char *filterList, int numThreads )
+{
+	int i ;
+	char trustedFile[1024] ;
+	FILE *fp = fopen( filterList, "r" ) ;
+	if ( fp == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", filterList ) ;
+		exit( 1 ) ;
+	}
+	std::vector<struct _filterJob> jobs ;
+	std::vector<struct _trustedSet> sets ;
+	std::map<std::string, int> setIds ;
+	struct _filterJob job ;
+	while ( fscanf( fp, "%1023s %1023s %1023s", job.rawSplice, trustedFile, job.output ) == 3 )
+	{
+		std::map<std::string, int>::iterator it = setIds.find( trustedFile ) ;
+		if ( it == setIds.end() )
+		{
+			job.setId = sets.size() ;
+			setIds[ trustedFile ] = job.setId ;
+			sets.resize( sets.size() + 1 ) ;
+			LoadTrustedSet( trustedFile, sets.back() ) ;
+		}
+		else
+			job.setId = it->second ;
+		jobs.push_back( job ) ;
+	}
+	fclose( fp ) ;
+	if ( jobs.size() == 0 )
+		return ;
+
+	int jobCnt = jobs.size() ;
+	int threadCnt = numThreads < jobCnt ? numThreads : jobCnt ;
+	if ( threadCnt < 1 )
+		threadCnt = 1 ;
+	int nextJob = 0 ;
+	pthread_mutex_t lock ;
+	pthread_attr_t pthreadAttr ;
+	pthread_t *threads = new pthread_t[ threadCnt ] ;
+	struct _filterSpliceThreadArg arg ;
+	arg.jobs = &jobs[0] ;
+	arg.jobCnt = jobCnt ;
+	arg.sets = &sets[0] ;
+	arg.nextJob = &nextJob ;
+	arg.lock = &lock ;
+
+	pthread_mutex_init( &lock, NULL ) ;
+	pthread_attr_init( &pthreadAttr ) ;
+	pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_create( &threads[i], &pthreadAttr, FilterSplice_Thread, &arg ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &pthreadAttr ) ;
+	pthread_mutex_destroy( &lock ) ;
+	delete[] threads ;
+}
+
 int main( int argc, char *argv[] )
 {
 	int i, j, k ;
 	FILE *fpList ;	
-	FILE *fp ;
 	char spliceFile[2048] ;
-	char chrName[1024], strand[3] ;
-	int start, end, uniqSupport, secSupport, uniqEditDistance, secEditDistance ;
-	double support ;
 	Alignments alignments ;
 	std::vector<struct _intron> introns ;
 	std::vector<struct _site> sites ;
 	double averageSupportThreshold = 0.5 ;
+	int numThreads = 1 ;
+	char *accumulatorFile = NULL ;
 
-	if ( argc <= 1 )
+	if ( argc <= 2 )
 	{
 		printf( "%s", usage ) ;
 		exit( 1 ) ;
@@ -132,6 +630,16 @@ int main( int argc, char *argv[] )
 			averageSupportThreshold = atof( argv[i + 1] ) ;
 			++i ;
 		}
+		else if ( !strcmp( argv[ i ], "-p" ) )
+		{
+			numThreads = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[ i ], "--add" ) )
+		{
+			accumulatorFile = argv[i + 1] ;
+			++i ;
+		}
 		else
 		{
 			printf( "Unknown option: %s", argv[i] ) ;
@@ -139,48 +647,63 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	if ( !strcmp( argv[1], "--filter" ) )
+	{
+		FilterSplices( argv[2], numThreads ) ;
+		return 0 ;
+	}
+
 	alignments.Open( argv[2] ) ;
 
 	// Get the number of samples.
-	fpList = fopen( argv[1], "r" ) ;
+	std::vector<FILE *> runs ;
 	int sampleCnt = 0 ;
+	if ( accumulatorFile != NULL )
+	{
+		// The samples already in the accumulator come first.
+		FILE *run = LoadIntronAccumulator( accumulatorFile, alignments, sampleCnt ) ;
+		if ( run != NULL )
+			runs.push_back( run ) ;
+	}
+	fpList = fopen( argv[1], "r" ) ;
 	while ( fscanf( fpList, "%s", spliceFile ) != EOF )
 	{
 		++sampleCnt ;
 	}
 	fclose( fpList ) ;
 
-	// Get all the introns.
+	// Get all the introns. Each sample is sorted once, and the samples are merged by streaming. 
+	// When too many samples are open, the earlier ones are merged into one run first.
 	fpList = fopen( argv[1], "r" ) ;
 	while ( fscanf( fpList, "%s", spliceFile ) != EOF )
 	{
-		fp = fopen( spliceFile, "r" ) ;	
-		while (  fscanf( fp, "%s %d %d %lf %s %d %d %d %d", chrName, &start, &end, &support,
-				strand, &uniqSupport, &secSupport, &uniqEditDistance, &secEditDistance ) != EOF )
+		runs.push_back( BuildIntronRun( spliceFile, alignments ) ) ;
+		if ( runs.size() >= MAX_OPEN_RUNS )
 		{
-			
-			if ( support <= 0 )
-				support = 0.1 ;
-			else if ( support == 1 && sampleCnt > 5 )
-				support = 0.75 ;
-
-			struct _intron ni ;
-			ni.chrId = alignments.GetChromIdFromName( chrName ) ;
-			ni.start = start ;
-			ni.end = end ;
-			ni.support = support ;
-			ni.strand = strand[0] ;
-			ni.uniqSupport = uniqSupport ;
-			ni.secSupport = secSupport ;
-			ni.sampleSupport = 1 ;
-			ni.editDist = uniqEditDistance + secEditDistance ;
-			introns.push_back( ni ) ;
+			FILE *run = tmpfile() ;
+			if ( run == NULL )
+			{
+				fprintf( stderr, "Could not create a temporary file.\n" ) ;
+				exit( 1 ) ;
+			}
+			MergeIntronRuns( &runs[0], runs.size(), run, introns ) ;
+			rewind( run ) ;
+			runs.clear() ;
+			runs.push_back( run ) ;
 		}
-		fclose( fp ) ;
-
-		CoalesceIntrons( introns ) ;
 	}
 	fclose( fpList ) ;
+	if ( runs.size() > 0 )
+		MergeIntronRuns( &runs[0], runs.size(), NULL, introns ) ;
+	
+	if ( accumulatorFile != NULL )
+		SaveIntronAccumulator( accumulatorFile, alignments, sampleCnt, introns ) ;
+	if ( sampleCnt <= 5 )
+	{
+		int intronCnt = introns.size() ;
+		for ( i = 0 ; i < intronCnt ; ++i )
+			introns[i].support = introns[i].smallCohortSupport ;
+	}
 
 	// Obtain the split sites.
 	int intronCnt = introns.size() ;
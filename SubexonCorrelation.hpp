@@ -2,145 +2,157 @@
 #define _MOURISL_CLASSES_SUBEXONCORRELATION_HEADER
 
 #include "SubexonGraph.hpp"
+#include "SubexonDepthMatrix.hpp"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <math.h>
 
+#include <vector>
+
 class SubexonCorrelation
 {
 private:
-	struct _subexon *lastSubexons ;
-	std::vector<FILE *> fileList ;
+	std::vector<SubexonFile *> fileList ;
+	bool ownFiles ;
+	// The subexons of each sample that are read but may still overlap the next subexons we are interested in.
+	std::vector< std::vector<struct _subexon> > pendingSubexons ;
+	// The precomputed depth of each sample, used instead of the subexon files when given.
+	SubexonDepthMatrix *depthMatrix ;
+	int sampleCnt ;
 	int offset ;
-	int prevSeCnt ;
 	int seCnt ;
 
-	double **correlation ;
-		
-	int OverlapSize( int s0, int e0, int s1, int e1 )
-	{
-		int s = -1, e = -1 ;
-		if ( e0 < s1 || s0 > e1 )
-			return 0 ;
-		s = s0 > s1 ? s0 : s1 ;
-		e = e0 < e1 ? e0 : e1 ;
-		return e - s + 1 ;
-	}
-public:
-	SubexonCorrelation() 
+	// The correlation of a pair is computed when queried, from the depth of the subexons of the gene.
+	// depth[j * sampleCnt + i] is the depth of subexon j in sample i, so each subexon is contiguous.
+	double *depth ;
+	double *avg ;
+	double *var ;
+	int capacity ; // the number of subexons the buffers can hold.
+
+	// The correlations already queried for the current gene, in an open-addressing hash keyed by i * seCnt + j.
+	std::vector<int64_t> memoKeys ; // -1 for an empty slot.
+	std::vector<double> memoValues ;
+	std::vector<int> memoUsedSlots ;
+
+	int MemoSlot( int64_t key )
 	{
-		offset = 0 ;
-		lastSubexons = NULL ;
-		correlation = NULL ;
-		prevSeCnt = 0 ;
+		uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ull ;
+		int mask = memoKeys.size() - 1 ;
+		int slot = (int)( h >> 32 ) & mask ;
+		while ( memoKeys[slot] != -1 && memoKeys[slot] != key )
+			slot = ( slot + 1 ) & mask ;
+		return slot ;
 	}
 
-	~SubexonCorrelation()
+	void ClearMemo()
 	{
-		int cnt = fileList.size() ;
 		int i ;
-		for ( i = 0 ; i < cnt ; ++i )
-			fclose( fileList[i] ) ;
-		delete[] lastSubexons ;
+		int size = memoUsedSlots.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			memoKeys[ memoUsedSlots[i] ] = -1 ;
+		memoUsedSlots.clear() ;
 	}
 
-	void Initialize( char *f )
+	void AddMemo( int64_t key, double value )
 	{
-		FILE *fpSl ;
-		fpSl = fopen( f, "r" ) ;
-		char buffer[1024] ;
-		while ( fgets( buffer, sizeof( buffer ), fpSl ) != NULL )
+		if ( 2 * ( memoUsedSlots.size() + 1 ) > memoKeys.size() )
 		{
-			int len = strlen( buffer ) ;
-			if ( buffer[len - 1] == '\n' )
+			// Grow the table and put the entries back.
+			std::vector<int64_t> keys ;
+			std::vector<double> values ;
+			int i ;
+			int size = memoUsedSlots.size() ;
+			for ( i = 0 ; i < size ; ++i )
 			{
-				buffer[len - 1] = '\0' ;
-				--len ;
-
+				keys.push_back( memoKeys[ memoUsedSlots[i] ] ) ;
+				values.push_back( memoValues[ memoUsedSlots[i] ] ) ;
+			}
+			int newSize = memoKeys.size() < 1024 ? 1024 : 2 * memoKeys.size() ;
+			memoKeys.assign( newSize, -1 ) ;
+			memoValues.resize( newSize ) ;
+			memoUsedSlots.clear() ;
+			for ( i = 0 ; i < size ; ++i )
+			{
+				int slot = MemoSlot( keys[i] ) ;
+				memoKeys[slot] = keys[i] ;
+				memoValues[slot] = values[i] ;
+				memoUsedSlots.push_back( slot ) ;
 			}
-			FILE *fp = fopen( buffer, "r" ) ;
-			fileList.push_back( fp ) ;
 		}
-
-		lastSubexons = new struct _subexon[ fileList.size() ] ;
-		int i, cnt ;
-		cnt = fileList.size() ;
-		for ( i = 0 ; i < cnt ; ++i )
-			lastSubexons[i].chrId = -1 ;
-	
+		int slot = MemoSlot( key ) ;
+		memoKeys[slot] = key ;
+		memoValues[slot] = value ;
+		memoUsedSlots.push_back( slot ) ;
 	}
-	
-	// We assume the subexons only contains the subexons we are interested in.
-	// And we assume that each time we call this function, the subexons we are interested are 
-	// sorted in order.
-	void ComputeCorrelation( struct _subexon *subexons, int cnt, Alignments &alignments )
+
+	void Reserve( int cnt )
 	{
-		int sampleCnt = fileList.size() ;
-		if ( sampleCnt <= 1 )
+		if ( cnt <= capacity )
 			return ;
-		int i, j, k ;
-		seCnt = cnt ;
-
-		// Obtain the depth matrix.
-		double **depth ;
-		depth = new double* [sampleCnt] ; 
-		for ( i = 0 ; i < sampleCnt ; ++i )
+		if ( depth != NULL )
 		{
-			depth[i] = new double[ cnt ] ; 
-			memset( depth[i], 0, sizeof( double ) * cnt ) ;
+			delete[] depth ;
+			delete[] avg ;
+			delete[] var ;
 		}
+		capacity = cnt ;
+		depth = new double[ capacity * sampleCnt ] ;
+		avg = new double[ capacity ] ;
+		var = new double[ capacity ] ;
+	}
 		
-		char buffer[2048] ;
+	int OverlapSize( int s0, int e0, int s1, int e1 )
+	{
+		int s = -1, e = -1 ;
+		if ( e0 < s1 || s0 > e1 )
+			return 0 ;
+		s = s0 > s1 ? s0 : s1 ;
+		e = e0 < e1 ? e0 : e1 ;
+		return e - s + 1 ;
+	}
+
+	// Obtain the average depth of each sample on the subexons from the subexon files.
+	void ReadDepth( struct _subexon *subexons, int cnt, Alignments &alignments, double *depth )
+	{
+		int i, j, k ;
 		for ( i = 0 ; i < sampleCnt ; ++i )
 		{
+			std::vector<struct _subexon> &pending = pendingSubexons[i] ;
 			struct _subexon se ;
-			bool useLastSubexon = false ;
-			if ( lastSubexons[i].chrId != -1 )
-			{
-				se = lastSubexons[i] ;
-				useLastSubexon = true ;
-			}
-			else
-				se.chrId = -1 ;
 
-			// Locate the subexon
-			while ( 1 )
+			// Drop the subexons before the interested ones. They can not overlap the later ones either.
+			for ( k = 0 ; k < (int)pending.size() ; ++k )
+				if ( !( pending[k].chrId < subexons[0].chrId 
+					|| ( pending[k].chrId == subexons[0].chrId && pending[k].end < subexons[0].start ) ) )
+					break ;
+			pending.erase( pending.begin(), pending.begin() + k ) ;
+			if ( pending.size() == 0 )
 			{
-				if ( se.chrId < subexons[0].chrId 
-					|| ( se.chrId == subexons[0].chrId && se.end < subexons[0].start ) )
+				fileList[i]->SeekChrom( subexons[0].chrId, alignments ) ;
+				while ( fileList[i]->Next( se, alignments ) )
 				{
-					if ( fgets( buffer, sizeof( buffer ), fileList[i] ) == NULL )
-					{
-						buffer[0] = '\0' ;
-						break ;
-					}
-					if ( buffer[0] == '#' )
-						continue ;
-					
-					SubexonGraph::InputSubexon( buffer, alignments, se ) ;
 					--se.start ; --se.end ;
-					useLastSubexon = false ;
-					continue ;
+					if ( se.chrId < subexons[0].chrId 
+						|| ( se.chrId == subexons[0].chrId && se.end < subexons[0].start ) )
+						continue ;
+					pending.push_back( se ) ;
+					break ;
 				}
-				break ;
-			}
-			if ( buffer[0] == '\0' )
-			{
-				lastSubexons[i] = se ;	
-				continue ;
 			}
 
-			// Process the subexon.
+			// Process the subexons overlapping the interested ones, and keep them for the next call.
 			int tag = 0 ;
-			while ( 1 )
+			for ( k = 0 ; ; ++k )
 			{
-				lastSubexons[i] = se ;
-				
-				if ( useLastSubexon == false )
+				if ( k >= (int)pending.size() )
 				{
-					SubexonGraph::InputSubexon( buffer, alignments, se ) ; 
+					if ( !fileList[i]->Next( se, alignments ) )
+						break ;
 					--se.start ; --se.end ;
+					pending.push_back( se ) ;
 				}
+				se = pending[k] ;
 
 				if ( se.chrId > subexons[cnt - 1].chrId || se.start > subexons[cnt - 1].end )
 					break ;
@@ -155,115 +167,186 @@ public:
 				for ( j = tag ; j < cnt && subexons[j].start <= se.end ; ++j )
 				{
 					int overlap = OverlapSize( se.start, se.end, subexons[j].start, subexons[j].end ) ; 
-					depth[i][j] += overlap * se.avgDepth ;		
+					depth[j * sampleCnt + i] += overlap * se.avgDepth ;		
 				}
-				
-				if ( fgets( buffer, sizeof( buffer ), fileList[i] ) == NULL )
-					break ;
 			}
 		}
 		// Normalize the depth
 		for ( i = 0 ; i < sampleCnt ; ++i )
 		{
 			for ( j = 0 ; j < cnt ; ++j )
-				depth[i][j] /= ( subexons[j].end - subexons[j].start + 1 ) ;
+				depth[j * sampleCnt + i] /= ( subexons[j].end - subexons[j].start + 1 ) ;
 		}
+	}
+public:
+	SubexonCorrelation() 
+	{
+		offset = 0 ;
+		ownFiles = false ;
+		depthMatrix = NULL ;
+		sampleCnt = 0 ;
+		seCnt = 0 ;
+		depth = avg = var = NULL ;
+		capacity = 0 ;
+	}
 
-		// Compute the correlation.
-		double *avg = new double[cnt] ;
-		double *var = new double[cnt] ;
-		if ( correlation != NULL )
+	~SubexonCorrelation()
+	{
+		int cnt = fileList.size() ;
+		int i ;
+		if ( ownFiles )
 		{
-			for ( i = 0 ; i < prevSeCnt ; ++i )
-				delete[] correlation[i] ;
-			delete[] correlation ;
+			for ( i = 0 ; i < cnt ; ++i )
+				delete fileList[i] ;
+			if ( depthMatrix != NULL )
+				delete depthMatrix ;
 		}
-
-		correlation = new double*[cnt] ;
-		for ( i = 0 ; i < cnt ; ++i )
-			correlation[i] = new double[cnt] ;
-		
-		memset( avg, 0, sizeof( double ) * cnt ) ;
-		memset( var, 0, sizeof( double ) * cnt ) ;
-		for ( i = 0 ; i < cnt ; ++i ) 
+		if ( depth != NULL )
 		{
-			//avg[i] = 0 ;
-			//var[i] = 0 ;
-			memset( correlation[i], 0, sizeof( double ) * cnt ) ;
-			correlation[i][i] = 1 ;
+			delete[] depth ;
+			delete[] avg ;
+			delete[] var ;
 		}
+	}
 
-		for ( i = 0 ; i < sampleCnt ; ++i )
-			for ( j = 0 ; j < cnt ; ++j )
+	void Initialize( char *f )
+	{
+		FILE *fpSl ;
+		fpSl = fopen( f, "r" ) ;
+		char buffer[1024] ;
+		while ( fgets( buffer, sizeof( buffer ), fpSl ) != NULL )
+		{
+			int len = strlen( buffer ) ;
+			if ( buffer[len - 1] == '\n' )
+			{
+				buffer[len - 1] = '\0' ;
+				--len ;
+
+			}
+			SubexonFile *file = new SubexonFile ;
+			if ( !file->Open( buffer ) )
 			{
-				avg[j] += depth[i][j] ;
-				var[j] += depth[i][j] * depth[i][j] ;
+				fprintf( stderr, "Could not open file %s\n", buffer ) ;
+				exit( 1 ) ;
 			}
-		for ( i = 0 ; i < cnt ; ++i )
+			fileList.push_back( file ) ;
+		}
+		fclose( fpSl ) ;
+		ownFiles = true ;
+		pendingSubexons.resize( fileList.size() ) ;
+		sampleCnt = fileList.size() ;
+	}
+
+	void InitializeDepthMatrix( char *f )
+	{
+		depthMatrix = new SubexonDepthMatrix ;
+		if ( !depthMatrix->Open( f ) )
 		{
-			avg[i] /= sampleCnt ;
-			var[i] = var[i] / sampleCnt - avg[i] * avg[i] ;
+			fprintf( stderr, "Could not open file %s\n", f ) ;
+			exit( 1 ) ;
 		}
-		
-		for ( i = 0 ; i < sampleCnt ; ++i )
-			for ( j = 0 ; j < cnt ; ++j )
-				for ( k = j + 1 ; k < cnt ; ++k )
-				{
-					//if ( subexons[j].geneId == subexons[k].geneId )
-					correlation[j][k] += depth[i][j] * depth[i][k] ;	
-				}
-		for ( j = 0 ; j < cnt ; ++j )
-			for ( k = j + 1 ; k < cnt ; ++k )
+		ownFiles = true ;
+		sampleCnt = depthMatrix->GetSampleCount() ;
+	}
+	
+	// We assume the subexons only contains the subexons we are interested in.
+	// And we assume that each time we call this function, the subexons we are interested are 
+	// sorted in order.
+	void ComputeCorrelation( struct _subexon *subexons, int cnt, Alignments &alignments )
+	{
+		if ( sampleCnt <= 1 )
+			return ;
+		int i, j ;
+		seCnt = cnt ;
+		ClearMemo() ;
+
+		// Obtain the depth matrix.
+		Reserve( cnt ) ;
+		memset( depth, 0, sizeof( double ) * cnt * sampleCnt ) ;
+		if ( depthMatrix != NULL )
+		{
+			if ( !depthMatrix->GetDepth( subexons, cnt, alignments, depth ) )
 			{
-				if ( var[j] > 1e-6 && var[k] > 1e-6 )
-				{
-					correlation[j][k] = ( correlation[j][k] / sampleCnt - avg[j] * avg[k] ) / sqrt( var[j] * var[k] ) ;
-				}
-				else
-					correlation[j][k] = 0 ;
-				//printf( "%d %d %d\n", j, k, cnt ) ;
-				correlation[k][j] = correlation[j][k] ;
+				fprintf( stderr, "The depth matrix does not match the subexon file.\n" ) ;
+				exit( 1 ) ;
 			}
-		//printf( "%lf\n", correlation[0][1] ) ;
-		// Release the memory.
-		for ( i = 0 ; i < sampleCnt ; ++i )
-			delete[] depth[i] ;
-		delete[] depth ;
-		delete[] avg ;
-		delete[] var ;
+		}
+		else
+			ReadDepth( subexons, cnt, alignments, depth ) ;
 
-		prevSeCnt = cnt ;
+		// The mean and variance of each subexon. The pairs are left to Query.
+		memset( avg, 0, sizeof( double ) * cnt ) ;
+		memset( var, 0, sizeof( double ) * cnt ) ;
+		for ( j = 0 ; j < cnt ; ++j )
+		{
+			const double *d = depth + j * sampleCnt ;
+			for ( i = 0 ; i < sampleCnt ; ++i )
+			{
+				avg[j] += d[i] ;
+				var[j] += d[i] * d[i] ;
+			}
+			avg[j] /= sampleCnt ;
+			var[j] = var[j] / sampleCnt - avg[j] * avg[j] ;
+		}
 	}
 
 	double Query( int i, int j )
 	{
-		if ( fileList.size() > 1 )
-			return correlation[i][j] ;
-		else
+		if ( sampleCnt <= 1 )
 			return 0 ;
+		if ( i == j )
+			return 1 ;
+		if ( var[i] <= 1e-6 || var[j] <= 1e-6 )
+			return 0 ;
+
+		// The same pairs are queried many times, e.g. for each sample in the DP, so each pair is computed once.
+		int64_t key = i < j ? (int64_t)i * seCnt + j : (int64_t)j * seCnt + i ;
+		if ( memoKeys.size() > 0 )
+		{
+			int slot = MemoSlot( key ) ;
+			if ( memoKeys[slot] == key )
+				return memoValues[slot] ;
+		}
+
+		int k ;
+		double sum = 0 ;
+		const double *di = depth + i * sampleCnt ;
+		const double *dj = depth + j * sampleCnt ;
+		for ( k = 0 ; k < sampleCnt ; ++k )
+			sum += di[k] * dj[k] ;
+		double ret = ( sum / sampleCnt - avg[i] * avg[j] ) / sqrt( var[i] * var[j] ) ;
+		AddMemo( key, ret ) ;
+		return ret ;
 	}
 
 	void Assign( const SubexonCorrelation &c )
 	{
-		int i ;
-		fileList = c.fileList ;
-		if ( fileList.size() <= 1 )
+		sampleCnt = c.sampleCnt ; // only the count and the depth are used by the copy.
+		if ( sampleCnt <= 1 )
 			return ;
 
-		if ( correlation != NULL )
-		{
-			for ( i = 0 ; i < seCnt ; ++i )
-				delete[] correlation[i] ;
-			delete[] correlation ;
-		}
-		
 		seCnt = c.seCnt ;
-		correlation = new double*[seCnt] ;
-		for ( i = 0 ; i < seCnt ; ++i )
-		{
-			correlation[i] = new double[seCnt] ;
-			memcpy( correlation[i], c.correlation[i], sizeof( double ) * seCnt ) ;
-		}
+		ClearMemo() ;
+		Reserve( seCnt ) ;
+		memcpy( depth, c.depth, sizeof( double ) * seCnt * sampleCnt ) ;
+		memcpy( avg, c.avg, sizeof( double ) * seCnt ) ;
+		memcpy( var, c.var, sizeof( double ) * seCnt ) ;
+	}
+
+	// Take the depth of the current gene from c without copying. c gets the buffers held here,
+	// which are reused for its next gene.
+	void Swap( SubexonCorrelation &c )
+	{
+		double *tmp ;
+		int t ;
+		sampleCnt = c.sampleCnt ;
+		t = seCnt ; seCnt = c.seCnt ; c.seCnt = t ;
+		t = capacity ; capacity = c.capacity ; c.capacity = t ;
+		tmp = depth ; depth = c.depth ; c.depth = tmp ;
+		tmp = avg ; avg = c.avg ; c.avg = tmp ;
+		tmp = var ; var = c.var ; c.var = tmp ;
+		ClearMemo() ;
+		c.ClearMemo() ;
 	}
 } ;
 
@@ -0,0 +1,257 @@
+#ifndef _MOURISL_CLASSES_SUBEXONDEPTHMATRIX_HEADER
+#define _MOURISL_CLASSES_SUBEXONDEPTHMATRIX_HEADER
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+
+#include "SubexonFile.hpp"
+
+// The average depth of each sample on each subexon of the combined subexon file, written by combine-subexons
+// so classes does not need to go through the subexon files of the samples.
+// Layout, each section padded to 8 bytes:
+//	"PSIDEP01", int sample count, int 0
+//	the chunks, one for each chromosome:
+//		int length and the characters of the chromosome name
+//		int64 row count
+//		int start and int end of each row, 1-based as in the combined subexon file
+//		double depth of each row and each sample, row by row
+//	the index: int64 chunk count and the int64 offset of each chunk
+//	int64 offset of the index
+#define SUBEXON_DEPTH_MATRIX_MAGIC "PSIDEP01"
+
+class SubexonDepthMatrixWriter
+{
+private:
+	FILE *fp ;
+	int64_t offset ;
+	std::vector<int64_t> chunkOffsets ;
+
+	static void WritePad( FILE *fp, int64_t &offset )
+	{
+		char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0} ;
+		int64_t padded = ( offset + 7 ) / 8 * 8 ;
+		fwrite( zeros, 1, padded - offset, fp ) ;
+		offset = padded ;
+	}
+public:
+	SubexonDepthMatrixWriter()
+	{
+		fp = NULL ;
+	}
+
+	void Open( FILE *f, int sampleCnt )
+	{
+		int zero = 0 ;
+		fp = f ;
+		fwrite( SUBEXON_DEPTH_MATRIX_MAGIC, 1, 8, fp ) ;
+		fwrite( &sampleCnt, sizeof( int ), 1, fp ) ;
+		fwrite( &zero, sizeof( int ), 1, fp ) ;
+		offset = 16 ;
+	}
+
+	// The chunk of a chromosome is written to its own file first, so the chromosomes can be computed in parallel.
+	// The depth of each row follows with WriteChunkDepth.
+	static void WriteChunkRows( FILE *fpChunk, const char *chrName, std::vector<int> &starts, std::vector<int> &ends )
+	{
+		int len = strlen( chrName ) ;
+		int64_t rowCnt = starts.size() ;
+		int64_t chunkOffset = 0 ;
+		fwrite( &len, sizeof( int ), 1, fpChunk ) ;
+		fwrite( chrName, 1, len, fpChunk ) ;
+		chunkOffset += sizeof( int ) + len ;
+		WritePad( fpChunk, chunkOffset ) ;
+		fwrite( &rowCnt, sizeof( int64_t ), 1, fpChunk ) ;
+		if ( rowCnt > 0 )
+		{
+			fwrite( &starts[0], sizeof( int ), rowCnt, fpChunk ) ;
+			fwrite( &ends[0], sizeof( int ), rowCnt, fpChunk ) ;
+		}
+		chunkOffset += sizeof( int64_t ) + 2 * rowCnt * sizeof( int ) ;
+		WritePad( fpChunk, chunkOffset ) ;
+	}
+
+	static void WriteChunkDepth( FILE *fpChunk, double *depth, int sampleCnt )
+	{
+		fwrite( depth, sizeof( double ), sampleCnt, fpChunk ) ;
+	}
+
+	// Append a chunk written by WriteChunkRows and WriteChunkDepth.
+	void AppendChunk( FILE *fpChunk )
+	{
+		char buffer[65536] ;
+		size_t size ;
+		chunkOffsets.push_back( offset ) ;
+		rewind( fpChunk ) ;
+		while ( ( size = fread( buffer, 1, sizeof( buffer ), fpChunk ) ) > 0 )
+		{
+			fwrite( buffer, 1, size, fp ) ;
+			offset += size ;
+		}
+	}
+
+	void Close()
+	{
+		int64_t chunkCnt = chunkOffsets.size() ;
+		int64_t indexOffset = offset ;
+		fwrite( &chunkCnt, sizeof( int64_t ), 1, fp ) ;
+		if ( chunkCnt > 0 )
+			fwrite( &chunkOffsets[0], sizeof( int64_t ), chunkCnt, fp ) ;
+		fwrite( &indexOffset, sizeof( int64_t ), 1, fp ) ;
+		fp = NULL ;
+	}
+} ;
+
+class SubexonDepthMatrix
+{
+private:
+	struct _depthChunk
+	{
+		std::string chrName ;
+		int64_t rowCnt ;
+		const int *start, *end ;
+		const double *depth ;
+	} ;
+
+	char *map ;
+	size_t mapSize ;
+	int sampleCnt ;
+	std::vector<struct _depthChunk> chunks ;
+	Alignments *mappedAlignments ;
+	std::vector<int> chrChunk ; // the chunk of each chromosome in the alignment file, -1 if none.
+
+	void Corrupted()
+	{
+		fprintf( stderr, "The depth matrix file is truncated.\n" ) ;
+		exit( 1 ) ;
+	}
+
+	void MapChroms( Alignments &alignments )
+	{
+		int i ;
+		int chunkCnt = chunks.size() ;
+		chrChunk.assign( alignments.GetChromCount(), -1 ) ;
+		for ( i = 0 ; i < chunkCnt ; ++i )
+			chrChunk[ alignments.GetChromIdFromName( chunks[i].chrName.c_str() ) ] = i ;
+		mappedAlignments = &alignments ;
+	}
+public:
+	SubexonDepthMatrix()
+	{
+		map = NULL ;
+		sampleCnt = 0 ;
+		mappedAlignments = NULL ;
+	}
+
+	~SubexonDepthMatrix()
+	{
+		if ( map != NULL )
+			munmap( map, mapSize ) ;
+	}
+
+	bool Open( const char *file )
+	{
+		FILE *fp = fopen( file, "r" ) ;
+		if ( fp == NULL )
+			return false ;
+		struct stat st ;
+		if ( fstat( fileno( fp ), &st ) != 0 || st.st_size < 24 )
+		{
+			fclose( fp ) ;
+			return false ;
+		}
+		mapSize = st.st_size ;
+		map = (char *)mmap( NULL, mapSize, PROT_READ, MAP_PRIVATE, fileno( fp ), 0 ) ;
+		fclose( fp ) ;
+		if ( map == MAP_FAILED )
+		{
+			map = NULL ;
+			return false ;
+		}
+		if ( memcmp( map, SUBEXON_DEPTH_MATRIX_MAGIC, 8 ) )
+		{
+			fprintf( stderr, "%s is not a depth matrix file.\n", file ) ;
+			exit( 1 ) ;
+		}
+		memcpy( &sampleCnt, map + 8, sizeof( int ) ) ;
+
+		int64_t indexOffset, chunkCnt, i ;
+		memcpy( &indexOffset, map + mapSize - sizeof( int64_t ), sizeof( int64_t ) ) ;
+		if ( indexOffset < 16 || indexOffset + (int64_t)sizeof( int64_t ) * 2 > (int64_t)mapSize )
+			Corrupted() ;
+		memcpy( &chunkCnt, map + indexOffset, sizeof( int64_t ) ) ;
+		if ( indexOffset + ( chunkCnt + 2 ) * (int64_t)sizeof( int64_t ) > (int64_t)mapSize )
+			Corrupted() ;
+		for ( i = 0 ; i < chunkCnt ; ++i )
+		{
+			int64_t offset ;
+			int len ;
+			struct _depthChunk chunk ;
+			memcpy( &offset, map + indexOffset + ( i + 1 ) * sizeof( int64_t ), sizeof( int64_t ) ) ;
+			if ( offset + (int64_t)sizeof( int ) > indexOffset )
+				Corrupted() ;
+			memcpy( &len, map + offset, sizeof( int ) ) ;
+			offset += sizeof( int ) ;
+			chunk.chrName = std::string( map + offset, len ) ;
+			offset = ( offset + len + 7 ) / 8 * 8 ;
+			memcpy( &chunk.rowCnt, map + offset, sizeof( int64_t ) ) ;
+			offset += sizeof( int64_t ) ;
+			chunk.start = (const int *)( map + offset ) ;
+			chunk.end = chunk.start + chunk.rowCnt ;
+			offset = ( offset + 2 * chunk.rowCnt * sizeof( int ) + 7 ) / 8 * 8 ;
+			chunk.depth = (const double *)( map + offset ) ;
+			if ( offset + chunk.rowCnt * sampleCnt * (int64_t)sizeof( double ) > indexOffset )
+				Corrupted() ;
+			chunks.push_back( chunk ) ;
+		}
+		return true ;
+	}
+
+	int GetSampleCount()
+	{
+		return sampleCnt ;
+	}
+
+	// Fill depth[i * sampleCnt + sample] for the subexons, which are sorted and use 0-based coordinates.
+	// Return false if some subexon is not in the matrix.
+	bool GetDepth( struct _subexon *subexons, int cnt, Alignments &alignments, double *depth )
+	{
+		int i ;
+		if ( mappedAlignments != &alignments )
+			MapChroms( alignments ) ;
+		if ( subexons[0].chrId >= (int)chrChunk.size() || chrChunk[ subexons[0].chrId ] == -1 )
+			return false ;
+		struct _depthChunk &chunk = chunks[ chrChunk[ subexons[0].chrId ] ] ;
+
+		// Locate the first row by the start, then go along the rows.
+		int64_t l = 0, r = chunk.rowCnt ;
+		while ( l < r )
+		{
+			int64_t m = ( l + r ) / 2 ;
+			if ( chunk.start[m] < subexons[0].start + 1 )
+				l = m + 1 ;
+			else
+				r = m ;
+		}
+		for ( i = 0 ; i < cnt ; ++i )
+		{
+			if ( subexons[i].chrId != subexons[0].chrId )
+				return false ;
+			for ( ; l < chunk.rowCnt && chunk.start[l] <= subexons[i].start + 1 ; ++l )
+				if ( chunk.start[l] == subexons[i].start + 1 && chunk.end[l] == subexons[i].end + 1 )
+					break ;
+			if ( l >= chunk.rowCnt || chunk.start[l] != subexons[i].start + 1 || chunk.end[l] != subexons[i].end + 1 )
+				return false ;
+			memcpy( depth + i * sampleCnt, chunk.depth + l * sampleCnt, sizeof( double ) * sampleCnt ) ;
+		}
+		return true ;
+	}
+} ;
+
+#endif
@@ -0,0 +1,582 @@
+#ifndef _MOURISL_CLASSES_SUBEXONFILE_HEADER
+#define _MOURISL_CLASSES_SUBEXONFILE_HEADER
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+#include <map>
+
+#include "alignments.hpp"
+
+struct _subexon
+{
+	int chrId ;
+	int geneId ;
+	int start, end ;
+	int leftType, rightType ;
+	double avgDepth ;
+	//double ratio, classifier ;
+	double leftRatio, rightRatio ;
+	double leftClassifier, rightClassifier ;
+	int lcCnt, rcCnt ;
+	int leftStrand, rightStrand ;
+
+	int nextCnt, prevCnt ;
+	int *next, *prev ;
+
+	bool canBeStart, canBeEnd ;
+} ;
+
+// The binary subexon file holds the same content as the text one, column by column, so it can be mmapped
+// instead of parsed. The doubles are rounded as the text output prints them, so both formats read the same.
+// Layout, each section padded to 8 bytes:
+//	"PSISUB01", int sorted, int chrCnt, int64 subexon count, int64 adjacency count, int64 header length
+//	the header lines ("#..."), each ended with '\n'
+//	the chromosome names: int length and the characters
+//	int64 begin and end subexon of each chromosome, valid if sorted is 1
+//	int64 offset of each subexon's prev and next coordinates, subexon count + 1 of them
+//	double avgDepth, leftRatio, rightRatio, leftClassifier, rightClassifier
+//	int chrId, start, end, prevCnt, nextCnt
+//	int adjacency: the prev coordinates followed by the next coordinates of each subexon
+//	char leftType, rightType, leftStrand, rightStrand
+#define SUBEXON_FILE_MAGIC "PSISUB01"
+
+class SubexonFile
+{
+private:
+	FILE *fp ;
+	bool ownFp ;
+	bool binary ;
+	std::vector<std::string> headerLines ;
+	char buffer[4096] ;
+
+	// The binary file.
+	char *map ;
+	size_t mapSize ;
+	int sorted ;
+	int chrCnt ;
+	int64_t seCnt ;
+	int64_t pos ;
+	std::vector<std::string> chrNames ;
+	Alignments *mappedAlignments ; // chrIdMap is for this alignment file.
+	std::vector<int> chrIdMap ; // file chromosome to the alignment's chromosome id.
+	std::vector<int> fileChrId ; // the reverse of chrIdMap.
+	const int64_t *chrBegin, *chrEnd ;
+	const int64_t *adjOffset ;
+	const double *avgDepth, *leftRatio, *rightRatio, *leftClassifier, *rightClassifier ;
+	const int *chrId, *start, *end, *prevCnt, *nextCnt ;
+	const int *adj ;
+	const char *leftType, *rightType, *leftStrand, *rightStrand ;
+
+	static int64_t Pad( int64_t offset )
+	{
+		return ( offset + 7 ) / 8 * 8 ;
+	}
+
+	static int StrandToInt( char s )
+	{
+		if ( s == '+' )
+			return 1 ;
+		else if ( s == '-' )
+			return -1 ;
+		return 0 ;
+	}
+
+	void Truncated()
+	{
+		fprintf( stderr, "The binary subexon file is truncated.\n" ) ;
+		exit( 1 ) ;
+	}
+
+	void MapChroms( Alignments &alignments )
+	{
+		int i ;
+		chrIdMap.resize( chrCnt ) ;
+		fileChrId.assign( alignments.GetChromCount(), -1 ) ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+		{
+			chrIdMap[i] = alignments.GetChromIdFromName( chrNames[i].c_str() ) ;
+			fileChrId[ chrIdMap[i] ] = i ;
+		}
+		mappedAlignments = &alignments ;
+	}
+
+	void OpenBinary()
+	{
+		struct stat st ;
+		if ( fstat( fileno( fp ), &st ) != 0 )
+		{
+			fprintf( stderr, "Could not stat the subexon file.\n" ) ;
+			exit( 1 ) ;
+		}
+		mapSize = st.st_size ;
+		map = (char *)mmap( NULL, mapSize, PROT_READ, MAP_PRIVATE, fileno( fp ), 0 ) ;
+		if ( map == MAP_FAILED )
+		{
+			fprintf( stderr, "Could not map the subexon file.\n" ) ;
+			exit( 1 ) ;
+		}
+
+		int64_t offset = 8 ;
+		int64_t adjCnt, headerLen ;
+		if ( mapSize < 40 )
+			Truncated() ;
+		memcpy( &sorted, map + offset, sizeof( int ) ) ; offset += sizeof( int ) ;
+		memcpy( &chrCnt, map + offset, sizeof( int ) ) ; offset += sizeof( int ) ;
+		memcpy( &seCnt, map + offset, sizeof( int64_t ) ) ; offset += sizeof( int64_t ) ;
+		memcpy( &adjCnt, map + offset, sizeof( int64_t ) ) ; offset += sizeof( int64_t ) ;
+		memcpy( &headerLen, map + offset, sizeof( int64_t ) ) ; offset += sizeof( int64_t ) ;
+
+		if ( offset + headerLen > (int64_t)mapSize )
+			Truncated() ;
+		const char *p = map + offset ;
+		const char *hEnd = p + headerLen ;
+		while ( p < hEnd )
+		{
+			const char *q = (const char *)memchr( p, '\n', hEnd - p ) ;
+			if ( q == NULL )
+				q = hEnd ;
+			headerLines.push_back( std::string( p, q - p ) ) ;
+			p = q + 1 ;
+		}
+		offset = Pad( offset + headerLen ) ;
+
+		int i ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+		{
+			int len ;
+			if ( offset + (int64_t)sizeof( int ) > (int64_t)mapSize )
+				Truncated() ;
+			memcpy( &len, map + offset, sizeof( int ) ) ;
+			offset += sizeof( int ) ;
+			if ( len < 0 || offset + len > (int64_t)mapSize )
+				Truncated() ;
+			chrNames.push_back( std::string( map + offset, len ) ) ;
+			offset += len ;
+		}
+		offset = Pad( offset ) ;
+
+		int64_t need = offset + 2 * chrCnt * sizeof( int64_t ) + ( seCnt + 1 ) * sizeof( int64_t )
+			+ 5 * seCnt * sizeof( double ) + 5 * seCnt * sizeof( int ) + adjCnt * sizeof( int ) + 4 * seCnt ;
+		if ( need > (int64_t)mapSize )
+			Truncated() ;
+		chrBegin = (const int64_t *)( map + offset ) ; offset += chrCnt * sizeof( int64_t ) ;
+		chrEnd = (const int64_t *)( map + offset ) ; offset += chrCnt * sizeof( int64_t ) ;
+		adjOffset = (const int64_t *)( map + offset ) ; offset += ( seCnt + 1 ) * sizeof( int64_t ) ;
+		avgDepth = (const double *)( map + offset ) ; offset += seCnt * sizeof( double ) ;
+		leftRatio = (const double *)( map + offset ) ; offset += seCnt * sizeof( double ) ;
+		rightRatio = (const double *)( map + offset ) ; offset += seCnt * sizeof( double ) ;
+		leftClassifier = (const double *)( map + offset ) ; offset += seCnt * sizeof( double ) ;
+		rightClassifier = (const double *)( map + offset ) ; offset += seCnt * sizeof( double ) ;
+		chrId = (const int *)( map + offset ) ; offset += seCnt * sizeof( int ) ;
+		start = (const int *)( map + offset ) ; offset += seCnt * sizeof( int ) ;
+		end = (const int *)( map + offset ) ; offset += seCnt * sizeof( int ) ;
+		prevCnt = (const int *)( map + offset ) ; offset += seCnt * sizeof( int ) ;
+		nextCnt = (const int *)( map + offset ) ; offset += seCnt * sizeof( int ) ;
+		adj = (const int *)( map + offset ) ; offset += adjCnt * sizeof( int ) ;
+		leftType = map + offset ; offset += seCnt ;
+		rightType = map + offset ; offset += seCnt ;
+		leftStrand = map + offset ; offset += seCnt ;
+		rightStrand = map + offset ; offset += seCnt ;
+		pos = 0 ;
+	}
+
+	void OpenText()
+	{
+		// Collect the header lines.
+		long offset = 0 ;
+		while ( fgets( buffer, sizeof( buffer ), fp ) != NULL )
+		{
+			if ( buffer[0] != '#' )
+				break ;
+			int len = strlen( buffer ) ;
+			if ( len > 0 && buffer[len - 1] == '\n' )
+				buffer[len - 1] = '\0' ;
+			headerLines.push_back( std::string( buffer ) ) ;
+			offset = ftell( fp ) ;
+		}
+		fseek( fp, offset, SEEK_SET ) ;
+	}
+public:
+	SubexonFile()
+	{
+		fp = NULL ;
+		map = NULL ;
+		binary = false ;
+		ownFp = false ;
+		mappedAlignments = NULL ;
+	}
+
+	~SubexonFile()
+	{
+		Close() ;
+	}
+
+	// Open the subexon file, binary or text.
+	bool Open( const char *file )
+	{
+		FILE *f = fopen( file, "r" ) ;
+		if ( f == NULL )
+			return false ;
+		Open( f ) ;
+		ownFp = true ;
+		if ( binary )
+		{
+			// The mapping stays after the file is closed.
+			fclose( fp ) ;
+			fp = NULL ;
+		}
+		return true ;
+	}
+
+	// Use an opened subexon file, which the caller closes.
+	void Open( FILE *f )
+	{
+		char magic[8] ;
+		Close() ;
+		fp = f ;
+		ownFp = false ;
+		rewind( fp ) ;
+		binary = ( fread( magic, 1, 8, fp ) == 8 && !memcmp( magic, SUBEXON_FILE_MAGIC, 8 ) ) ;
+		rewind( fp ) ;
+		if ( binary )
+			OpenBinary() ;
+		else
+			OpenText() ;
+	}
+
+	void Close()
+	{
+		if ( map != NULL )
+			munmap( map, mapSize ) ;
+		map = NULL ;
+		if ( fp != NULL && ownFp )
+			fclose( fp ) ;
+		fp = NULL ;
+		headerLines.clear() ;
+		chrNames.clear() ;
+		mappedAlignments = NULL ;
+	}
+
+	bool IsBinary()
+	{
+		return binary ;
+	}
+
+	int GetHeaderLineCount()
+	{
+		return headerLines.size() ;
+	}
+
+	const char *GetHeaderLine( int i )
+	{
+		return headerLines[i].c_str() ;
+	}
+
+	void Rewind()
+	{
+		if ( binary )
+			pos = 0 ;
+		else
+		{
+			rewind( fp ) ;
+			headerLines.clear() ;
+			OpenText() ;
+		}
+	}
+
+	// Move to the first subexon of the chromosome. Only the sorted binary file has the index;
+	// return false if it is not available.
+	bool SeekChrom( int chrom, Alignments &alignments )
+	{
+		if ( !binary || !sorted )
+			return false ;
+		if ( mappedAlignments != &alignments )
+			MapChroms( alignments ) ;
+		if ( chrom >= (int)fileChrId.size() || fileChrId[ chrom ] == -1 )
+			return false ;
+		int64_t to = chrBegin[ fileChrId[ chrom ] ] ;
+		if ( to > pos ) // never move back.
+			pos = to ;
+		return true ;
+	}
+
+	// Read the next subexon, like SubexonGraph::InputSubexon. The coordinates are 1-based.
+	bool Next( struct _subexon &se, Alignments &alignments, bool needPrevNext = false )
+	{
+		if ( !binary )
+		{
+			char chrName[1024] ;
+			while ( fgets( buffer, sizeof( buffer ), fp ) != NULL )
+			{
+				if ( buffer[0] == '#' )
+					continue ;
+				ParseLine( buffer, chrName, se, needPrevNext ) ;
+				se.chrId = alignments.GetChromIdFromName( chrName ) ;
+				return true ;
+			}
+			return false ;
+		}
+
+		if ( pos >= seCnt )
+			return false ;
+		if ( mappedAlignments != &alignments )
+			MapChroms( alignments ) ;
+
+		se.chrId = chrIdMap[ chrId[pos] ] ;
+		se.start = start[pos] ;
+		se.end = end[pos] ;
+		se.leftType = leftType[pos] ;
+		se.rightType = rightType[pos] ;
+		se.leftStrand = StrandToInt( leftStrand[pos] ) ;
+		se.rightStrand = StrandToInt( rightStrand[pos] ) ;
+		se.avgDepth = avgDepth[pos] ;
+		se.leftRatio = leftRatio[pos] ;
+		se.rightRatio = rightRatio[pos] ;
+		se.leftClassifier = leftClassifier[pos] ;
+		se.rightClassifier = rightClassifier[pos] ;
+		se.nextCnt = se.prevCnt = 0 ;
+		se.next = se.prev = NULL ;
+		se.lcCnt = se.rcCnt = 0 ;
+		if ( needPrevNext )
+		{
+			const int *p = adj + adjOffset[pos] ;
+			se.prevCnt = prevCnt[pos] ;
+			se.prev = new int[ se.prevCnt ] ;
+			memcpy( se.prev, p, sizeof( int ) * se.prevCnt ) ;
+			se.nextCnt = nextCnt[pos] ;
+			se.next = new int[ se.nextCnt ] ;
+			memcpy( se.next, p + se.prevCnt, sizeof( int ) * se.nextCnt ) ;
+		}
+		++pos ;
+		return true ;
+	}
+
+	// Print the binary subexon file in the text format.
+	void PrintText( FILE *fpOut )
+	{
+		int64_t i ;
+		int j ;
+		int size = headerLines.size() ;
+		for ( j = 0 ; j < size ; ++j )
+			fprintf( fpOut, "%s\n", headerLines[j].c_str() ) ;
+		if ( !binary )
+		{
+			while ( fgets( buffer, sizeof( buffer ), fp ) != NULL )
+				fputs( buffer, fpOut ) ;
+			return ;
+		}
+		for ( i = 0 ; i < seCnt ; ++i )
+		{
+			fprintf( fpOut, "%s %d %d %d %d %c %c %lf %lf %lf %lf %lf ", chrNames[ chrId[i] ].c_str(), start[i], end[i],
+				leftType[i], rightType[i], leftStrand[i], rightStrand[i], avgDepth[i],
+				leftRatio[i], rightRatio[i], leftClassifier[i], rightClassifier[i] ) ;
+			const int *p = adj + adjOffset[i] ;
+			fprintf( fpOut, "%d ", prevCnt[i] ) ;
+			for ( j = 0 ; j < prevCnt[i] ; ++j )
+				fprintf( fpOut, "%d ", p[j] ) ;
+			p += prevCnt[i] ;
+			fprintf( fpOut, "%d ", nextCnt[i] ) ;
+			for ( j = 0 ; j < nextCnt[i] ; ++j )
+				fprintf( fpOut, "%d ", p[j] ) ;
+			fprintf( fpOut, "\n" ) ;
+		}
+	}
+
+	// Parse a line of the text format.
+	static int ParseLine( char *in, char *chrName, struct _subexon &se, bool needPrevNext = false )
+	{
+		int i ;
+		char ls[3], rs[3] ;
+		sscanf( in, "%s %d %d %d %d %s %s %lf %lf %lf %lf %lf", chrName, &se.start, &se.end, &se.leftType, &se.rightType, ls, rs,
+				&se.avgDepth, &se.leftRatio, &se.rightRatio,
+				&se.leftClassifier, &se.rightClassifier ) ;
+		se.nextCnt = se.prevCnt = 0 ;
+		se.next = se.prev = NULL ;
+		se.lcCnt = se.rcCnt = 0 ;
+
+		se.leftStrand = StrandToInt( ls[0] ) ;
+		se.rightStrand = StrandToInt( rs[0] ) ;
+
+		if ( needPrevNext )
+		{
+			char *p = in ;
+			// Locate the offset for prevCnt
+			for ( i = 0 ; i <= 11 ; ++i )
+			{
+				p = strchr( p, ' ' ) ;
+				++p ;
+			}
+
+			sscanf( p, "%d", &se.prevCnt ) ;
+			p = strchr( p, ' ' ) ;
+			++p ;
+			se.prev = new int[ se.prevCnt ] ;
+			for ( i = 0 ; i < se.prevCnt ; ++i )
+			{
+				sscanf( p, "%d", &se.prev[i] ) ;
+				p = strchr( p, ' ' ) ;
+				++p ;
+			}
+
+			sscanf( p, "%d", &se.nextCnt ) ;
+			p = strchr( p, ' ' ) ;
+			++p ;
+			se.next = new int[ se.nextCnt ] ;
+			for ( i = 0 ; i < se.nextCnt ; ++i )
+			{
+				sscanf( p, "%d", &se.next[i] ) ;
+				p = strchr( p, ' ' ) ;
+				++p ;
+			}
+
+		}
+		return 1 ;
+	}
+} ;
+
+// Convert the text subexon output into the binary format.
+class SubexonFileWriter
+{
+private:
+	std::string header ;
+	std::vector<std::string> chrNames ;
+	std::map<std::string, int> chrIds ;
+	int sorted ;
+	std::vector<int64_t> chrBegin, chrEnd ;
+	std::vector<int64_t> adjOffset ;
+	std::vector<double> avgDepth, leftRatio, rightRatio, leftClassifier, rightClassifier ;
+	std::vector<int> chrId, start, end, prevCnt, nextCnt ;
+	std::vector<int> adj ;
+	std::vector<char> leftType, rightType, leftStrand, rightStrand ;
+
+	template <class T>
+	void WriteVector( FILE *fp, std::vector<T> &v )
+	{
+		if ( v.size() > 0 )
+			fwrite( &v[0], sizeof( T ), v.size(), fp ) ;
+	}
+
+	void WritePad( FILE *fp, int64_t &offset )
+	{
+		char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0} ;
+		int64_t padded = ( offset + 7 ) / 8 * 8 ;
+		fwrite( zeros, 1, padded - offset, fp ) ;
+		offset = padded ;
+	}
+public:
+	SubexonFileWriter()
+	{
+		sorted = 1 ;
+		adjOffset.push_back( 0 ) ;
+	}
+
+	void AddLine( char *line )
+	{
+		if ( line[0] == '#' )
+		{
+			header += line ;
+			if ( header[ header.size() - 1 ] != '\n' )
+				header += "\n" ;
+			return ;
+		}
+
+		char chrName[1024] ;
+		char ls[3], rs[3] ;
+		struct _subexon se ;
+		SubexonFile::ParseLine( line, chrName, se, true ) ;
+		sscanf( line, "%*s %*s %*s %*s %*s %2s %2s", ls, rs ) ;
+
+		int id ;
+		std::map<std::string, int>::iterator it = chrIds.find( chrName ) ;
+		if ( it == chrIds.end() )
+		{
+			id = chrNames.size() ;
+			chrIds[ chrName ] = id ;
+			chrNames.push_back( chrName ) ;
+			chrBegin.push_back( chrId.size() ) ;
+			chrEnd.push_back( chrId.size() ) ;
+		}
+		else
+		{
+			id = it->second ;
+			if ( chrId.back() != id )
+				sorted = 0 ; // the chromosome is not contiguous.
+		}
+		chrEnd[id] = chrId.size() + 1 ;
+
+		chrId.push_back( id ) ;
+		start.push_back( se.start ) ;
+		end.push_back( se.end ) ;
+		leftType.push_back( se.leftType ) ;
+		rightType.push_back( se.rightType ) ;
+		leftStrand.push_back( ls[0] ) ;
+		rightStrand.push_back( rs[0] ) ;
+		avgDepth.push_back( se.avgDepth ) ;
+		leftRatio.push_back( se.leftRatio ) ;
+		rightRatio.push_back( se.rightRatio ) ;
+		leftClassifier.push_back( se.leftClassifier ) ;
+		rightClassifier.push_back( se.rightClassifier ) ;
+		prevCnt.push_back( se.prevCnt ) ;
+		nextCnt.push_back( se.nextCnt ) ;
+		adj.insert( adj.end(), se.prev, se.prev + se.prevCnt ) ;
+		adj.insert( adj.end(), se.next, se.next + se.nextCnt ) ;
+		adjOffset.push_back( adj.size() ) ;
+		delete[] se.prev ;
+		delete[] se.next ;
+	}
+
+	void Write( FILE *fp )
+	{
+		int i ;
+		int chrCnt = chrNames.size() ;
+		int64_t seCnt = chrId.size() ;
+		int64_t adjCnt = adj.size() ;
+		int64_t headerLen = header.size() ;
+		int64_t offset = 0 ;
+
+		fwrite( SUBEXON_FILE_MAGIC, 1, 8, fp ) ;
+		fwrite( &sorted, sizeof( int ), 1, fp ) ;
+		fwrite( &chrCnt, sizeof( int ), 1, fp ) ;
+		fwrite( &seCnt, sizeof( int64_t ), 1, fp ) ;
+		fwrite( &adjCnt, sizeof( int64_t ), 1, fp ) ;
+		fwrite( &headerLen, sizeof( int64_t ), 1, fp ) ;
+		fwrite( header.c_str(), 1, headerLen, fp ) ;
+		offset = 40 + headerLen ;
+		WritePad( fp, offset ) ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+		{
+			int len = chrNames[i].size() ;
+			fwrite( &len, sizeof( int ), 1, fp ) ;
+			fwrite( chrNames[i].c_str(), 1, len, fp ) ;
+			offset += sizeof( int ) + len ;
+		}
+		WritePad( fp, offset ) ;
+		WriteVector( fp, chrBegin ) ;
+		WriteVector( fp, chrEnd ) ;
+		WriteVector( fp, adjOffset ) ;
+		WriteVector( fp, avgDepth ) ;
+		WriteVector( fp, leftRatio ) ;
+		WriteVector( fp, rightRatio ) ;
+		WriteVector( fp, leftClassifier ) ;
+		WriteVector( fp, rightClassifier ) ;
+		WriteVector( fp, chrId ) ;
+		WriteVector( fp, start ) ;
+		WriteVector( fp, end ) ;
+		WriteVector( fp, prevCnt ) ;
+		WriteVector( fp, nextCnt ) ;
+		WriteVector( fp, adj ) ;
+		WriteVector( fp, leftType ) ;
+		WriteVector( fp, rightType ) ;
+		WriteVector( fp, leftStrand ) ;
+		WriteVector( fp, rightStrand ) ;
+	}
+} ;
+
+#endif
@@ -3,25 +3,7 @@
 
 #include "alignments.hpp"
 #include "blocks.hpp"
-
-struct _subexon
-{
-	int chrId ;
-	int geneId ;
-	int start, end ;
-	int leftType, rightType ;
-	double avgDepth ;
-	//double ratio, classifier ;
-	double leftRatio, rightRatio ;
-	double leftClassifier, rightClassifier ;
-	int lcCnt, rcCnt ;
-	int leftStrand, rightStrand ;
-	
-	int nextCnt, prevCnt ;
-	int *next, *prev ;
-	
-	bool canBeStart, canBeEnd ;
-} ;
+#include "SubexonFile.hpp"
 
 struct _geneInterval
 {
@@ -63,17 +45,13 @@ public:
 	SubexonGraph( double classifierThreshold, Alignments &bam, FILE *fpSubexon ) 
 	{ 
 		// Read in the subexons
-		rewind( fpSubexon ) ; 
-		char buffer[2048] ;
+		SubexonFile subexonFile ;
+		subexonFile.Open( fpSubexon ) ;
 		int subexonCnt ;
 		int i, j, k ;
-		while ( fgets( buffer, sizeof( buffer ), fpSubexon ) != NULL )
+		struct _subexon se ;
+		while ( subexonFile.Next( se, bam, true ) )
 		{
-			if ( buffer[0] == '#' )
-				continue ;
-
-			struct _subexon se ;
-			InputSubexon( buffer, bam, se, true ) ;
 
 			// filter.
 			if ( ( se.leftType == 0 && se.rightType == 0 ) 
@@ -274,64 +252,9 @@ public:
 	// Parse the input line
 	static int InputSubexon( char *in, Alignments &alignments, struct _subexon &se, bool needPrevNext = false )
 	{
-		int i ;
-		char chrName[50] ;
-		char ls[3], rs[3] ;	
-		sscanf( in, "%s %d %d %d %d %s %s %lf %lf %lf %lf %lf", chrName, &se.start, &se.end, &se.leftType, &se.rightType, ls, rs,
-				&se.avgDepth, &se.leftRatio, &se.rightRatio, 
-				&se.leftClassifier, &se.rightClassifier ) ;	
+		char chrName[1024] ;
+		SubexonFile::ParseLine( in, chrName, se, needPrevNext ) ;
 		se.chrId = alignments.GetChromIdFromName( chrName ) ;
-		se.nextCnt = se.prevCnt = 0 ;
-		se.next = se.prev = NULL ;
-		se.lcCnt = se.rcCnt = 0 ;
-
-		if ( ls[0] == '+' )
-			se.leftStrand = 1 ;
-		else if ( ls[0] == '-' )
-			se.leftStrand = -1 ;
-		else
-			se.leftStrand = 0 ;
-
-		if ( rs[0] == '+' )
-			se.rightStrand = 1 ;
-		else if ( rs[0] == '-' )
-			se.rightStrand = -1 ;
-		else
-			se.rightStrand = 0 ;
-
-		if ( needPrevNext )
-		{
-			char *p = in ;
-			// Locate the offset for prevCnt
-			for ( i = 0 ; i <= 11 ; ++i )
-			{
-				p = strchr( p, ' ' ) ;
-				++p ;
-			}
-
-			sscanf( p, "%d", &se.prevCnt ) ;
-			p = strchr( p, ' ' ) ;
-			++p ;
-			se.prev = new int[ se.prevCnt ] ;
-			for ( i = 0 ; i < se.prevCnt ; ++i )
-			{
-				sscanf( p, "%d", &se.prev[i] ) ;
-				p = strchr( p, ' ' ) ;
-				++p ;
-			}
-
-			sscanf( p, "%d", &se.nextCnt ) ;
-			p = strchr( p, ' ' ) ;
-			++p ;
-			se.next = new int[ se.nextCnt ] ;
-			for ( i = 0 ; i < se.nextCnt ; ++i )
-			{
-				sscanf( p, "%d", &se.next[i] ) ;
-				p = strchr( p, ' ' ) ;
-				++p ;
-			}
-			
-		}
 		return 1 ;
 	}
 	
@@ -10,21 +10,71 @@
 #include <algorithm>
 #include <vector>
 #include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "alignments.hpp"
 #include "blocks.hpp"
 #include "stats.hpp"
+#include "SubexonFile.hpp"
 
 #define ABS(x) ((x)<0?-(x):(x))
 
 char usage[] = "./subexon-info alignment.bam intron.splice [options]\n"
+		"       ./subexon-info --lb list [options]\n"
+		"\t\teach line of the list is \"alignment.bam intron.splice output [segment_cache]\"; the samples are processed in parallel with -p, the largest first\n"
+		"       ./subexon-info --printText subexon_file\n"
+		"\t\tprint a binary subexon file in the text format\n"
 		"options:\n"
 		"\t--minDepth INT: the minimum coverage depth considered as part of a subexon (default: 2)\n"
-		"\t--noStats: do not compute the statistical scores (default: not used)\n" ;
-char buffer[4096] ;
+		"\t--noStats: do not compute the statistical scores; the output is in text (default: not used)\n"
+		"\t--text: output the subexons in text instead of the binary format (default: not used)\n"
+		"\t-p INT: number of threads; the chromosomes are processed in parallel when the alignment file is indexed (default: 1)\n"
+		"\t--segmentCache FILE: write the spliced segment cache of the alignments to FILE, and use it for the later passes (default: not used)\n" ;
+__thread char buffer[4096] ;
 
 int gMinDepth ;
 
+struct _buildExonBlocksThreadArg
+{
+	char *file ;
+	Blocks *chrBlocks ; // the blocks of each chromosome.
+	std::vector<struct _splitSite> *chrSplitSites ;
+	int *chrOrder ; // the chromosomes from the longest one.
+	int chrCnt ;
+	int *nextChr ;
+	pthread_mutex_t *lock ;
+} ;
+
+__thread int *gChrLength ;
+pthread_mutex_t gRandLock = PTHREAD_MUTEX_INITIALIZER ;
+bool CompChrByLength( int a, int b )
+{
+	return gChrLength[a] > gChrLength[b] ;
+}
+
+void *BuildExonBlocks_Thread( void *pArg )
+{
+	struct _buildExonBlocksThreadArg &arg = *( (struct _buildExonBlocksThreadArg *)pArg ) ;
+	Alignments alignments ;
+	alignments.Open( arg.file ) ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextChr ) ;
+		++*( arg.nextChr ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= arg.chrCnt )
+			break ;
+
+		int chrId = arg.chrOrder[k] ;
+		alignments.SeekRegion( chrId, 0, alignments.GetChromLength( chrId ) ) ;
+		arg.chrBlocks[ chrId ].BuildExonBlocks( alignments, arg.chrSplitSites[ chrId ] ) ;
+	}
+	alignments.Close() ;
+	pthread_exit( NULL ) ;
+}
+
 bool CompSplitSite( struct _splitSite a, struct _splitSite b )
 {
 	if ( a.chrId < b.chrId )
@@ -643,9 +693,16 @@ int RatioAndCovEM( double *covRatio, double *cov, int n, double &piRatio, double
 			filteredCovRatio[m] = covRatio[i] ;
 			++m ;
 		}*/
-	srand( 17 ) ;
 	int maxTries = 10 ;
 	int t = 0 ;
+	// Draw the random perturbations up front, so samples fitted in parallel do not interleave on rand().
+	int randNumbers[ 5 * ( maxTries + 1 ) ] ;
+	int randUsed = 0 ;
+	pthread_mutex_lock( &gRandLock ) ;
+	srand( 17 ) ;
+	for ( i = 0 ; i < 5 * ( maxTries + 1 ) ; ++i )
+		randNumbers[i] = rand() ;
+	pthread_mutex_unlock( &gRandLock ) ;
 	double *buffer = new double[n] ;
 	for ( i = 0 ; i < n ; ++i )
 		buffer[i] = covRatio[i] ;
@@ -662,21 +719,21 @@ int RatioAndCovEM( double *covRatio, double *cov, int n, double &piRatio, double
 			if ( t > maxTries )
 				break ;
 			piRatio = 0.6 ;
-			kRatio[0] += ( ( rand() * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
+			kRatio[0] += ( ( randNumbers[ randUsed++ ] * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
 			if ( kRatio[0] <= 0 )
 				kRatio[0] = 0.9 ;
-			kRatio[1] += ( ( rand() * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
+			kRatio[1] += ( ( randNumbers[ randUsed++ ] * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
 			if ( kRatio[1] <= 0 )
 				kRatio[1] = 0.45 ;
-			thetaRatio[0] += ( ( rand() * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
+			thetaRatio[0] += ( ( randNumbers[ randUsed++ ] * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
 			if ( thetaRatio[0] <= 0 )
 				thetaRatio[0] = 0.05 ;
-			thetaRatio[1] += ( ( rand() * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
+			thetaRatio[1] += ( ( randNumbers[ randUsed++ ] * 0.5 - RAND_MAX ) / (double)RAND_MAX * 0.1 ) ;
 			if ( thetaRatio[1] <= 0 )
 				thetaRatio[1] = 1 ;
 			if ( kRatio[0] < kRatio[1] )
 			{	
-				if ( rand() & 1 )
+				if ( randNumbers[ randUsed++ ] & 1 )
 					kRatio[0] = kRatio[1] ;
 				else
 					kRatio[1] = kRatio[0] ;
@@ -764,46 +821,26 @@ double TransformCov( double c )
 	//return log( c ) / log( 2.0 ) ;
 }
 
-int main( int argc, char *argv[] )
+// Compute the subexons of one sample and write them to fpOut.
+void ComputeSubexonInfo( char *alignmentPath, char *spliceFile, char *segmentCache, int numThreads, bool noStats, FILE *fpOut )
 {
 	int i, j ;
-	bool noStats = false ;
-	if ( argc < 3 )
-	{
-		fprintf( stderr, usage ) ;
-		exit( 1 ) ;
-	}
-
-	gMinDepth = 2 ;
-
-	for ( i = 3 ; i < argc ; ++i )
+	Alignments alignments ;
+	alignments.Open( alignmentPath, numThreads ) ;
+	if ( segmentCache != NULL )
 	{
-		if ( !strcmp( argv[i], "--noStats" ) )
-		{
-			noStats = true ;
-			continue ;
-		}
-		else if ( !strcmp( argv[i], "--minDepth" ) )
-		{
-			gMinDepth = atoi( argv[i + 1] ) ;
-			++i ;
-			continue ;
-		}
-		else
-		{
-			fprintf( stderr, "Unknown argument: %s\n", argv[i] ) ;
-			return 0 ;
-		}
+		alignments.WriteSegmentCache( segmentCache ) ;
+		alignments.Close() ;
+		alignments.Open( segmentCache ) ;
 	}
-
-	Alignments alignments ;
-	alignments.Open( argv[1] ) ;
+	char alignmentFile[1024] ; // the BAM file, also for a segment cache.
+	alignments.GetFileName( alignmentFile ) ;
 	std::vector<struct _splitSite> splitSites ; // only compromised the 
 	std::vector<struct _splitSite> allSplitSites ;
 
 	// read in the splice site
 	FILE *fp ;
-	fp = fopen( argv[2], "r" ) ;
+	fp = fopen( spliceFile, "r" ) ;
 	char chrom[50] ;
 	int64_t start, end ;
 	int support ;
@@ -851,7 +888,57 @@ int main( int argc, char *argv[] )
 	// Build the blocks
 	Blocks regions ;
 	alignments.Rewind() ;
-	regions.BuildExonBlocks( alignments ) ;
+	int chrCnt = alignments.GetChromCount() ;
+	if ( numThreads > 1 && chrCnt > 1 && alignments.CanSeekRegion() )
+	{
+		// Each chromosome is built separately from the index, and the blocks are put together in the chromosome order.
+		Blocks *chrBlocks = new Blocks[ chrCnt ] ;
+		std::vector< std::vector<struct _splitSite> > chrSplitSites( chrCnt ) ;
+		int size = splitSites.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			chrSplitSites[ splitSites[i].chrId ].push_back( splitSites[i] ) ;
+
+		int *chrOrder = new int[ chrCnt ] ;
+		gChrLength = new int[ chrCnt ] ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+		{
+			chrOrder[i] = i ;
+			gChrLength[i] = alignments.GetChromLength( i ) ;
+		}
+		std::sort( chrOrder, chrOrder + chrCnt, CompChrByLength ) ;
+
+		int threadCnt = numThreads < chrCnt ? numThreads : chrCnt ;
+		int nextChr = 0 ;
+		pthread_mutex_t lock ;
+		pthread_attr_t pthreadAttr ;
+		pthread_t *threads = new pthread_t[ threadCnt ] ;
+		struct _buildExonBlocksThreadArg arg ;
+		arg.file = segmentCache != NULL ? segmentCache : alignmentPath ;
+		arg.chrBlocks = chrBlocks ;
+		arg.chrSplitSites = &chrSplitSites[0] ;
+		arg.chrOrder = chrOrder ;
+		arg.chrCnt = chrCnt ;
+		arg.nextChr = &nextChr ;
+		arg.lock = &lock ;
+
+		pthread_mutex_init( &lock, NULL ) ;
+		pthread_attr_init( &pthreadAttr ) ;
+		pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
+		for ( i = 0 ; i < threadCnt ; ++i )
+			pthread_create( &threads[i], &pthreadAttr, BuildExonBlocks_Thread, &arg ) ;
+		for ( i = 0 ; i < threadCnt ; ++i )
+			pthread_join( threads[i], NULL ) ;
+		pthread_attr_destroy( &pthreadAttr ) ;
+		pthread_mutex_destroy( &lock ) ;
+
+		regions.AppendExonBlocks( chrBlocks, chrCnt ) ;
+		delete[] threads ;
+		delete[] chrOrder ;
+		delete[] gChrLength ;
+		delete[] chrBlocks ;
+	}
+	else
+		regions.BuildExonBlocks( alignments, splitSites ) ;
 	//printf( "%d\n", regions.exonBlocks.size() ) ;
 	
 	FilterAndSortSplitSites( splitSites ) ; 
@@ -875,11 +962,10 @@ int main( int argc, char *argv[] )
 		printf( "%s %" PRId64 " %" PRId64 " %d %d\n", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1,  e.leftType, e.rightType ) ;
 	}
 	return 0 ;*/
-	// Recompute the coverage for each block. 
-	alignments.Rewind() ;
+	// Compute the coverage for each block from what BuildExonBlocks collected. 
 	//printf( "Before computeDepth: %d\n", regions.exonBlocks.size() ) ;
 
-	regions.ComputeDepth( alignments ) ;
+	regions.ComputeDepth() ;
 	//printf( "After computeDepth: %d\n", regions.exonBlocks.size() ) ;
 
 	// Merge blocks that may have a hollow coverage by accident.
@@ -898,50 +984,50 @@ int main( int argc, char *argv[] )
 	if ( noStats ) 
 	{ 
 		// just output the subexons.
-		if ( realpath( argv[1], buffer ) == NULL )
+		if ( realpath( alignmentFile, buffer ) == NULL )
 		{
-			strcpy( buffer, argv[1] ) ;
+			strcpy( buffer, alignmentFile ) ;
 		}
-		printf( "#%s\n", buffer ) ;
-		printf( "#fitted_ir_parameter_ratio: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
-		printf( "#fitted_ir_parameter_cov: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
+		fprintf( fpOut, "#%s\n", buffer ) ;
+		fprintf( fpOut, "#fitted_ir_parameter_ratio: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
+		fprintf( fpOut, "#fitted_ir_parameter_cov: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
 		
 		int blockCnt = regions.exonBlocks.size() ;
 		for ( int i = 0 ; i < blockCnt ; ++i )
 		{
 			struct _block &e = regions.exonBlocks[i] ;
 			double avgDepth = (double)e.depthSum / ( e.end - e.start + 1 ) ;
-			printf( "%s %" PRId64 " %" PRId64 " %d %d %lf -1 -1 -1 -1 ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, avgDepth ) ;
+			fprintf( fpOut, "%s %" PRId64 " %" PRId64 " %d %d %lf -1 -1 -1 -1 ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, avgDepth ) ;
 			int prevCnt = e.prevCnt ;
 			if ( i > 0 && e.start == regions.exonBlocks[i - 1].end + 1 &&
 					e.leftType == regions.exonBlocks[i - 1].rightType )
 			{
-				printf( "%d ", prevCnt + 1 ) ;
+				fprintf( fpOut, "%d ", prevCnt + 1 ) ;
 				for ( j = 0 ; j < prevCnt ; ++j )
-					printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
-				printf( "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
+					fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+				fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
 			}
 			else
 			{
-				printf( "%d ", prevCnt ) ;
+				fprintf( fpOut, "%d ", prevCnt ) ;
 				for ( j = 0 ; j < prevCnt ; ++j )
-					printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+					fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
 			}
 
 			int nextCnt = e.nextCnt ;
 			if ( i < blockCnt - 1 && e.end == regions.exonBlocks[i + 1].start - 1 &&
 					e.rightType == regions.exonBlocks[i + 1].leftType )
 			{
-				printf( "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
+				fprintf( fpOut, "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
 			}
 			else
-				printf( "%d ", nextCnt ) ;
+				fprintf( fpOut, "%d ", nextCnt ) ;
 			for ( j = 0 ; j < nextCnt ; ++j )
-				printf( "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
-			printf( "\n" ) ;
+				fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
+			fprintf( fpOut, "\n" ) ;
 
 		}
-		return 0 ;
+		return ;
 	}
 
 	// Extract the blocks for different events.
@@ -1158,53 +1244,53 @@ int main( int argc, char *argv[] )
 
 	
 	// Output the result.
-	if ( realpath( argv[1], buffer ) == NULL )
+	if ( realpath( alignmentFile, buffer ) == NULL )
 	{
-		strcpy( buffer, argv[1] ) ;
+		strcpy( buffer, alignmentFile ) ;
 	}
-	printf( "#%s\n", buffer ) ;
+	fprintf( fpOut, "#%s\n", buffer ) ;
 	// TODO: higher precision.
-	printf( "#fitted_ir_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piRatio, kRatio[0], thetaRatio[0], kRatio[1], thetaRatio[1] ) ;
-	printf( "#fitted_ir_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piCov, kCov[0], thetaCov[0], kCov[1], thetaCov[1] ) ;
+	fprintf( fpOut, "#fitted_ir_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piRatio, kRatio[0], thetaRatio[0], kRatio[1], thetaRatio[1] ) ;
+	fprintf( fpOut, "#fitted_ir_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piCov, kCov[0], thetaCov[0], kCov[1], thetaCov[1] ) ;
 	
-	printf( "#fitted_overhang_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiRatio, overhangKRatio[0], overhangThetaRatio[0], overhangKRatio[1], overhangThetaRatio[1] ) ;
-	printf( "#fitted_overhang_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiCov, overhangKCov[0], overhangThetaCov[0], overhangKCov[1], overhangThetaCov[1] ) ;
+	fprintf( fpOut, "#fitted_overhang_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiRatio, overhangKRatio[0], overhangThetaRatio[0], overhangKRatio[1], overhangThetaRatio[1] ) ;
+	fprintf( fpOut, "#fitted_overhang_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiCov, overhangKCov[0], overhangThetaCov[0], overhangKCov[1], overhangThetaCov[1] ) ;
 
 
 	for ( int i = 0 ; i < blockCnt ; ++i )
 	{
 		struct _block &e = regions.exonBlocks[i] ;
 		double avgDepth = regions.GetAvgDepth( e ) ;
-		printf( "%s %" PRId64 " %" PRId64 " %d %d %c %c %lf %lf %lf %lf %lf ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, 
+		fprintf( fpOut, "%s %" PRId64 " %" PRId64 " %d %d %c %c %lf %lf %lf %lf %lf ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, 
 			e.leftStrand, e.rightStrand, avgDepth, 
 			e.leftRatio, e.rightRatio, leftClassifier[i], rightClassifier[i] ) ;
 		int prevCnt = e.prevCnt ;
 		if ( i > 0 && e.start == regions.exonBlocks[i - 1].end + 1 )
 			//&& e.leftType == regions.exonBlocks[i - 1].rightType )
 		{
-			printf( "%d ", prevCnt + 1 ) ;
+			fprintf( fpOut, "%d ", prevCnt + 1 ) ;
 			for ( j = 0 ; j < prevCnt ; ++j )
-				printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
-			printf( "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
+				fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+			fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
 		}
 		else
 		{
-			printf( "%d ", prevCnt ) ;
+			fprintf( fpOut, "%d ", prevCnt ) ;
 			for ( j = 0 ; j < prevCnt ; ++j )
-				printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+				fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
 		}
 
 		int nextCnt = e.nextCnt ;
 		if ( i < blockCnt - 1 && e.end == regions.exonBlocks[i + 1].start - 1 ) 
 			//&& e.rightType == regions.exonBlocks[i + 1].leftType )
 		{
-			printf( "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
+			fprintf( fpOut, "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
 		}
 		else
-			printf( "%d ", nextCnt ) ;
+			fprintf( fpOut, "%d ", nextCnt ) ;
 		for ( j = 0 ; j < nextCnt ; ++j )
-			printf( "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
-		printf( "\n" ) ;
+			fprintf( fpOut, "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
+		fprintf( fpOut, "\n" ) ;
 	}
 
 	delete[] cov ;
@@ -1212,3 +1298,212 @@ int main( int argc, char *argv[] )
 	delete[] leftClassifier ;
 	delete[] rightClassifier ;
 }
+
+// Write the subexons in the binary format unless textOutput is set. 
+void OutputSubexonInfo( char *alignmentPath, char *spliceFile, char *segmentCache, int numThreads, bool noStats, 
+	bool textOutput, FILE *fpOut )
+{
+	if ( textOutput || noStats )
+	{
+		ComputeSubexonInfo( alignmentPath, spliceFile, segmentCache, numThreads, noStats, fpOut ) ;
+		return ;
+	}
+
+	// Convert the text output, so the binary file rounds the values in the same way.
+	FILE *fpText = tmpfile() ;
+	if ( fpText == NULL )
+	{
+		fprintf( stderr, "Could not create the temporary file.\n" ) ;
+		exit( 1 ) ;
+	}
+	ComputeSubexonInfo( alignmentPath, spliceFile, segmentCache, numThreads, noStats, fpText ) ;
+	rewind( fpText ) ;
+
+	SubexonFileWriter writer ;
+	char *line = NULL ;
+	size_t lineSize = 0 ;
+	while ( getline( &line, &lineSize, fpText ) != -1 )
+		writer.AddLine( line ) ;
+	free( line ) ;
+	fclose( fpText ) ;
+	writer.Write( fpOut ) ;
+}
+
+struct _sampleJob
+{
+	char alignment[1024] ;
+	char splice[1024] ;
+	char output[1024] ;
+	char segmentCache[1024] ; // empty if not used.
+	off_t size ;
+} ;
+
+bool CompSampleJobBySize( const struct _sampleJob &a, const struct _sampleJob &b )
+{
+	return a.size > b.size ;
+}
+
+struct _computeSubexonInfoThreadArg
+{
+	struct _sampleJob *jobs ;
+	int jobCnt ;
+	int *nextJob ;
+	int numThreads ; // the threads for each sample.
+	bool noStats ;
+	bool textOutput ;
+	pthread_mutex_t *lock ;
+} ;
+
+void *ComputeSubexonInfo_Thread( void *pArg )
+{
+	struct _computeSubexonInfoThreadArg &arg = *( (struct _computeSubexonInfoThreadArg *)pArg ) ;
+	while ( 1 )
+	{
+		pthread_mutex_lock( arg.lock ) ;
+		int k = *( arg.nextJob ) ;
+		++*( arg.nextJob ) ;
+		pthread_mutex_unlock( arg.lock ) ;
+		if ( k >= arg.jobCnt )
+			break ;
+
+		struct _sampleJob &job = arg.jobs[k] ;
+		FILE *fpOut = fopen( job.output, "w" ) ;
+		if ( fpOut == NULL )
+		{
+			fprintf( stderr, "Could not open file %s\n", job.output ) ;
+			exit( 1 ) ;
+		}
+		OutputSubexonInfo( job.alignment, job.splice, job.segmentCache[0] ? job.segmentCache : NULL, 
+			arg.numThreads, arg.noStats, arg.textOutput, fpOut ) ;
+		fclose( fpOut ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// Process the samples listed in file, each line is "alignment.bam intron.splice output [segment_cache]". 
+// The largest alignment files are started first so a deep sample does not hold up the others at the end.
+void ComputeSubexonInfoInList( char *file, int numThreads, bool noStats, bool textOutput )
+{
+	int i ;
+	FILE *fp = fopen( file, "r" ) ;
+	if ( fp == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", file ) ;
+		exit( 1 ) ;
+	}
+	std::vector<struct _sampleJob> jobs ;
+	struct _sampleJob job ;
+	char line[4200] ;
+	while ( fgets( line, sizeof( line ), fp ) != NULL )
+	{
+		job.segmentCache[0] = '\0' ;
+		if ( sscanf( line, "%1023s %1023s %1023s %1023s", job.alignment, job.splice, job.output, job.segmentCache ) < 3 )
+			continue ;
+		struct stat st ;
+		job.size = stat( job.alignment, &st ) == 0 ? st.st_size : 0 ;
+		jobs.push_back( job ) ;
+	}
+	fclose( fp ) ;
+	if ( jobs.size() == 0 )
+		return ;
+	std::stable_sort( jobs.begin(), jobs.end(), CompSampleJobBySize ) ;
+
+	int jobCnt = jobs.size() ;
+	int threadCnt = numThreads < jobCnt ? numThreads : jobCnt ;
+	if ( threadCnt < 1 )
+		threadCnt = 1 ;
+	int nextJob = 0 ;
+	pthread_mutex_t lock ;
+	pthread_attr_t pthreadAttr ;
+	pthread_t *threads = new pthread_t[ threadCnt ] ;
+	struct _computeSubexonInfoThreadArg arg ;
+	arg.jobs = &jobs[0] ;
+	arg.jobCnt = jobCnt ;
+	arg.nextJob = &nextJob ;
+	arg.numThreads = numThreads / threadCnt ; // the spare threads work within each sample.
+	arg.noStats = noStats ;
+	arg.textOutput = textOutput ;
+	arg.lock = &lock ;
+
+	pthread_mutex_init( &lock, NULL ) ;
+	pthread_attr_init( &pthreadAttr ) ;
+	pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_create( &threads[i], &pthreadAttr, ComputeSubexonInfo_Thread, &arg ) ;
+	for ( i = 0 ; i < threadCnt ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &pthreadAttr ) ;
+	pthread_mutex_destroy( &lock ) ;
+	delete[] threads ;
+}
+
+int main( int argc, char *argv[] )
+{
+	int i ;
+	bool noStats = false ;
+	bool textOutput = false ;
+	int numThreads = 1 ;
+	char *segmentCache = NULL ;
+	if ( argc < 3 )
+	{
+		fprintf( stderr, usage ) ;
+		exit( 1 ) ;
+	}
+
+	gMinDepth = 2 ;
+
+	if ( !strcmp( argv[1], "--printText" ) )
+	{
+		SubexonFile subexonFile ;
+		if ( !subexonFile.Open( argv[2] ) )
+		{
+			fprintf( stderr, "Could not open file %s\n", argv[2] ) ;
+			exit( 1 ) ;
+		}
+		subexonFile.PrintText( stdout ) ;
+		return 0 ;
+	}
+
+	for ( i = 3 ; i < argc ; ++i )
+	{
+		if ( !strcmp( argv[i], "--noStats" ) )
+		{
+			noStats = true ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--text" ) )
+		{
+			textOutput = true ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--minDepth" ) )
+		{
+			gMinDepth = atoi( argv[i + 1] ) ;
+			++i ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "-p" ) )
+		{
+			numThreads = atoi( argv[i + 1] ) ;
+			++i ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--segmentCache" ) )
+		{
+			segmentCache = argv[i + 1] ;
+			++i ;
+			continue ;
+		}
+		else
+		{
+			fprintf( stderr, "Unknown argument: %s\n", argv[i] ) ;
+			return 0 ;
+		}
+	}
+
+	if ( !strcmp( argv[1], "--lb" ) )
+		ComputeSubexonInfoInList( argv[2], numThreads, noStats, textOutput ) ;
+	else
+		OutputSubexonInfo( argv[1], argv[2], segmentCache, numThreads, noStats, textOutput, stdout ) ;
+	return 0 ;
+}
@@ -281,6 +281,74 @@ int TranscriptDecider::IsConstraintInTranscriptDebug( struct _transcript transcr
 	printf( "ret=%d\n", ret ) ;
 	return ret ;
 }
+
+bool TranscriptDecider::IsConstraintFullyInTranscript( struct _transcript &transcript, struct _constraint &c )
+{
+	if ( transcript.partial )
+		return IsConstraintInTranscript( transcript, c ) == 1 ;
+	// The bits of the constraint are all in [c.first, c.last].
+	if ( c.first < transcript.first || c.last > transcript.last )
+		return false ;
+	return transcript.seVector.IsEqualInRange( c.vector, c.first, c.last ) ;
+}
+
+void TranscriptDecider::BuildCompatibilityIndex( std::vector<struct _transcript> &transcripts, Constraints &constraints,
+	TranscriptConstraintIndex &index )
+{
+	int i, j, k ;
+	std::vector<struct _constraint> &scc = constraints.constraints ;
+	std::vector<struct _matePairConstraint> &tc = constraints.matePairs ;
+	int tcnt = transcripts.size() ;
+	int sccCnt = scc.size() ;
+	int tcCnt = tc.size() ;
+
+	index.Clear() ;
+	// The constraints are sorted by the first subexon, and the mate pairs are sorted by i then j.
+	// So the mate pairs of constraint a are pairStart[a]...pairStart[a + 1] - 1.
+	std::vector<int> pairStart( sccCnt + 1, 0 ) ;
+	for ( j = 0 ; j < tcCnt ; ++j )
+		++pairStart[ tc[j].i + 1 ] ;
+	for ( k = 0 ; k < sccCnt ; ++k )
+		pairStart[k + 1] += pairStart[k] ;
+
+	// compatibleTag[k] == i if constraint k is compatible with transcript i.
+	std::vector<int> compatibleTag( sccCnt, -1 ) ;
+	std::vector<int> compatible ;
+	for ( i = 0 ; i < tcnt ; ++i )
+	{
+		struct _transcript &t = transcripts[i] ;
+		int l = 0, r = sccCnt ;
+		while ( l < r )
+		{
+			int m = ( l + r ) / 2 ;
+			if ( scc[m].first < t.first )
+				l = m + 1 ;
+			else
+				r = m ;
+		}
+
+		compatible.clear() ;
+		for ( k = l ; k < sccCnt && scc[k].first <= t.last ; ++k )
+		{
+			if ( IsConstraintFullyInTranscript( t, scc[k] ) )
+			{
+				compatibleTag[k] = i ;
+				compatible.push_back( k ) ;
+			}
+		}
+
+		int size = compatible.size() ;
+		for ( k = 0 ; k < size ; ++k )
+		{
+			int a = compatible[k] ;
+			for ( j = pairStart[a] ; j < pairStart[a + 1] ; ++j )
+				if ( compatibleTag[ tc[j].j ] == i )
+					index.Add( j ) ;
+		}
+		index.NextTranscript() ;
+	}
+	index.Finish( tcCnt ) ;
+}
 int TranscriptDecider::SubTranscriptCount( int tag, struct _subexon *subexons, int *f )
 {
 	if ( f[tag] != -1 )
@@ -657,50 +725,45 @@ struct _dp TranscriptDecider::SolveSubTranscript( int visit[], int vcnt, int str
 			return attr.f1[ visit[0] ] ;
 		}
 	}
-	else if ( vcnt == 2 && attr.f2 )
+	else if ( vcnt == 2 )
 	{
-		int a = visit[0] ;
-		int b = visit[1] ;
+		struct _dp *d = attr.f2->Get( visit[0], visit[1] ) ;
 		
-		if ( attr.f2[a][b].cover != -1 && attr.f2[a][b].strand == strand && ( attr.f2[a][b].timeStamp == attr.timeStamp || 
-			( attr.f2[a][b].minAbundance < attr.minAbundance && attr.f2[a][b].cover == -2 ) ) )
+		if ( d != NULL && d->cover != -1 && d->strand == strand && ( d->timeStamp == attr.timeStamp || 
+			( d->minAbundance < attr.minAbundance && d->cover == -2 ) ) )
 		{
-			return attr.f2[a][b] ;
+			return *d ;
 		}
 	}
 	else
 	{
-		int key = 0 ;	
-		for ( i = 0 ; i < vcnt ; ++i )
-			key = ( key * attr.seCnt + visit[i] ) % hashMax ;
-		if ( key < 0 )
-			key += hashMax ;
+		struct _dp *d = attr.hash->Get( visit, vcnt ) ;
 
-		if ( attr.hash[key].cover != -1 && attr.hash[key].cnt == vcnt && attr.hash[key].strand == strand && 
-			( attr.hash[key].first == visit[0] )  &&
-			( attr.hash[key].timeStamp == attr.timeStamp || 
-				( attr.hash[key].minAbundance < attr.minAbundance && attr.hash[key].cover == -2 ) ) )
+		if ( d != NULL && d->cover != -1 && d->cnt == vcnt && d->strand == strand && 
+			( d->first == visit[0] )  &&
+			( d->timeStamp == attr.timeStamp || 
+				( d->minAbundance < attr.minAbundance && d->cover == -2 ) ) )
 		{
 			struct _transcript subTxpt = attr.bufferTxpt ;
 			subTxpt.seVector.Reset() ;
 			for ( i = 0 ; i < vcnt ; ++i )
 				subTxpt.seVector.Set( visit[i] ) ;
 			//subTxpt.seVector.Print() ;
-			//attr.hash[key].seVector.Print() ;
-			subTxpt.seVector.Xor( attr.hash[key].seVector ) ;
+			//d->seVector.Print() ;
+			subTxpt.seVector.Xor( d->seVector ) ;
 			subTxpt.seVector.MaskRegionOutside( visit[0], visit[ vcnt - 1] ) ;
 			//printf( "hash test: %d %d\n", key, subTxpt.seVector.IsAllZero() ) ;
 			if ( subTxpt.seVector.IsAllZero() )
 			{
-				return attr.hash[key] ;
+				return *d ;
 			}
 			
 			// Can't use the code below, because vcnt is the header of subexons.
 			/*for ( i = 0 ; i < vcnt ; ++i )
-				if ( !attr.hash[key].seVector.Test( visit[i] ) )
+				if ( !d->seVector.Test( visit[i] ) )
 					break ;
 			if ( i >= vcnt )
-				return attr.hash[key] ;*/
+				return *d ;*/
 				
 		}
 	}
@@ -830,29 +893,20 @@ struct _dp TranscriptDecider::SolveSubTranscript( int visit[], int vcnt, int str
 		visitdp.seVector.Release() ;
 		return attr.f1[ visit[0] ] ;
 	}
-	else if ( vcnt == 2 && attr.f2 )
+	else if ( vcnt == 2 )
 	{
-		SetDpContent( attr.f2[ visit[0] ][ visit[1] ], visitdp, attr ) ;
+		struct _dp &d = attr.f2->GetOrAdd( visit[0], visit[1] ) ;
+		SetDpContent( d, visitdp, attr ) ;
 		visitdp.seVector.Release() ;
-		return attr.f2[ visit[0] ][ visit[1] ] ;
+		return d ;
 	}
 	else
 	{
-		int key = 0 ;	
-		for ( i = 0 ; i < vcnt ; ++i )
-			key = ( key * attr.seCnt + visit[i] ) % hashMax ;
-		if ( key < 0 )
-			key += hashMax ;
-
-		//static int hashUsed = 0 ;
-		//if (  attr.hash[key].cover == -1 )
-		//	++hashUsed ;
-		//printf( "%d/%d\n", hashUsed, HASH_MAX) ;
-		//printf( "hash write: %d\n", key ) ;	
-		SetDpContent( attr.hash[key], visitdp, attr ) ;	
-		attr.hash[key].cnt = vcnt ;
+		struct _dp &d = attr.hash->GetOrAdd( visit, vcnt ) ;
+		SetDpContent( d, visitdp, attr ) ;	
+		d.cnt = vcnt ;
 		visitdp.seVector.Release() ;
-		return attr.hash[key] ;
+		return d ;
 	}
 }
 
@@ -881,11 +935,8 @@ void TranscriptDecider::PickTranscriptsByDP( struct _subexon *subexons, int seCn
 	memset( attr.hash, -1, sizeof( struct _dp ) * HASH_MAX ) ;*/
 	for ( i = 0 ; i < seCnt ; ++i )
 		ResetDpContent( attr.f1[i] ) ;
-	for ( i = 0 ; i < seCnt && attr.f2 ; ++i )
-		for ( j = i ; j < seCnt ; ++j )
-			ResetDpContent( attr.f2[i][j] ) ;
-	for ( i = 0 ; i < hashMax ; ++i )
-		ResetDpContent( attr.hash[i] ) ;
+	attr.f2->Clear( seCnt ) ;
+	attr.hash->Clear( seCnt ) ;
 
 	// Set the uncovered pair
 	attr.uncoveredPair.clear() ;
@@ -1366,9 +1417,11 @@ void TranscriptDecider::AugmentTranscripts( struct _subexon *subexons, std::vect
 
 // Pick the transcripts from given transcripts.
 void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<struct _transcript> &alltranscripts, Constraints &constraints, 
-		SubexonCorrelation &seCorrelation, std::vector<struct _transcript> &transcripts ) 
+		TranscriptConstraintIndex &compatibility, SubexonCorrelation &seCorrelation, std::vector<struct _transcript> &transcripts ) 
 {
-	int i, j, k ;
+	int i, j, k, l ;
+	const int *row, *col ;
+	int rowCnt, colCnt ;
 	std::vector<int> chosen ;
 	std::vector<struct _matePairConstraint> &tc = constraints.matePairs ;
 	int atcnt = alltranscripts.size() ;
@@ -1389,13 +1442,10 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 	double *transcriptAbundance = new double[atcnt] ; // the roughly estimated abundance based on constraints.
 	double *avgTranscriptAbundance = new double[atcnt] ; // the average normAbund from the compatible constraints.
 
-	BitTable *btable = new BitTable[ atcnt ] ; 
 	//BitTable lowCovSubexon ; // force the abundance to 0 for the transcript contains the subexon.
 	double *coveredPortion = new double[atcnt] ;
 
 	memset( avgTranscriptAbundance, 0 ,sizeof( double ) * atcnt ) ;
-	for ( i = 0 ; i < atcnt ; ++i )
-		btable[i].Init( tcCnt ) ;
 	for ( j = 0 ; j < tcCnt ; ++j )
 	{
 		int a = constraints.matePairs[j].i ;
@@ -1412,41 +1462,15 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 		tc[j].abundance = tc[j].normAbund ;
 	}
 	++inf ;
-	bool btableSet = false ;
 	for ( i = 0 ; i < atcnt ; ++i )
-	{
-		//printf( "correlation %d: %lf\n", i, alltranscripts[i].correlationScore ) ;
-		/*for ( int l = 0 ; l < subexonInd.size() ; ++l )
-		{
-			for ( int m = l ; m < subexonInd.size() ; ++m )
-				printf( "%lf ", seCorrelation.Query( l, m ) ) ;
-			printf( "\n" ) ;
-		}*/
-
-		for ( j = 0 ; j < tcCnt ; ++j )
-		{
-			int a = tc[j].i ;
-			int b = tc[j].j ;
-
-			//printf( "try set btble[ %d ].Set( %d ): %d %d\n", i, j, a, b ) ;
-			//alltranscripts[i].seVector.Print() ;
-			//constraints.constraints[a].vector.Print() ;
-			//constraints.constraints[b].vector.Print() ;
-			if ( IsConstraintInTranscript( alltranscripts[i], constraints.constraints[a] ) == 1 
-					&& IsConstraintInTranscript( alltranscripts[i], constraints.constraints[b] ) == 1 )
-			{
-				//printf( "set btble[ %d ].Set( %d ): %d %d\n", i, j, a, b ) ;
-				btable[i].Set( j ) ;
-				btableSet = true ;
-			}
-		}
 		transcriptSeCnt[i] = alltranscripts[i].seVector.Count() ;
-	}
-	if ( btableSet == false )
+	if ( compatibility.GetCompatibleCount() == 0 )
 	{
-		for ( i = 0 ; i < atcnt ; ++i )
-			btable[i].Release() ;
-		delete[] btable ;
+		delete[] transcriptSeCnt ;
+		delete[] transcriptLength ;
+		delete[] transcriptAbundance ;
+		delete[] avgTranscriptAbundance ;
+		delete[] coveredPortion ;
 		return ;
 	}
 
@@ -1556,10 +1580,12 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 			}
 			memset( usedConstraints, false, sizeof( bool ) * constraints.constraints.size() ) ;
 			int compatibleCnt = 0 ;
-			for ( j = 0 ; j < tcCnt ; ++j )
+			memset( alltranscripts[i].constraintsSupport, 0, sizeof( double ) * tcCnt ) ;
+			rowCnt = compatibility.GetConstraints( i, row ) ;
+			for ( l = 0 ; l < rowCnt ; ++l )
 			{
-				alltranscripts[i].constraintsSupport[j] = 0 ;
-				if ( btable[i].Test(j) && tc[j].abundance > 0 )
+				j = row[l] ;
+				if ( tc[j].abundance > 0 )
 				{	
 					++compatibleCnt ;
 					double adjustAbundance = tc[j].abundance ;
@@ -1847,9 +1873,11 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 
 			if ( coverCnt[i] == -1 )
 			{
-				for ( j = 0 ; j < tcCnt ; ++j )
+				rowCnt = compatibility.GetConstraints( i, row ) ;
+				for ( l = 0 ; l < rowCnt ; ++l )
 				{
-					if ( tc[j].abundance > 0 && btable[i].Test( j ) )
+					j = row[l] ;
+					if ( tc[j].abundance > 0 )
 					{
 						cnt += tc[j].effectiveCount ; 
 					}
@@ -1912,10 +1940,11 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 		// Find the constraint that should be depleted.
 		double update = inf ;
 		int updateTag = 0 ;
-		for ( j = 0 ; j < tcCnt ; ++j )
+		rowCnt = compatibility.GetConstraints( maxtag, row ) ;
+		for ( l = 0 ; l < rowCnt ; ++l )
 		{
-			if ( btable[ maxtag ].Test( j ) && tc[j].abundance > 0 && 
-					tc[j].abundance <= update )
+			j = row[l] ;
+			if ( tc[j].abundance > 0 && tc[j].abundance <= update )
 			{
 				update = tc[j].abundance ;	
 				updateTag = j ;
@@ -1927,7 +1956,7 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 		while ( p != -1 )
 		{
 			if ( transcriptAbundance[p] >= 10.0 * transcriptAbundance[maxtag] 
-				&& btable[p].Test( updateTag ) )
+				&& compatibility.IsCompatible( p, updateTag ) )
 			{
 				//printf( "%d\n", p ) ;
 				maxtag = p ;
@@ -1939,7 +1968,7 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 		while ( p != -1 )
 		{
 			if ( transcriptAbundance[p] >= 10.0 * transcriptAbundance[maxtag] 
-				&& btable[p].Test( updateTag ) )
+				&& compatibility.IsCompatible( p, updateTag ) )
 			{
 				maxtag = p ;
 				break ;
@@ -1949,10 +1978,12 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 
 		
 		// Update the abundance.
+		// Only the compatible constraints can be updated.
 		int supportCnt = 0 ;
-		for ( j = 0 ; j < tcCnt ; ++j )
+		rowCnt = compatibility.GetConstraints( maxtag, row ) ;
+		for ( l = 0 ; l < rowCnt ; ++l )
 		{
-			if ( btable[maxtag].Test( j ) )
+			j = row[l] ;
 			{
 				if ( tc[j].abundance > 0 )
 				{
@@ -1964,12 +1995,9 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 
 					if ( tc[j].abundance <= 0 )
 					{
-						int l ;
-						for ( l = 0 ; l < atcnt ; ++l )
-						{
-							if ( btable[l].Test(j) )
-								coverCnt[l] -= tc[j].effectiveCount ;
-						}
+						colCnt = compatibility.GetTranscripts( j, col ) ;
+						for ( k = 0 ; k < colCnt ; ++k )
+							coverCnt[ col[k] ] -= tc[j].effectiveCount ;
 					}
 					++supportCnt ;
 				}
@@ -1979,12 +2007,14 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 					double takeOut = 0 ;
 					double factor = tc[j].effectiveCount ;
 					listCnt = 0 ;
-					for ( i = 0 ; i < atcnt ; ++i )
+					colCnt = compatibility.GetTranscripts( j, col ) ;
+					for ( k = 0 ; k < colCnt ; ++k )
 					{
+						i = col[k] ;
 						if ( i == maxtag )
 							continue ;
 
-						if ( alltranscripts[i].abundance > 0 && btable[i].Test(j) )
+						if ( alltranscripts[i].abundance > 0 )
 						{
 							sum += alltranscripts[i].constraintsSupport[j] ;
 
@@ -2084,13 +2114,8 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 		}
 	}
 	
-	// Release the memory of btable.
 	for ( i = 0 ; i < atcnt ; ++i )
-	{
 		delete[] alltranscripts[i].constraintsSupport ;
-		btable[i].Release() ;
-	}
-	delete[] btable ;
 	
 	delete[] list ;
 	delete[] transcriptSeCnt ;
@@ -2118,46 +2143,75 @@ void TranscriptDecider::PickTranscripts( struct _subexon *subexons, std::vector<
 	}*/
 }
 
-void TranscriptDecider::AbundanceEstimation( struct _subexon *subexons, int seCnt, Constraints &constraints, std::vector<struct _transcript> &transcripts )
+void TranscriptDecider::AbundanceEstimation( struct _subexon *subexons, int seCnt, Constraints &constraints, 
+	TranscriptConstraintIndex &compatibility, std::vector<struct _transcript> &transcripts )
 {
 	int tcnt = transcripts.size() ;
-	int size ;
-	int i, j ;
+	int i, j, k ;
+	const int *row ;
+	int rowCnt ;
 	if ( tcnt <= 0 )
 		return ;
 	
 	std::vector<struct _matePairConstraint> &tc = constraints.matePairs ;
 	int tcCnt = tc.size() ; // transcript constraints
 
-	BitTable *btable = new BitTable[ tcnt ] ; 
 	int *transcriptLength = new int[tcnt] ;
-	int *compatibleList = new int[tcnt] ;
 	double *rho = new double[tcnt] ; // the abundance.
 	int iterCnt = 0 ;
 
+	// The transcripts compatible with each constraint, taken from the rows of the transcripts in the index.
+	std::vector<int> colOffset( tcCnt + 1, 0 ) ;
+	std::vector<int> colIds ;
 	for ( i = 0 ; i < tcnt ; ++i )
-		transcripts[i].constraintsSupport = new double[ tcCnt ] ;
-	
+	{
+		rowCnt = compatibility.GetConstraints( transcripts[i].id, row ) ;
+		for ( k = 0 ; k < rowCnt ; ++k )
+			++colOffset[ row[k] + 1 ] ;
+	}
+	for ( j = 0 ; j < tcCnt ; ++j )
+		colOffset[j + 1] += colOffset[j] ;
+	colIds.resize( colOffset[tcCnt] ) ;
+	std::vector<int> pos( colOffset.begin(), colOffset.end() - 1 ) ;
 	for ( i = 0 ; i < tcnt ; ++i )
 	{
-		btable[i].Init( tcCnt ) ;
-		double min = -1 ;
-		for ( j = 0 ; j < tcCnt ; ++j )
+		rowCnt = compatibility.GetConstraints( transcripts[i].id, row ) ;
+		for ( k = 0 ; k < rowCnt ; ++k )
 		{
-			int a = tc[j].i ;
-			int b = tc[j].j ;
-
-			if ( IsConstraintInTranscript( transcripts[i], constraints.constraints[a] ) == 1 
-					&& IsConstraintInTranscript( transcripts[i], constraints.constraints[b] ) == 1 )
-			{
-				//printf( "set btble[ %d ].Set( %d ): %d %d\n", i, j, a, b ) ;
-				btable[i].Set( j ) ;
-
-				if ( min == -1 || tc[j].normAbund < min )
-					min = tc[j].normAbund ;
-			}
+			colIds[ pos[ row[k] ] ] = i ;
+			++pos[ row[k] ] ;
 		}
+	}
 
+	// Collapse the constraints compatible with the same transcripts into one class. The E-step splits the 
+	// constraints of a class in the same proportions, so a class only needs the sum of their weighted support.
+	std::map< std::vector<int>, int > classIdx ;
+	std::vector<double> classWeight ;
+	std::vector<int> classOffset ;
+	std::vector<int> classIds ;
+	classOffset.push_back( 0 ) ;
+	for ( j = 0 ; j < tcCnt ; ++j )
+	{
+		if ( colOffset[j + 1] == colOffset[j] )
+			continue ;
+		std::vector<int> key( colIds.begin() + colOffset[j], colIds.begin() + colOffset[j + 1] ) ;
+		double weight = tc[j].support * tc[j].effectiveCount ;
+		std::map< std::vector<int>, int >::iterator it = classIdx.find( key ) ;
+		if ( it == classIdx.end() )
+		{
+			classIdx[key] = classWeight.size() ;
+			classWeight.push_back( weight ) ;
+			classIds.insert( classIds.end(), key.begin(), key.end() ) ;
+			classOffset.push_back( classIds.size() ) ;
+		}
+		else
+			classWeight[ it->second ] += weight ;
+	}
+	int classCnt = classWeight.size() ;
+	double *support = new double[tcnt] ; // the support assigned to each transcript in the E-step.
+	
+	for ( i = 0 ; i < tcnt ; ++i )
+	{
 		std::vector<int> subexonIdx ;
 		transcripts[i].seVector.GetOnesIndices( subexonIdx ) ;
 		int subexonIdxCnt = subexonIdx.size() ;
@@ -2174,40 +2228,25 @@ void TranscriptDecider::AbundanceEstimation( struct _subexon *subexons, int seCn
 	
 	while ( 1 )
 	{
-		for ( i = 0 ; i < tcnt ; ++i )
-			for ( j = 0 ; j < tcCnt ; ++j )
-			{
-				transcripts[i].constraintsSupport[j] = 0 ;
-			}
-		for ( j = 0 ; j < tcCnt ; ++j )
+		memset( support, 0, sizeof( double ) * tcnt ) ;
+		for ( j = 0 ; j < classCnt ; ++j )
 		{
-			int clCnt = 0 ;
+			int clCnt = classOffset[j + 1] - classOffset[j] ;
+			const int *compatibleList = &classIds[ classOffset[j] ] ;
 			double sum = 0 ;
-			for ( i = 0 ; i < tcnt ; ++i )
-			{
-				if ( btable[i].Test(j) )
-				{
-					compatibleList[ clCnt ] = i ;
-					++clCnt ;
-					sum += rho[i] ;
-				}
-			}
+			for ( k = 0 ; k < clCnt ; ++k )
+				sum += rho[ compatibleList[k] ] ;
 
-			for ( i = 0 ; i < clCnt ; ++i )
-			{
-				double factor = tc[j].effectiveCount ;
-				transcripts[ compatibleList[i] ].constraintsSupport[j] = ( rho[ compatibleList[i] ] / sum ) * tc[j].support * factor ;
-			}
+			double factor = classWeight[j] / sum ;
+			for ( k = 0 ; k < clCnt ; ++k )
+				support[ compatibleList[k] ] += rho[ compatibleList[k] ] * factor ;
 		}
 
 		double diff = 0 ;
 		for ( i = 0 ; i < tcnt ; ++i )
 		{
-			double newAbund = 0 ;
-			for ( j = 0 ; j < tcCnt ; ++j )
-				newAbund += transcripts[i].constraintsSupport[j] ;
 			double old = rho[i] ;
-			rho[i] = newAbund / transcriptLength[i] ;
+			rho[i] = support[i] / transcriptLength[i] ;
 			//printf( "rho[%d]=%lf\n", i, rho[i] ) ;
 			if ( transcripts[i].correlationScore == -1 && rho[i] > 0.1 / (double)alignments.readLen )
 				rho[i] = 0.1 / (double)alignments.readLen  ;
@@ -2224,36 +2263,27 @@ void TranscriptDecider::AbundanceEstimation( struct _subexon *subexons, int seCn
 			break ;
 	}
 
+	// The abundance is the support from the last E-step.
 	for ( i = 0 ; i < tcnt ; ++i )
 	{
 		//printf( "%lf=>", transcripts[i].abundance ) ;
-		transcripts[i].abundance = 0 ;
-		for ( j = 0 ; j < tcCnt ; ++j )
-		{
-			transcripts[i].abundance += transcripts[i].constraintsSupport[j] ;
-		}
+		transcripts[i].abundance = support[i] ;
 		//printf( "%lf. (%lf)\n", transcripts[i].abundance, transcripts[i].correlationScore ) ;
 		//transcripts[i].seVector.Print() ;
 	}
 
-	for ( i = 0 ; i < tcnt ; ++i )
-		delete[] transcripts[i].constraintsSupport ;
-
-	// Release the memory of btable.
-	for ( i = 0 ; i < tcnt ; ++i )
-	{
-		btable[i].Release() ;
-	}
-	delete[] compatibleList ;
-	delete[] btable ;
+	delete[] support ;
 	delete[] transcriptLength ;
 	delete[] rho ;
 }
 
 int TranscriptDecider::RefineTranscripts( struct _subexon *subexons, int seCnt, bool aggressive,
-	std::map<int, int> *subexonChainSupport, int *txptSampleSupport, std::vector<struct _transcript> &transcripts, Constraints &constraints ) 
+	std::map<int, int> *subexonChainSupport, int *txptSampleSupport, std::vector<struct _transcript> &transcripts, Constraints &constraints,
+	TranscriptConstraintIndex &compatibility ) 
 {
 	int i, j, k ;
+	const int *row ;
+	int rowCnt ;
 	int tcnt = transcripts.size() ;
 	if ( tcnt == 0 )
 		return 0 ;
@@ -2324,8 +2354,7 @@ int TranscriptDecider::RefineTranscripts( struct _subexon *subexons, int seCnt,
 				continue ;
 			for ( i = 0 ; i < tcnt ; ++i )
 			{
-				if ( IsConstraintInTranscript( transcripts[i], scc[ tc[j].i ] ) && 
-					IsConstraintInTranscript( transcripts[i], scc[ tc[j].j] ) )
+				if ( compatibility.IsCompatible( transcripts[i].id, j ) )
 				{
 					tag = i ;
 					++cnt ;
@@ -2725,10 +2754,10 @@ int TranscriptDecider::RefineTranscripts( struct _subexon *subexons, int seCnt,
 		int support = 0 ;
 		int uniqSupport = 0 ;
 
-		for ( j = 0 ; j < tcCnt ; ++j )
+		rowCnt = compatibility.GetConstraints( transcripts[i].id, row ) ;
+		for ( k = 0 ; k < rowCnt ; ++k )
 		{
-			if ( !IsConstraintInTranscript( transcripts[i], scc[ tc[j].i ] ) || !IsConstraintInTranscript( transcripts[i], scc[ tc[j].j ] ) )
-				continue ;
+			j = row[k] ;
 			//support += scc[ tc[j].i ].support + scc[ tc[j].j ].support ;
 			//uniqSupport += scc[ tc[j].i ].uniqSupport + scc[ tc[j].j ].uniqSupport ; 
 			support += tc[j].support ;
@@ -2809,10 +2838,10 @@ int TranscriptDecider::RefineTranscripts( struct _subexon *subexons, int seCnt,
 		// the alignment support the intron must be unique and has enough support.
 		int support = 0 ;
 		int uniqSupport = 0 ;
-		for ( j = 0 ; j < tcCnt ; ++j )
+		rowCnt = compatibility.GetConstraints( transcripts[i].id, row ) ;
+		for ( k = 0 ; k < rowCnt ; ++k )
 		{
-			if ( !IsConstraintInTranscript( transcripts[i], scc[ tc[j].i ] ) || !IsConstraintInTranscript( transcripts[i], scc[ tc[j].j ] ) )
-				continue ;
+			j = row[k] ;
 			if ( ( scc[ tc[j].i ].vector.Test( subexonIdx[ anchorIdx ] ) && scc[ tc[j].i ].vector.Test( subexonIdx[ anchorIdx + 1 ] ) ) 
 			 	||  ( scc[ tc[j].j ].vector.Test( subexonIdx[ anchorIdx ] ) && scc[ tc[j].j ].vector.Test( subexonIdx[ anchorIdx + 1 ] ) ) )
 			{
@@ -2875,11 +2904,11 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 {
 	int i, j, k ;
 	int cnt = 0 ;
-	int *f = new int[seCnt] ; // this is a general buffer for a type of usage.	
+	int *f = ReserveBuffer( bufferF, seCnt ) ; // this is a general buffer for a type of usage.	
 	bool useDP = false ;
 
-	compatibleTestVectorT.Init( seCnt ) ; // this is the bittable used in compatible test function.	
-	compatibleTestVectorC.Init( seCnt ) ;
+	compatibleTestVectorT.Reinit( seCnt ) ; // this is the bittable used in compatible test function.	
+	compatibleTestVectorC.Reinit( seCnt ) ;
 
 	for ( i = 0 ; i < seCnt ; ++i )
 	{
@@ -3003,7 +3032,7 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 		defaultGeneId[1] = usedGeneId - 1 ;
 
 	// Go through the constraints to find the chain of subexons that should be kept.
-	std::map<int, int> *subexonChainSupport = new std::map<int, int>[ seCnt ] ; 
+	std::map<int, int> *subexonChainSupport = ReserveBuffer( bufferChainSupport, seCnt ) ; 
 	for ( i = 0 ; i < sampleCnt ; ++i )
 	{
 		std::vector<int> subexonIdx ;
@@ -3142,43 +3171,12 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 
 		// pre allocate the memory.
 		struct _dpAttribute attr ;
-		attr.f1 = new struct _dp[seCnt] ;
-		if ( seCnt <= 10000 )
-		{
-			attr.f2 = new struct _dp*[seCnt] ;
-			for ( i = 0 ; i < seCnt ; ++i )
-				attr.f2[i] = new struct _dp[seCnt] ;
-		}
-		else 
-			attr.f2 = NULL ;
-		
-		hashMax = HASH_MAX ;
-		if (seCnt > 500)
-			hashMax = 1000003 ;
-		else if (seCnt > 1000)
-			hashMax = 10000019 ; 
-		else if (seCnt > 1500)
-			hashMax = 20000003 ;
-
-		attr.hash = dpHash ; 
-		if ( hashMax != HASH_MAX )
-			attr.hash = new struct _dp[hashMax] ;
+		attr.f1 = ReserveBuffer( bufferF1, seCnt ) ;
+		attr.f2 = &dpPairs ;
+		attr.hash = &dpMemo ;
 
 		for ( i = 0 ; i < seCnt ; ++i )
-		{
-			attr.f1[i].seVector.Nullify() ;
-			attr.f1[i].seVector.Init( seCnt ) ;
-			for ( j = i ; j < seCnt ; ++j )
-			{
-				attr.f2[i][j].seVector.Nullify() ;
-				attr.f2[i][j].seVector.Init( seCnt ) ;
-			}
-		}
-		for ( i = 0 ; i < hashMax ; ++i )
-		{
-			attr.hash[i].seVector.Nullify() ;
-			attr.hash[i].seVector.Init( seCnt ) ;
-		}
+			attr.f1[i].seVector.Reinit( seCnt ) ;
 
 		// select candidate transcripts from each sample.
 		struct _pair32 *sampleComplexity = new struct _pair32[ sampleCnt ] ;
@@ -3242,30 +3240,20 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 
 		// release the memory.
 		delete[] sampleComplexity ;
-		for ( i = 0 ; i < seCnt ; ++i )	
-		{
-			attr.f1[i].seVector.Release() ;
-			for ( j = i ; j < seCnt && attr.f2 ; ++j )
-				attr.f2[i][j].seVector.Release() ;
-		}
-		for ( i = 0 ; i < hashMax ; ++i )
-			attr.hash[i].seVector.Release() ;
-
-		delete[] attr.f1 ;
-		for ( i = 0 ; i < seCnt && attr.f2 ; ++i )
-			delete[] attr.f2[i] ;
-		delete[] attr.f2 ;
-		if (hashMax != HASH_MAX)
-			delete[] attr.hash ;
-
 	}
 	
-	transcriptId = new int[usedGeneId - baseGeneId] ;
-	std::vector<struct _transcript> *predTranscripts = new std::vector<struct _transcript>[sampleCnt] ;
+	transcriptId = ReserveBuffer( bufferTranscriptId, usedGeneId - baseGeneId ) ;
+	std::vector<struct _transcript> *predTranscripts = ReserveBuffer( bufferPredTranscripts, sampleCnt ) ;
 	
 	atCnt = alltranscripts.size() ;
 	for ( i = 0 ; i < atCnt ; ++i )
 		alltranscripts[i].FPKM = 0 ;
+
+	// The compatibility between alltranscripts and the constraints of each sample, shared by the picking, 
+	// the abundance estimation and the refinement below.
+	TranscriptConstraintIndex *compatibility = ReserveBuffer( bufferCompatibility, sampleCnt ) ;
+	for ( i = 0 ; i < sampleCnt ; ++i )
+		BuildCompatibilityIndex( alltranscripts, constraints[i], compatibility[i] ) ;
 	
 	for ( i = 0 ; i < sampleCnt ; ++i )
 	{
@@ -3273,7 +3261,7 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 		for ( j = 0 ; j < size ; ++j )
 			alltranscripts[j].abundance = -1 ;
 		//printf( "pick: %d: %d %d\n", i, constraints[i].matePairs.size(), alltranscripts.size() ) ;
-		PickTranscripts( subexons, alltranscripts, constraints[i], subexonCorrelation, predTranscripts[i] ) ;
+		PickTranscripts( subexons, alltranscripts, constraints[i], compatibility[i], subexonCorrelation, predTranscripts[i] ) ;
 		
 		/*double tmp = FPKMFraction ;
 		FPKMFraction = 0 ;
@@ -3288,7 +3276,7 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 	}
 	
 	atCnt = alltranscripts.size() ;
-	int *txptSampleSupport = new int[atCnt] ;
+	int *txptSampleSupport = ReserveBuffer( bufferTxptSampleSupport, atCnt ) ;
 	memset( txptSampleSupport, 0, sizeof( int ) * atCnt ) ;
 	for ( i = 0 ; i < sampleCnt ; ++i )
 	{
@@ -3313,11 +3301,11 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 			predTranscripts[i][j].seVector.Release() ;
 		}
 		predTranscripts[i].clear() ;
-		PickTranscripts( subexons, alltranscripts, constraints[i], subexonCorrelation, predTranscripts[i] ) ;
+		PickTranscripts( subexons, alltranscripts, constraints[i], compatibility[i], subexonCorrelation, predTranscripts[i] ) ;
 	}
 	
-	std::vector<int> *rawPredTranscriptIds = new std::vector<int>[sampleCnt] ;
-	std::vector<double> *rawPredTranscriptAbundance = new std::vector<double>[sampleCnt] ;
+	std::vector<int> *rawPredTranscriptIds = ReserveBuffer( bufferRawPredTranscriptIds, sampleCnt ) ;
+	std::vector<double> *rawPredTranscriptAbundance = ReserveBuffer( bufferRawPredTranscriptAbundance, sampleCnt ) ;
 	for ( i = 0 ; i < sampleCnt ; ++i )
 	{
 		int size = predTranscripts[i].size() ;
@@ -3337,13 +3325,13 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 		{
 			ConvertTranscriptAbundanceToFPKM( subexons, predTranscripts[i][j] ) ;
 		}
-		size = RefineTranscripts( subexons, seCnt, false, subexonChainSupport, txptSampleSupport, predTranscripts[i], constraints[i] ) ;
+		size = RefineTranscripts( subexons, seCnt, false, subexonChainSupport, txptSampleSupport, predTranscripts[i], constraints[i], compatibility[i] ) ;
 		
 		// Recompute the abundance.
-		AbundanceEstimation( subexons, seCnt, constraints[i], predTranscripts[i] ) ;
+		AbundanceEstimation( subexons, seCnt, constraints[i], compatibility[i], predTranscripts[i] ) ;
 		for ( j = 0 ; j < size ; ++j )
 			ConvertTranscriptAbundanceToFPKM( subexons, predTranscripts[i][j] ) ;
-		size = RefineTranscripts( subexons, seCnt, true, subexonChainSupport, txptSampleSupport, predTranscripts[i], constraints[i] ) ;
+		size = RefineTranscripts( subexons, seCnt, true, subexonChainSupport, txptSampleSupport, predTranscripts[i], constraints[i], compatibility[i] ) ;
 		
 		//ComputeTranscriptsScore( subexons, seCnt, subexonChainSupport, predTranscripts[i] ) ;
 	}
@@ -3359,10 +3347,10 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 		}
 	}
 
-	bool *predicted = new bool[atCnt] ;
+	char *predicted = ReserveBuffer( bufferPredicted, atCnt ) ;
 	for ( i = 0 ; i < sampleCnt ; ++i )
 	{
-		memset( predicted, false, sizeof( bool ) * atCnt ) ;
+		memset( predicted, false, sizeof( char ) * atCnt ) ;
 		if ( predTranscripts[i].size() != rawPredTranscriptIds[i].size() )	
 		{
 			int psize = predTranscripts[i].size() ;
@@ -3389,7 +3377,7 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 				}
 			}
 			if ( psize != predTranscripts[i].size() )
-				AbundanceEstimation( subexons, seCnt, constraints[i], predTranscripts[i] ) ;
+				AbundanceEstimation( subexons, seCnt, constraints[i], compatibility[i], predTranscripts[i] ) ;
 		}
 
 		int size = predTranscripts[i].size() ;
@@ -3404,7 +3392,7 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 			{
 				predTranscripts[i][j].abundance = 1.0 / alignments.readLen ;
 			}
-			AbundanceEstimation( subexons, seCnt, constraints[i], predTranscripts[i] ) ;
+			AbundanceEstimation( subexons, seCnt, constraints[i], compatibility[i], predTranscripts[i] ) ;
 			
 			std::vector<int> subexonIdx ;
 			for ( j = 0 ; j < l ; ++j )
@@ -3438,20 +3426,19 @@ int TranscriptDecider::Solve( struct _subexon *subexons, int seCnt, std::vector<
 		}
 	}
 
-	delete []predicted ;
-	delete []transcriptId ;
-	delete []predTranscripts ;
-	delete []rawPredTranscriptIds ;
-	delete []rawPredTranscriptAbundance ;
-	delete []txptSampleSupport ;
+	// Only reset the part of the buffers used by this gene, so they can be used by the next gene.
+	for ( i = 0 ; i < sampleCnt ; ++i )
+	{
+		predTranscripts[i].clear() ;
+		rawPredTranscriptIds[i].clear() ;
+		rawPredTranscriptAbundance[i].clear() ;
+	}
 
 	atCnt = alltranscripts.size() ;
 	for ( i = 0 ; i < atCnt ; ++i )
 		alltranscripts[i].seVector.Release() ;
-	compatibleTestVectorT.Release() ;
-	compatibleTestVectorC.Release() ;
-	delete[] f ;
-	delete[] subexonChainSupport ;
+	for ( i = 0 ; i < seCnt ; ++i )
+		subexonChainSupport[i].clear() ;
 	return 0 ;	
 }
 
@@ -3460,33 +3447,34 @@ void *TranscriptDeciderSolve_Wrapper( void *a )
 	int i ;
 	
 	struct _transcriptDeciderThreadArg &arg = *( (struct _transcriptDeciderThreadArg *)a ) ;
+	// The decider and its dp buffer are kept for all the genes of this thread.
 	TranscriptDecider transcriptDecider( arg.FPKMFraction, arg.classifierThreshold, arg.txptMinReadDepth, arg.sampleCnt, *( arg.alignments ) ) ;
 	transcriptDecider.SetNumThreads( arg.numThreads + 1 ) ;
 	transcriptDecider.SetMultiThreadOutputHandler( arg.outputHandler ) ;
 	transcriptDecider.SetMaxDpConstraintSize( arg.maxDpConstraintSize ) ;
-	transcriptDecider.Solve( arg.subexons, arg.seCnt, arg.constraints, arg.subexonCorrelation ) ;
+
+	struct _geneWork *work ;
+	while ( ( work = arg.workQueue->GetWork() ) != NULL )
+	{
+		transcriptDecider.Solve( work->subexons, work->seCnt, work->constraints, work->subexonCorrelation ) ;
 	
-	int start = arg.subexons[0].start ;
-	int end = arg.subexons[ arg.seCnt - 1 ].end ;
-	int chrId = arg.subexons[0].chrId ;
-	// Release memory
-	for ( i = 0 ; i < arg.seCnt ; ++i )
-	{
-		delete[] arg.subexons[i].prev ;
-		delete[] arg.subexons[i].next ;
-	}
-	delete[] arg.subexons ;
-
-	// Put the work id back to the free threads queue.
-	pthread_mutex_lock( arg.ftLock ) ;
-	arg.freeThreads[ *( arg.ftCnt ) ] = arg.tid ;
-	++*( arg.ftCnt ) ;
-	if ( *( arg.ftCnt ) == 1 )
-		pthread_cond_signal( arg.fullWorkCond ) ;
-	pthread_mutex_unlock( arg.ftLock) ;
-	printf( "Thread %d: %s %d %d finished.\n", arg.tid, arg.alignments->GetChromName(chrId), start + 1, end + 1 ) ;
-	fflush( stdout ) ;
+		int start = work->subexons[0].start ;
+		int end = work->subexons[ work->seCnt - 1 ].end ;
+		int chrId = work->subexons[0].chrId ;
+		// Release memory
+		for ( i = 0 ; i < work->seCnt ; ++i )
+		{
+			delete[] work->subexons[i].prev ;
+			delete[] work->subexons[i].next ;
+		}
+		delete[] work->subexons ;
+		work->subexons = NULL ;
 
+		// Put the work back for the next gene.
+		arg.workQueue->ReleaseWork( work ) ;
+		printf( "Thread %d: %s %d %d finished.\n", arg.tid, arg.alignments->GetChromName(chrId), start + 1, end + 1 ) ;
+		fflush( stdout ) ;
+	}
 
 	pthread_exit( NULL ) ;
 }
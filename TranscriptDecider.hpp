@@ -12,8 +12,8 @@
 #include "BitTable.hpp"
 #include "Constraints.hpp"
 
-#define HASH_MAX 100003 // default HASH_MAX
 #define USE_DP 200000
+#define DP_KEEP_ENTRY_MIN 4096 // the dp entries a decider always keeps for the later genes.
 
 struct _transcript
 {
@@ -57,11 +57,331 @@ struct _dp
 	int strand ;
 } ;
 
+// Prepare a dp entry kept from an earlier gene for a gene with seCnt subexons.
+inline void InitDpEntry( struct _dp &d, int seCnt )
+{
+	d.seVector.Reinit( seCnt ) ;
+	d.first = d.last = d.cnt = -1 ;
+	d.cover = -1 ;
+	d.minAbundance = -1 ;
+	d.timeStamp = -1 ;
+}
+
+// Release the kept dp entries beyond twice what the last gene used, when that gene used 
+// less than a quarter of them, so one large gene does not pin its arena for the rest of the run.
+template <class T> void ShrinkDpEntries( std::vector<T> &entries, int usedCnt )
+{
+	int i ;
+	int size = entries.size() ;
+	if ( size <= DP_KEEP_ENTRY_MIN || size <= 4 * usedCnt )
+		return ;
+	int keep = 2 * usedCnt ;
+	if ( keep < DP_KEEP_ENTRY_MIN )
+		keep = DP_KEEP_ENTRY_MIN ;
+	for ( i = keep ; i < size ; ++i )
+		entries[i].dp.seVector.Release() ;
+	std::vector<T>( entries.begin(), entries.begin() + keep ).swap( entries ) ;
+}
+
+// The mate-pair constraints compatible with each transcript of a gene in a sample, in CSR form.
+// The constraints of transcript i are ids[ offset[i]...offset[i + 1] - 1 ] in increasing order.
+// The transposed lists give the compatible transcripts of each constraint, also in increasing order.
+class TranscriptConstraintIndex
+{
+private:
+	std::vector<int> offset ;
+	std::vector<int> ids ;
+	std::vector<int> colOffset ;
+	std::vector<int> colIds ;
+public:
+	void Clear()
+	{
+		offset.clear() ;
+		ids.clear() ;
+		colOffset.clear() ;
+		colIds.clear() ;
+		offset.push_back( 0 ) ;
+	}
+
+	// Add constraint j to the current transcript. The constraints of a transcript are added in increasing order.
+	void Add( int j )
+	{
+		ids.push_back( j ) ;
+	}
+
+	// Finish the current transcript and start the next one.
+	void NextTranscript()
+	{
+		offset.push_back( ids.size() ) ;
+	}
+
+	// Build the transposed lists after all the transcripts are added.
+	void Finish( int constraintCnt )
+	{
+		int i, k ;
+		int tcnt = (int)offset.size() - 1 ;
+		colOffset.assign( constraintCnt + 1, 0 ) ;
+		colIds.resize( ids.size() ) ;
+		for ( k = 0 ; k < (int)ids.size() ; ++k )
+			++colOffset[ ids[k] + 1 ] ;
+		for ( i = 0 ; i < constraintCnt ; ++i )
+			colOffset[i + 1] += colOffset[i] ;
+		std::vector<int> pos( colOffset.begin(), colOffset.end() - 1 ) ;
+		for ( i = 0 ; i < tcnt ; ++i )
+			for ( k = offset[i] ; k < offset[i + 1] ; ++k )
+			{
+				colIds[ pos[ ids[k] ] ] = i ;
+				++pos[ ids[k] ] ;
+			}
+	}
+
+	int GetCompatibleCount() const
+	{
+		return ids.size() ;
+	}
+
+	// Return the number of constraints compatible with transcript i, and let row point to them.
+	int GetConstraints( int i, const int *&row ) const
+	{
+		row = ids.size() > 0 ? &ids[0] + offset[i] : NULL ;
+		return offset[i + 1] - offset[i] ;
+	}
+
+	// Return the number of transcripts compatible with constraint j, and let col point to them.
+	int GetTranscripts( int j, const int *&col ) const
+	{
+		col = colIds.size() > 0 ? &colIds[0] + colOffset[j] : NULL ;
+		return colOffset[j + 1] - colOffset[j] ;
+	}
+
+	bool IsCompatible( int i, int j ) const
+	{
+		int l = offset[i], r = offset[i + 1] - 1 ;
+		while ( l <= r )
+		{
+			int m = ( l + r ) / 2 ;
+			if ( ids[m] == j )
+				return true ;
+			else if ( ids[m] < j )
+				l = m + 1 ;
+			else
+				r = m - 1 ;
+		}
+		return false ;
+	}
+} ;
+
+// The dp results of the sub-transcripts with two subexons. Only the pairs that are written get an entry,
+// and the entries with their bit tables are kept for the later genes of the same decider, 
+// up to what ShrinkDpEntries allows.
+class DpPairTable
+{
+private:
+	struct _dpPairEntry
+	{
+		int b ;
+		int next ; // the next entry with the same first subexon.
+		struct _dp dp ;
+	} ;
+
+	std::vector<struct _dpPairEntry> entries ;
+	int usedCnt ;
+	std::vector<int> rowHead ; // the first entry of each first subexon.
+	int seCnt ;
+public:
+	DpPairTable()
+	{
+		usedCnt = 0 ;
+		seCnt = 0 ;
+	}
+
+	~DpPairTable()
+	{
+		int i ;
+		int size = entries.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			entries[i].dp.seVector.Release() ;
+	}
+
+	// Drop all the entries, for the gene with cnt subexons.
+	void Clear( int cnt )
+	{
+		ShrinkDpEntries( entries, usedCnt ) ;
+		seCnt = cnt ;
+		usedCnt = 0 ;
+		if ( (int)rowHead.capacity() > 4 * cnt && (int)rowHead.capacity() > DP_KEEP_ENTRY_MIN )
+			std::vector<int>().swap( rowHead ) ;
+		rowHead.assign( cnt, -1 ) ;
+	}
+
+	// Return NULL if the pair has no entry.
+	struct _dp *Get( int a, int b )
+	{
+		int i ;
+		for ( i = rowHead[a] ; i != -1 ; i = entries[i].next )
+			if ( entries[i].b == b )
+				return &entries[i].dp ;
+		return NULL ;
+	}
+
+	// The returned entry is only valid until the next call to GetOrAdd.
+	struct _dp &GetOrAdd( int a, int b )
+	{
+		struct _dp *d = Get( a, b ) ;
+		if ( d != NULL )
+			return *d ;
+
+		if ( usedCnt >= (int)entries.size() )
+		{
+			struct _dpPairEntry e ;
+			e.dp.seVector.Nullify() ;
+			entries.push_back( e ) ;
+		}
+		struct _dpPairEntry &e = entries[ usedCnt ] ;
+		InitDpEntry( e.dp, seCnt ) ;
+		e.b = b ;
+		e.next = rowHead[a] ;
+		rowHead[a] = usedCnt ;
+		++usedCnt ;
+		return e.dp ;
+	}
+} ;
+
+// The dp results of the longer sub-transcripts, in an open addressing hash table keyed by their subexons.
+// The keys and the entries are kept for the later genes of the same decider, up to what ShrinkDpEntries
+// allows, and the table grows with the number of dp states.
+class DpMemo
+{
+private:
+	struct _dpMemoEntry
+	{
+		uint64_t key ;
+		int keyOffset ; // the subexons of the key are in keys.
+		int keyCnt ;
+		struct _dp dp ;
+	} ;
+
+	std::vector<struct _dpMemoEntry> entries ;
+	int usedCnt ;
+	std::vector<int> keys ;
+	std::vector<int> slots ; // the entry in each slot, -1 for empty.
+	int seCnt ;
+
+	static uint64_t HashKey( int visit[], int vcnt )
+	{
+		int i ;
+		uint64_t key = 0 ;
+		for ( i = 0 ; i < vcnt ; ++i )
+			key = key * 1000003ull + (uint64_t)( visit[i] + 1 ) ;
+		return key ;
+	}
+
+	int SlotOf( uint64_t key )
+	{
+		key ^= key >> 31 ;
+		key *= 0x9e3779b97f4a7c15ull ;
+		return (int)( ( key >> 32 ) & ( slots.size() - 1 ) ) ;
+	}
+
+	// The slot holding the key, or the empty slot it goes to.
+	int FindSlot( uint64_t key, int visit[], int vcnt )
+	{
+		int mask = slots.size() - 1 ;
+		int i ;
+		for ( i = SlotOf( key ) ; slots[i] != -1 ; i = ( i + 1 ) & mask )
+		{
+			struct _dpMemoEntry &e = entries[ slots[i] ] ;
+			if ( e.key == key && e.keyCnt == vcnt
+				&& !memcmp( &keys[ e.keyOffset ], visit, sizeof( int ) * vcnt ) )
+				break ;
+		}
+		return i ;
+	}
+
+	void Grow()
+	{
+		int i ;
+		int mask = slots.size() * 2 - 1 ;
+		slots.assign( slots.size() * 2, -1 ) ;
+		for ( i = 0 ; i < usedCnt ; ++i )
+		{
+			int j ;
+			for ( j = SlotOf( entries[i].key ) ; slots[j] != -1 ; j = ( j + 1 ) & mask )
+				;
+			slots[j] = i ;
+		}
+	}
+public:
+	DpMemo()
+	{
+		usedCnt = 0 ;
+		seCnt = 0 ;
+	}
+
+	~DpMemo()
+	{
+		int i ;
+		int size = entries.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			entries[i].dp.seVector.Release() ;
+	}
+
+	// Drop all the entries, for the gene with cnt subexons.
+	void Clear( int cnt )
+	{
+		if ( (int)keys.capacity() > 4 * (int)keys.size() && (int)keys.capacity() > 8 * DP_KEEP_ENTRY_MIN )
+			std::vector<int>().swap( keys ) ;
+		if ( (int)slots.capacity() > 8 * usedCnt && (int)slots.capacity() > 2 * DP_KEEP_ENTRY_MIN )
+			std::vector<int>().swap( slots ) ;
+		ShrinkDpEntries( entries, usedCnt ) ;
+		seCnt = cnt ;
+		usedCnt = 0 ;
+		keys.clear() ;
+		slots.assign( 1024, -1 ) ;
+	}
+
+	// Return NULL if the sub-transcript has no entry.
+	struct _dp *Get( int visit[], int vcnt )
+	{
+		int i = FindSlot( HashKey( visit, vcnt ), visit, vcnt ) ;
+		if ( slots[i] == -1 )
+			return NULL ;
+		return &entries[ slots[i] ].dp ;
+	}
+
+	// The returned entry is only valid until the next call to GetOrAdd.
+	struct _dp &GetOrAdd( int visit[], int vcnt )
+	{
+		if ( ( usedCnt + 1 ) * 2 > (int)slots.size() )
+			Grow() ;
+		uint64_t key = HashKey( visit, vcnt ) ;
+		int i = FindSlot( key, visit, vcnt ) ;
+		if ( slots[i] != -1 )
+			return entries[ slots[i] ].dp ;
+
+		if ( usedCnt >= (int)entries.size() )
+		{
+			struct _dpMemoEntry e ;
+			e.dp.seVector.Nullify() ;
+			entries.push_back( e ) ;
+		}
+		struct _dpMemoEntry &e = entries[ usedCnt ] ;
+		InitDpEntry( e.dp, seCnt ) ;
+		e.key = key ;
+		e.keyOffset = keys.size() ;
+		e.keyCnt = vcnt ;
+		keys.insert( keys.end(), visit, visit + vcnt ) ;
+		slots[i] = usedCnt ;
+		++usedCnt ;
+		return e.dp ;
+	}
+} ;
 
 struct _dpAttribute
 {
-	struct _dp *f1, **f2 ;
-	struct _dp *hash ;
+	struct _dp *f1 ;
+	DpPairTable *f2 ;
+	DpMemo *hash ;
 
 	struct _transcript bufferTxpt ;
 
@@ -78,25 +398,202 @@ struct _dpAttribute
 
 class MultiThreadOutputTranscript ;
 
-struct _transcriptDeciderThreadArg
+// The inputs of a gene handed to a worker thread.
+struct _geneWork
 {
-	int tid ;
+	int id ; // the index of the gene.
 	struct _subexon *subexons ;
 	int seCnt ;
+	int64_t cost ; // estimated from the subexon and constraint counts.
+	std::vector<Constraints> constraints ;
+	SubexonCorrelation subexonCorrelation ;
+} ;
+
+// The work shared by the persistent worker threads: building the constraints of the gene being
+// read in, one sample per job, and solving the genes read in so far, the most expensive one first,
+// so the large genes do not start last and hold up the run.
+class GeneWorkQueue
+{
+private:
+	std::vector<struct _geneWork *> works ;
+	std::vector<struct _geneWork *> freeWorks ;
+	std::vector<struct _geneWork *> readyWorks ; // a heap by cost.
+
+	// The current round of constraint building.
+	std::vector<Constraints> *buildConstraints ;
+	struct _subexon *buildSubexons ;
+	int buildSeCnt, buildStart, buildEnd ;
+	int nextBuild, buildCnt, buildDoneCnt ;
+
+	int idleCnt ;
+	bool finished ;
+	pthread_mutex_t lock ;
+	pthread_cond_t workCond ; // for the workers
+	pthread_cond_t freeCond, buildCond ; // for the thread reading in the genes
+
+	static bool CompWorkCost( const struct _geneWork *a, const struct _geneWork *b )
+	{
+		if ( a->cost != b->cost )
+			return a->cost < b->cost ;
+		return a->id > b->id ;
+	}
+
+	// Called and returns with the lock held.
+	void RunBuildJob()
+	{
+		int k = nextBuild ;
+		++nextBuild ;
+		pthread_mutex_unlock( &lock ) ;
+		( *buildConstraints )[k].BuildConstraints( buildSubexons, buildSeCnt, buildStart, buildEnd ) ;
+		pthread_mutex_lock( &lock ) ;
+		++buildDoneCnt ;
+		if ( buildDoneCnt == buildCnt )
+			pthread_cond_signal( &buildCond ) ;
+	}
+public:
+	GeneWorkQueue( int workCnt, std::vector<Alignments> &alignmentFiles )
+	{
+		int i, j ;
+		int sampleCnt = alignmentFiles.size() ;
+		for ( i = 0 ; i < workCnt ; ++i )
+		{
+			struct _geneWork *w = new struct _geneWork ;
+			w->subexons = NULL ;
+			for ( j = 0 ; j < sampleCnt ; ++j )
+			{
+				Constraints constraints( &alignmentFiles[j] ) ;
+				w->constraints.push_back( constraints ) ;
+			}
+			works.push_back( w ) ;
+			freeWorks.push_back( w ) ;
+		}
+		nextBuild = buildCnt = buildDoneCnt = 0 ;
+		idleCnt = 0 ;
+		finished = false ;
+		pthread_mutex_init( &lock, NULL ) ;
+		pthread_cond_init( &workCond, NULL ) ;
+		pthread_cond_init( &freeCond, NULL ) ;
+		pthread_cond_init( &buildCond, NULL ) ;
+	}
+
+	~GeneWorkQueue()
+	{
+		int i ;
+		int size = works.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			delete works[i] ;
+		pthread_mutex_destroy( &lock ) ;
+		pthread_cond_destroy( &workCond ) ;
+		pthread_cond_destroy( &freeCond ) ;
+		pthread_cond_destroy( &buildCond ) ;
+	}
+
+	// Build the constraints of each sample for the subexons, with the help of the idle workers.
+	void BuildConstraints( std::vector<Constraints> &constraints, struct _subexon *subexons, int seCnt, int start, int end )
+	{
+		pthread_mutex_lock( &lock ) ;
+		buildConstraints = &constraints ;
+		buildSubexons = subexons ;
+		buildSeCnt = seCnt ;
+		buildStart = start ;
+		buildEnd = end ;
+		nextBuild = 0 ;
+		buildDoneCnt = 0 ;
+		buildCnt = constraints.size() ;
+		if ( buildCnt > 1 )
+			pthread_cond_broadcast( &workCond ) ;
+		while ( nextBuild < buildCnt )
+			RunBuildJob() ;
+		while ( buildDoneCnt < buildCnt )
+			pthread_cond_wait( &buildCond, &lock ) ;
+		pthread_mutex_unlock( &lock ) ;
+	}
+
+	// Wait for a work whose previous gene is solved.
+	struct _geneWork *GetFreeWork()
+	{
+		pthread_mutex_lock( &lock ) ;
+		while ( freeWorks.size() == 0 )
+			pthread_cond_wait( &freeCond, &lock ) ;
+		struct _geneWork *w = freeWorks.back() ;
+		freeWorks.pop_back() ;
+		pthread_mutex_unlock( &lock ) ;
+		return w ;
+	}
+
+	void AddWork( struct _geneWork *w )
+	{
+		pthread_mutex_lock( &lock ) ;
+		readyWorks.push_back( w ) ;
+		std::push_heap( readyWorks.begin(), readyWorks.end(), CompWorkCost ) ;
+		pthread_cond_signal( &workCond ) ;
+		pthread_mutex_unlock( &lock ) ;
+	}
+
+	// For the workers: help with the constraints first, then take the most expensive gene.
+	// Return NULL when all the genes are taken.
+	struct _geneWork *GetWork()
+	{
+		struct _geneWork *w = NULL ;
+		pthread_mutex_lock( &lock ) ;
+		while ( 1 )
+		{
+			if ( nextBuild < buildCnt )
+			{
+				RunBuildJob() ;
+				continue ;
+			}
+			if ( readyWorks.size() > 0 )
+			{
+				std::pop_heap( readyWorks.begin(), readyWorks.end(), CompWorkCost ) ;
+				w = readyWorks.back() ;
+				readyWorks.pop_back() ;
+				break ;
+			}
+			if ( finished )
+				break ;
+			++idleCnt ;
+			pthread_cond_wait( &workCond, &lock ) ;
+			--idleCnt ;
+		}
+		pthread_mutex_unlock( &lock ) ;
+		return w ;
+	}
+
+	void ReleaseWork( struct _geneWork *w )
+	{
+		pthread_mutex_lock( &lock ) ;
+		freeWorks.push_back( w ) ;
+		pthread_cond_signal( &freeCond ) ;
+		pthread_mutex_unlock( &lock ) ;
+	}
+
+	// No more genes will be added.
+	void Finish()
+	{
+		pthread_mutex_lock( &lock ) ;
+		finished = true ;
+		pthread_cond_broadcast( &workCond ) ;
+		pthread_mutex_unlock( &lock ) ;
+	}
+
+	int GetIdleCount()
+	{
+		return idleCnt ;
+	}
+} ;
+
+struct _transcriptDeciderThreadArg
+{
+	int tid ;
 	int sampleCnt ;
 	int numThreads ;
 
 	int maxDpConstraintSize ;
 	double FPKMFraction, classifierThreshold, txptMinReadDepth ;
 	Alignments *alignments ;
-	std::vector<Constraints> constraints ;
-	SubexonCorrelation subexonCorrelation ;
 	MultiThreadOutputTranscript *outputHandler ;
-
-	int *freeThreads ; // the stack for free threads
-	int *ftCnt ;
-	pthread_mutex_t *ftLock ;
-	pthread_cond_t *fullWorkCond ;
+	GeneWorkQueue *workQueue ;
 } ;
 
 class MultiThreadOutputTranscript
@@ -290,7 +787,6 @@ private:
 	int numThreads ;
 	double FPKMFraction ;
 	double txptMinReadDepth ;
-	int hashMax ;
 	int maxDpConstraintSize ;
 
 	Constraints *constraints ;
@@ -314,7 +810,31 @@ private:
 	bool IsStartOfMixtureStrandRegion( int tag, struct _subexon *subexons, int seCnt ) ;
 
 	// The functions to pick transcripts through dynamic programming
-	struct _dp *dpHash ;
+	DpPairTable dpPairs ;
+	DpMemo dpMemo ;
+
+	// The buffers of Solve, kept for the next genes of this decider. They only grow,
+	// and only the part used by a gene is reset.
+	std::vector<int> bufferF ;
+	std::vector<struct _dp> bufferF1 ;
+	std::vector< std::map<int, int> > bufferChainSupport ;
+	std::vector< std::vector<struct _transcript> > bufferPredTranscripts ;
+	std::vector< std::vector<int> > bufferRawPredTranscriptIds ;
+	std::vector< std::vector<double> > bufferRawPredTranscriptAbundance ;
+	std::vector<int> bufferTranscriptId ;
+	std::vector<int> bufferTxptSampleSupport ;
+	std::vector<char> bufferPredicted ;
+	std::vector<TranscriptConstraintIndex> bufferCompatibility ; // one for each sample.
+
+	// Return the buffer with room for at least size elements.
+	template <class T>
+	T *ReserveBuffer( std::vector<T> &buffer, int size )
+	{
+		if ( (int)buffer.size() < size )
+			buffer.resize( size ) ;
+		return buffer.size() > 0 ? &buffer[0] : NULL ;
+	}
+
 	void SearchSubTranscript( int tag, int strand, int parents[], int pcnt, struct _dp &pdp, int visit[], int vcnt, int extends[], int extendCnt, std::vector<struct _constraint> &tc, int tcStartInd, struct _dpAttribute &attr ) ;
 	struct _dp SolveSubTranscript( int visit[], int vcnt, int strand, std::vector<struct _constraint> &tc, int tcStartInd, struct _dpAttribute &attr ) ;
 	void PickTranscriptsByDP( struct _subexon *subexons, int seCnt, int iterBound, Constraints &constraints, SubexonCorrelation &correlation, struct _dpAttribute &attr, std::vector<struct _transcript> &allTranscripts ) ;
@@ -348,6 +868,10 @@ private:
 	// Return 0 - uncompatible or does not overlap at all. 1 - fully compatible. 2 - Head of the constraints compatible with the tail of the transcript
 	int IsConstraintInTranscript( struct _transcript transcript, struct _constraint &c ) ;
 	int IsConstraintInTranscriptDebug( struct _transcript transcript, struct _constraint &c ) ;
+	// The same as IsConstraintInTranscript(...) == 1, but only compares the bits from c.first to c.last.
+	bool IsConstraintFullyInTranscript( struct _transcript &transcript, struct _constraint &c ) ;
+	// Find the mate-pair constraints compatible with each transcript.
+	void BuildCompatibilityIndex( std::vector<struct _transcript> &transcripts, Constraints &constraints, TranscriptConstraintIndex &index ) ;
 	
 	// Count how many transcripts are possible starting from subexons[tag].
 	int SubTranscriptCount( int tag, struct _subexon *subexons, int f[] ) ;
@@ -355,7 +879,8 @@ private:
 	// The methods when there is no need for DP
 	void EnumerateTranscript( int tag, int strand, int visit[], int vcnt, struct _subexon *subexons, SubexonCorrelation &correlation, double correlationScore, std::vector<struct _transcript> &alltranscripts, int &atcnt ) ;
 	// For the simpler case, we can pick sample by sample.
-	void PickTranscripts( struct _subexon *subexons, std::vector<struct _transcript> &alltranscripts, Constraints &constraints, SubexonCorrelation &seCorrelation, std::vector<struct _transcript> &transcripts ) ; 
+	void PickTranscripts( struct _subexon *subexons, std::vector<struct _transcript> &alltranscripts, Constraints &constraints, 
+		TranscriptConstraintIndex &compatibility, SubexonCorrelation &seCorrelation, std::vector<struct _transcript> &transcripts ) ; 
 	
 	static bool CompSortTranscripts( const struct _transcript &a, const struct _transcript &b )
 	{
@@ -453,9 +978,10 @@ private:
 		return j ;
 	}
 		
-	void AbundanceEstimation( struct _subexon *subexons, int seCnt, Constraints &constraints, std::vector<struct _transcript> &transcripts ) ;
+	// The compatibility index is the one of alltranscripts, and the id of each transcript is its index in alltranscripts.
+	void AbundanceEstimation( struct _subexon *subexons, int seCnt, Constraints &constraints, TranscriptConstraintIndex &compatibility, std::vector<struct _transcript> &transcripts ) ;
 
-	int RefineTranscripts( struct _subexon *subexons, int seCnt, bool aggressive, std::map<int, int> *subexonChainSupport, int *txptSampleSupport, std::vector<struct _transcript> &transcripts, Constraints &constraints ) ;
+	int RefineTranscripts( struct _subexon *subexons, int seCnt, bool aggressive, std::map<int, int> *subexonChainSupport, int *txptSampleSupport, std::vector<struct _transcript> &transcripts, Constraints &constraints, TranscriptConstraintIndex &compatibility ) ;
 
 	void ComputeTranscriptsScore( struct _subexon *subexons, int seCnt, std::map<int, int> *subexonChainSupport, std::vector<struct _transcript> &transcripts ) ;
 
@@ -488,7 +1014,6 @@ public:
 		maxDpConstraintSize = -1 ;
 		numThreads = 1 ;
 		this->sampleCnt = sampleCnt ;
-		dpHash = new struct _dp[ HASH_MAX ] ; // pre-allocated buffer to hold dp information.
 	}
 	~TranscriptDecider() 
 	{
@@ -501,7 +1026,11 @@ public:
 				fclose( outputFPs[i] ) ;
 			}
 		}
-		delete[] dpHash ;
+		int size = bufferF1.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			bufferF1[i].seVector.Release() ;
+		compatibleTestVectorT.Release() ;
+		compatibleTestVectorC.Release() ;
 	}
 
 
@@ -10,17 +10,116 @@
 #include <iostream>
 #include <stdlib.h>
 #include <math.h>
+#include <ctype.h>
+#include <sys/stat.h>
 
 #include "defs.h"
 
+// The number of records read and decoded at a time by Next().
+#define ALIGNMENT_BATCH_SIZE 64
+
+// The reusable records of a batch and the fields decoded from them,
+// stored as a structure of arrays.
+struct _alignmentBatch
+{
+	bam1_t *records[ ALIGNMENT_BATCH_SIZE ] ;
+
+	struct _pair *segmentPool ; // the segments of all the records in the batch
+	int segmentPoolSize ;
+	int segOffset[ ALIGNMENT_BATCH_SIZE ] ;
+	int segCnt[ ALIGNMENT_BATCH_SIZE ] ;
+	int segmentsSum[ ALIGNMENT_BATCH_SIZE ] ;
+	char clip[ ALIGNMENT_BATCH_SIZE ] ; // bit 0: clipped head, bit 1: clipped tail, bit 2: clipped by 2 or more bases.
+
+	int flag[ ALIGNMENT_BATCH_SIZE ] ;
+	int mtid[ ALIGNMENT_BATCH_SIZE ] ;
+	int64_t mpos[ ALIGNMENT_BATCH_SIZE ] ;
+	int nh[ ALIGNMENT_BATCH_SIZE ] ; // 1 if there is no NH field.
+	int nm[ ALIGNMENT_BATCH_SIZE ] ; // -1 if there is no NM field.
+	char xs[ ALIGNMENT_BATCH_SIZE ] ; // 0 if there is no XS field.
+	int primaryCnt[ ALIGNMENT_BATCH_SIZE ] ; // the number of primary records read up to this record since the previous one in the batch.
+	int tid[ ALIGNMENT_BATCH_SIZE ] ;
+	int qlen[ ALIGNMENT_BATCH_SIZE ] ;
+	char cacheBits[ ALIGNMENT_BATCH_SIZE ] ; // the SEGMENT_CACHE_* bits.
+	// Only filled when replaying a segment cache.
+	uint64_t mateKey[ ALIGNMENT_BATCH_SIZE ] ;
+	char mateSuffix[ ALIGNMENT_BATCH_SIZE ][3] ;
+
+	int cnt ;
+	int cur ;
+	int pendingPrimaryCnt ; // primary records read but not accounted in totalReadCnt yet.
+	bool fileEnd ;
+} ;
+
+// The spliced segment cache holds what Next() returns for each alignment, so the later passes
+// over a sample can replay it instead of inflating and decoding the BAM file again.
+// Layout: the header, the source file name, the targets (length, name length, name), the file offset of 
+// the first record of each target, then one record per alignment followed by its segCnt (start, end) pairs. 
+// A record with chrId=-1 ends the file, and the targets without alignments point to it.
+// The file uses the native byte order and is meant as an intermediate file of one run.
+// The size and modification time of the source file are kept, and a cache that no longer matches 
+// its source is not replayed.
+#define SEGMENT_CACHE_MAGIC "PSISEG03"
+#define SEGMENT_CACHE_BUFFER_SIZE ( 1 << 20 )
+
+// The first three bits are the clip bits of the batch.
+#define SEGMENT_CACHE_CLIP_BITS 7
+#define SEGMENT_CACHE_CLIP_MORE 4
+#define SEGMENT_CACHE_GC_RICH 8
+// The bits below are also set from the auxiliary fields when reading the BAM file.
+#define SEGMENT_CACHE_HAS_SA 16
+#define SEGMENT_CACHE_HAS_XZ 32
+
+struct _segmentCacheHeader
+{
+	char magic[8] ;
+	int readLen, fragLen, fragStdev, matePaired ; // from GetGeneralInfo( true ) on the BAM file.
+	int sampledReadCnt ;
+	int targetCnt ;
+	int fileNameLen ;
+	int sorted ; // the records of each target are consecutive, so the target offsets are valid.
+	int64_t sourceSize, sourceMtime ; // the stat of the source file when the cache was written.
+} ;
+
+struct _segmentCacheRecord
+{
+	int chrId ;
+	int mtid ;
+	int mpos ;
+	int primaryCnt ; // as in the batch; for the last record, the primary records after the last alignment.
+	uint64_t mateKey ; // hash of the read id without the mate suffix.
+	short nm ;
+	unsigned short qlen ;
+	unsigned short flag ;
+	char nh ; // the alignments with NH>=5 are filtered.
+	unsigned char segCnt ;
+	char xs ;
+	char bits ;
+	char mateSuffix[2] ; // the ".1"-like suffix of the read id, if any.
+} ;
+
 class Alignments
 {
 private:
 	samfile_t *fpSam ;	
-	bam1_t *b ;
+	bam1_t *b ; // the current record, points to the batch.
+	struct _alignmentBatch *batch ;
+	bam_index_t *index ; // loaded at the first SeekRegion().
+	bam_iter_t iter ; // the region set by SeekRegion() on a BAM file.
+	int regionChrId ; // the region set by SeekRegion(), -1 when reading the whole file.
+	int regionStart, regionEnd ;
+	FILE *fpCache ; // the segment cache replayed instead of the BAM file.
+	bam_header_t *header ; // the header of the BAM file, or the one rebuilt from the segment cache.
+	struct _segmentCacheHeader cacheHeader ;
+	long cacheOffsetTable ; // where the target offsets start in the segment cache.
+	char *cacheBuffer ; // the chunk of the segment cache being replayed.
+	int cacheBufferLen, cacheBufferPos ;
+	char readId[32] ;
 
 	char fileName[1024] ;
+	char sourceFileName[1024] ; // the BAM file, differs from fileName for a segment cache.
 	bool opened ;	
+	int numThreads ; // threads inflating the BAM blocks ahead of the reader.
 	std::map<std::string, int> chrNameToId ;
 	bool allowSupplementary ;
 	bool allowClip ;
@@ -37,25 +136,407 @@ private:
 
 	void Open()
 	{
-		fpSam = samopen( fileName, "rb", 0 ) ;
-		if ( !fpSam->header )
+		if ( !OpenSegmentCache() )
 		{
-			fprintf( stderr, "Can not open %s.\n", fileName ) ;
-			exit( 1 ) ;
+			fpSam = samopen( fileName, "rb", 0 ) ;
+			if ( fpSam == NULL || !fpSam->header )
+			{
+				fprintf( stderr, "Can not open %s.\n", fileName ) ;
+				exit( 1 ) ;
+			}
+			if ( numThreads > 1 && ( fpSam->type & 1 ) )
+				bgzf_mt( fpSam->x.bam, numThreads, 16 ) ;
+			header = fpSam->header ;
+			strcpy( sourceFileName, fileName ) ;
 		}
 
 		// Collect the chromosome information
-		for ( int i = 0 ; i < fpSam->header->n_targets ; ++i )		
+		for ( int i = 0 ; i < header->n_targets ; ++i )		
 		{
-			std::string s( fpSam->header->target_name[i] ) ;
+			std::string s( header->target_name[i] ) ;
 			chrNameToId[s] = i ;
 		}
 		opened = true ;
 		atBegin = true ;
 		atEnd = false ;
+		ResetBatch() ;
+	}
+
+	// @return: false if the file can not be stat-ed.
+	static bool GetSourceStat( const char *file, int64_t &size, int64_t &mtime )
+	{
+		struct stat st ;
+		if ( stat( file, &st ) )
+			return false ;
+		size = st.st_size ;
+		mtime = st.st_mtime ;
+		return true ;
+	}
+
+	// The batch is allocated at the first read, so copying an unused Alignments object is safe.
+	// @return: false if fileName is not a segment cache. A cache whose source file has changed 
+	// 	is closed, and fileName is switched to the source file.
+	bool OpenSegmentCache()
+	{
+		int i ;
+		fpCache = fopen( fileName, "rb" ) ;
+		if ( fpCache == NULL )
+			return false ;
+		if ( fread( &cacheHeader, sizeof( cacheHeader ), 1, fpCache ) != 1 
+			|| memcmp( cacheHeader.magic, SEGMENT_CACHE_MAGIC, 8 ) )
+		{
+			fclose( fpCache ) ;
+			fpCache = NULL ;
+			return false ;
+		}
+
+		bool fail = ( cacheHeader.fileNameLen >= (int)sizeof( sourceFileName ) 
+			|| fread( sourceFileName, 1, cacheHeader.fileNameLen, fpCache ) != (size_t)cacheHeader.fileNameLen ) ;
+		if ( !fail )
+		{
+			int64_t size, mtime ;
+			sourceFileName[ cacheHeader.fileNameLen ] = '\0' ;
+			if ( !GetSourceStat( sourceFileName, size, mtime ) )
+			{
+				fprintf( stderr, "Can not find %s, the source of the segment cache %s.\n", sourceFileName, fileName ) ;
+				exit( 1 ) ;
+			}
+			if ( size != cacheHeader.sourceSize || mtime != cacheHeader.sourceMtime )
+			{
+				fprintf( stderr, "The segment cache %s does not match %s, use the alignment file instead.\n", 
+					fileName, sourceFileName ) ;
+				fclose( fpCache ) ;
+				fpCache = NULL ;
+				strcpy( fileName, sourceFileName ) ;
+				return false ;
+			}
+		}
+		header = bam_header_init() ;
+		header->n_targets = cacheHeader.targetCnt ;
+		header->target_name = (char **)calloc( header->n_targets, sizeof( char * ) ) ;
+		header->target_len = (uint32_t *)calloc( header->n_targets, sizeof( uint32_t ) ) ;
+		for ( i = 0 ; i < header->n_targets && !fail ; ++i )
+		{
+			int len[2] ;
+			if ( fread( len, sizeof( int ), 2, fpCache ) != 2 )
+			{
+				fail = true ;
+				break ;
+			}
+			header->target_len[i] = len[0] ;
+			header->target_name[i] = (char *)calloc( len[1] + 1, sizeof( char ) ) ;
+			fail = ( fread( header->target_name[i], 1, len[1], fpCache ) != (size_t)len[1] ) ;
+		}
+		if ( fail )
+		{
+			fprintf( stderr, "The segment cache %s is truncated.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+		sourceFileName[ cacheHeader.fileNameLen ] = '\0' ;
+		cacheOffsetTable = ftell( fpCache ) ;
+		if ( fseek( fpCache, sizeof( int64_t ) * cacheHeader.targetCnt, SEEK_CUR ) )
+		{
+			fprintf( stderr, "The segment cache %s is truncated.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+		cacheBufferLen = cacheBufferPos = 0 ;
+		return true ;
+	}
+
+	void AllocateBatch()
+	{
+		int i ;
+		batch = new struct _alignmentBatch ;
+		for ( i = 0 ; i < ALIGNMENT_BATCH_SIZE ; ++i )
+			batch->records[i] = bam_init1() ;
+		batch->segmentPoolSize = 4 * ALIGNMENT_BATCH_SIZE + MAX_SEG_COUNT ;
+		batch->segmentPool = new struct _pair[ batch->segmentPoolSize ] ;
+		ResetBatch() ;
+	}
+
+	void ResetBatch()
+	{
+		if ( batch == NULL )
+			return ;
+		batch->cnt = 0 ;
+		batch->cur = 0 ;
+		batch->pendingPrimaryCnt = 0 ;
+		batch->fileEnd = false ;
+	}
+	
+	// Go through the auxiliary fields once to get the ones we use for every read.
+	void ParseAuxFields( bam1_t *r, int k )
+	{
+		uint8_t *s = bam1_aux( r ) ;
+		uint8_t *end = r->data + r->data_len ;
+		batch->nh[k] = 1 ;
+		batch->nm[k] = -1 ;
+		batch->xs[k] = 0 ;
+		batch->cacheBits[k] = 0 ;
+		while ( s < end )
+		{
+			int tag = (int)s[0] << 8 | s[1] ;
+			s += 2 ;
+			if ( tag == ( 'N' << 8 | 'H' ) )
+				batch->nh[k] = bam_aux2i( s ) ;
+			else if ( tag == ( 'N' << 8 | 'M' ) )
+				batch->nm[k] = bam_aux2i( s ) ;
+			else if ( tag == ( 'X' << 8 | 'S' ) )
+				batch->xs[k] = bam_aux2A( s ) ;
+			else if ( tag == ( 'S' << 8 | 'A' ) && *s == 'Z' )
+				batch->cacheBits[k] |= SEGMENT_CACHE_HAS_SA ;
+			else if ( tag == ( 'X' << 8 | 'Z' ) && *s == 'Z' )
+				batch->cacheBits[k] |= SEGMENT_CACHE_HAS_XZ ;
+
+			// Skip the value.
+			int type = toupper( *s ) ;
+			++s ;
+			if ( type == 'Z' || type == 'H' )
+			{
+				while ( *s )
+					++s ;
+				++s ;
+			}
+			else if ( type == 'B' )
+				s += 5 + bam_aux_type2size( *s ) * ( *(int32_t *)( s + 1 ) ) ;
+			else
+				s += bam_aux_type2size( type ) ;
+		}
+	}
+
+	// Read the records into the batch and decode the ones that pass the filters.
+	// @return: the number of records in the batch.
+	int FillBatch()
+	{
+		int i, k ;
+		int used = 0 ;
+		k = 0 ;
+		while ( k < ALIGNMENT_BATCH_SIZE && used + MAX_SEG_COUNT <= batch->segmentPoolSize && !batch->fileEnd )
+		{
+			bam1_t *r = batch->records[k] ;
+			if ( ( iter ? bam_iter_read( fpSam->x.bam, iter, r ) : samread( fpSam, r ) ) <= 0 )
+			{
+				batch->fileEnd = true ;
+				break ;
+			}
+
+			if ( ( r->core.flag & 0x900 ) == 0 )
+				++batch->pendingPrimaryCnt ;
+
+			if ( r->core.flag & 0xC )
+				continue ;
+
+			uint32_t *rawCigar = bam1_cigar( r ) ; 
+			// Check whether the query length is compatible with the read
+			if ( bam_cigar2qlen( &r->core, rawCigar ) != r->core.l_qseq ) 
+				continue ;
+			
+			ParseAuxFields( r, k ) ;
+			// to many repeat.
+			if ( batch->nh[k] >= 5 )
+				continue ;
+
+			// Compute the exons segments from the reads
+			struct _pair *segs = batch->segmentPool + used ;
+			int cnt = 0 ;
+			int64_t start = r->core.pos ; //+ 1 ;
+			int len = 0 ;
+			int sum = 0 ;
+			bool clipMiddle = false ;
+			int clipSum = 0 ;
+			char clip = 0 ;
+			for ( i = 0 ; i < (int)r->core.n_cigar ; ++i )
+			{
+				int op = rawCigar[i] & BAM_CIGAR_MASK ;
+				int num = rawCigar[i] >> BAM_CIGAR_SHIFT ;
+
+				switch ( op )
+				{
+					case BAM_CMATCH:
+					case BAM_CDEL:
+						len += num ; break ;
+					case BAM_CSOFT_CLIP:
+					case BAM_CHARD_CLIP:
+					case BAM_CPAD:
+					{
+						if ( i == 0 )
+							clip |= 1 ;
+						else if ( i == (int)r->core.n_cigar - 1 )
+							clip |= 2 ;
+						else 
+							clipMiddle = true ;
+					
+						clipSum += num ;
+					}
+					case BAM_CINS:
+						num = 0 ; break ;
+					case BAM_CREF_SKIP:
+						{
+							segs[ cnt ].a = start ;
+							segs[ cnt ].b = start + len - 1 ;
+							++cnt ;
+							sum += len ;
+							start = start + len + num ;
+							len = 0 ;
+						} break ;
+					default:
+						len += num ; break ;
+				}
+			}
+			if ( clipMiddle ) // should never happend
+				continue ;
+			if ( clipSum >= 2 )
+				clip |= 4 ;
+
+			if ( clipSum >= 2 && !allowClip )
+				continue ;
+
+			if ( len > 0 )
+			{
+				segs[ cnt ].a = start ;
+				segs[ cnt ].b = start + len - 1 ;
+				++cnt ;
+				sum += len ;
+			}
+			
+			// Check whether the mates are compatible
+			int64_t mPos = r->core.mpos ;
+			if ( r->core.mtid == r->core.tid )
+			{
+				for ( i = 0 ; i < cnt - 1 ; ++i )
+				{
+					if ( mPos >= segs[i].b && mPos <= segs[i + 1].a )
+						break ;
+				}
+				if ( i < cnt - 1 )
+					continue ;
+			}
+
+			batch->segOffset[k] = used ;
+			batch->segCnt[k] = cnt ;
+			batch->segmentsSum[k] = sum ;
+			batch->clip[k] = clip ;
+			batch->flag[k] = r->core.flag ;
+			batch->tid[k] = r->core.tid ;
+			batch->qlen[k] = r->core.l_qseq ;
+			batch->mtid[k] = r->core.mtid ;
+			batch->mpos[k] = r->core.mpos ;
+			batch->primaryCnt[k] = batch->pendingPrimaryCnt ;
+			batch->pendingPrimaryCnt = 0 ;
+			used += cnt ;
+			++k ;
+		}
+		batch->cnt = k ;
+		batch->cur = 0 ;
+		return k ;
+	}
+
+	// Copy the next size bytes of the segment cache to dest; the stdio calls per record are too slow.
+	bool ReadCache( void *dest, int size )
+	{
+		if ( cacheBufferPos + size > cacheBufferLen )
+		{
+			if ( cacheBuffer == NULL ) // allocated at the first read like the batch.
+				cacheBuffer = new char[ SEGMENT_CACHE_BUFFER_SIZE ] ;
+			int left = cacheBufferLen - cacheBufferPos ;
+			memmove( cacheBuffer, cacheBuffer + cacheBufferPos, left ) ;
+			cacheBufferLen = left + fread( cacheBuffer + left, 1, SEGMENT_CACHE_BUFFER_SIZE - left, fpCache ) ;
+			cacheBufferPos = 0 ;
+			if ( size > cacheBufferLen )
+				return false ;
+		}
+		memcpy( dest, cacheBuffer + cacheBufferPos, size ) ;
+		cacheBufferPos += size ;
+		return true ;
+	}
+
+	// The counterpart of FillBatch() for the segment cache, whose records already passed the filters.
+	int FillBatchFromCache()
+	{
+		int i, k ;
+		int used = 0 ;
+		int coord[ 2 * MAX_SEG_COUNT ] ;
+		struct _segmentCacheRecord r ;
+		k = 0 ;
+		while ( k < ALIGNMENT_BATCH_SIZE && used + MAX_SEG_COUNT <= batch->segmentPoolSize && !batch->fileEnd )
+		{
+			if ( !ReadCache( &r, sizeof( r ) ) 
+				|| ( r.chrId >= 0 && !ReadCache( coord, sizeof( int ) * 2 * r.segCnt ) ) )
+			{
+				fprintf( stderr, "The segment cache %s is truncated.\n", fileName ) ;
+				exit( 1 ) ;
+			}
+			batch->pendingPrimaryCnt += r.primaryCnt ;
+			if ( r.chrId < 0 
+				|| ( regionChrId != -1 && ( r.chrId != regionChrId || coord[0] > regionEnd ) ) )
+			{
+				batch->fileEnd = true ;
+				break ;
+			}
+			if ( regionChrId != -1 && coord[ 2 * r.segCnt - 1 ] < regionStart )
+				continue ;
+			if ( ( r.bits & SEGMENT_CACHE_CLIP_MORE ) && !allowClip )
+				continue ;
+
+			struct _pair *segs = batch->segmentPool + used ;
+			int sum = 0 ;
+			for ( i = 0 ; i < r.segCnt ; ++i )
+			{
+				segs[i].a = coord[2 * i] ;
+				segs[i].b = coord[2 * i + 1] ;
+				sum += coord[2 * i + 1] - coord[2 * i] + 1 ;
+			}
+
+			batch->segOffset[k] = used ;
+			batch->segCnt[k] = r.segCnt ;
+			batch->segmentsSum[k] = sum ;
+			batch->clip[k] = r.bits & SEGMENT_CACHE_CLIP_BITS ;
+			batch->flag[k] = r.flag ;
+			batch->tid[k] = r.chrId ;
+			batch->qlen[k] = r.qlen ;
+			batch->mtid[k] = r.mtid ;
+			batch->mpos[k] = r.mpos ;
+			batch->nh[k] = r.nh ;
+			batch->nm[k] = r.nm ;
+			batch->xs[k] = r.xs ;
+			batch->cacheBits[k] = r.bits ;
+			batch->mateKey[k] = r.mateKey ;
+			batch->mateSuffix[k][0] = r.mateSuffix[0] ;
+			batch->mateSuffix[k][1] = r.mateSuffix[1] ;
+			batch->mateSuffix[k][2] = '\0' ;
+			batch->primaryCnt[k] = batch->pendingPrimaryCnt ;
+			batch->pendingPrimaryCnt = 0 ;
+			used += r.segCnt ;
+			++k ;
+		}
+		batch->cnt = k ;
+		batch->cur = 0 ;
+		return k ;
+	}
+
+	// FNV-1a hash of the read id without the mate suffix, which goes to suffix.
+	static uint64_t MateKey( const char *id, char suffix[2] )
+	{
+		int i ;
+		int len = strlen( id ) ;
+		uint64_t h = 14695981039346656037ull ;
+		suffix[0] = suffix[1] = '\0' ;
+		if ( len >= 2 && ( id[len - 1] == '1' || id[len - 1] == '2' ) 
+			&& ( id[len - 2] == '.' || id[len - 2] == '/' ) )
+		{
+			suffix[0] = id[len - 2] ;
+			suffix[1] = id[len - 1] ;
+			len -= 2 ;
+		}
+		for ( i = 0 ; i < len ; ++i )
+		{
+			h ^= (unsigned char)id[i] ;
+			h *= 1099511628211ull ;
+		}
+		return h ;
 	}
 public:
-	struct _pair segments[MAX_SEG_COUNT] ;		
+	struct _pair *segments ; // points to the batch.
 	int segCnt ;
 
 	int totalReadCnt ;
@@ -66,7 +547,18 @@ public:
 	Alignments() 
 	{ 
 		b = NULL ; 
+		batch = NULL ;
+		index = NULL ;
+		iter = NULL ;
+		regionChrId = -1 ;
+		fpSam = NULL ;
+		fpCache = NULL ;
+		header = NULL ;
+		cacheBuffer = NULL ;
+		segments = NULL ;
+		segCnt = 0 ;
 		opened = false ; 
+		numThreads = 1 ;
 		atBegin = true ;
 		atEnd = false ;
 		allowSupplementary = false ;
@@ -80,13 +572,24 @@ public:
 	}
 	~Alignments() 
 	{
-		if ( b )
-			bam_destroy1( b ) ;
+		if ( cacheBuffer )
+			delete[] cacheBuffer ;
+		if ( index )
+			bam_index_destroy( index ) ;
+		if ( batch )
+		{
+			for ( int i = 0 ; i < ALIGNMENT_BATCH_SIZE ; ++i )
+				bam_destroy1( batch->records[i] ) ;
+			delete[] batch->segmentPool ;
+			delete batch ;
+		}
 	}
 
-	void Open( char *file )
+	// threads>1 inflates the BAM file with that many read-ahead threads.
+	void Open( char *file, int threads = 1 )
 	{
 		strcpy( fileName, file ) ;
+		numThreads = threads ;
 		Open() ;
 	}
 
@@ -101,8 +604,198 @@ public:
 
 	void Close()
 	{
-		samclose( fpSam ) ;
+		if ( iter )
+			bam_iter_destroy( iter ) ;
+		iter = NULL ;
+		regionChrId = -1 ;
+		if ( fpCache )
+		{
+			fclose( fpCache ) ;
+			bam_header_destroy( header ) ;
+			fpCache = NULL ;
+		}
+		else
+			samclose( fpSam ) ;
 		fpSam = NULL ;
+		header = NULL ;
+	}
+
+	bool IsSegmentCache()
+	{
+		return fpCache != NULL ;
+	}
+
+	// Write the alignments that Next() returns from the beginning of the BAM file to the segment cache at file.
+	// Leaves the file rewound.
+	void WriteSegmentCache( const char *file )
+	{
+		int i ;
+		FILE *fp = fopen( file, "wb" ) ;
+		if ( fp == NULL )
+		{
+			fprintf( stderr, "Can not open %s.\n", file ) ;
+			exit( 1 ) ;
+		}
+
+		if ( fpCache )
+		{
+			fprintf( stderr, "%s is already a segment cache.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+
+		struct _segmentCacheHeader h ;
+		memset( &h, 0, sizeof( h ) ) ;
+		memcpy( h.magic, SEGMENT_CACHE_MAGIC, 8 ) ;
+		int readCnt = totalReadCnt ;
+		Rewind() ;
+		GetGeneralInfo( true ) ;
+		h.readLen = readLen ;
+		h.fragLen = fragLen ;
+		h.fragStdev = fragStdev ;
+		h.matePaired = matePaired ? 1 : 0 ;
+		h.sampledReadCnt = totalReadCnt - readCnt ;
+		h.targetCnt = header->n_targets ;
+		h.fileNameLen = strlen( sourceFileName ) ;
+		if ( !GetSourceStat( sourceFileName, h.sourceSize, h.sourceMtime ) )
+		{
+			fprintf( stderr, "Can not open %s.\n", sourceFileName ) ;
+			exit( 1 ) ;
+		}
+		fwrite( &h, sizeof( h ), 1, fp ) ;
+		fwrite( sourceFileName, 1, h.fileNameLen, fp ) ;
+		for ( i = 0 ; i < header->n_targets ; ++i )
+		{
+			int len[2] ;
+			len[0] = header->target_len[i] ;
+			len[1] = strlen( header->target_name[i] ) ;
+			fwrite( len, sizeof( int ), 2, fp ) ;
+			fwrite( header->target_name[i], 1, len[1], fp ) ;
+		}
+		// The target offsets are filled in after the records are written.
+		long offsetTable = ftell( fp ) ;
+		int64_t *offsets = new int64_t[ header->n_targets + 1 ] ;
+		for ( i = 0 ; i < header->n_targets ; ++i )
+			offsets[i] = -1 ;
+		fwrite( offsets, sizeof( int64_t ), header->n_targets, fp ) ;
+		int64_t written = ftell( fp ) ;
+		int prevChrId = -1 ;
+		h.sorted = 1 ;
+		
+		Rewind() ;
+		struct _segmentCacheRecord r ;
+		char *out = new char[ SEGMENT_CACHE_BUFFER_SIZE ] ;
+		int outLen = 0 ;
+		int writtenCnt = 0 ;
+		memset( &r, 0, sizeof( r ) ) ; // keep the padding bytes deterministic.
+		while ( Next() )
+		{
+			int k = batch->cur ;
+			r.chrId = batch->tid[k] ;
+			r.mtid = batch->mtid[k] ;
+			r.mpos = batch->mpos[k] ;
+			r.nm = batch->nm[k] ;
+			r.qlen = batch->qlen[k] ;
+			r.primaryCnt = batch->primaryCnt[k] ;
+			r.mateKey = MateKey( bam1_qname( b ), r.mateSuffix ) ;
+			r.flag = batch->flag[k] ;
+			r.nh = batch->nh[k] ;
+			r.segCnt = segCnt ;
+			r.xs = batch->xs[k] ;
+			r.bits = batch->clip[k] | batch->cacheBits[k] ;
+			if ( IsGCRich() )
+				r.bits |= SEGMENT_CACHE_GC_RICH ;
+			if ( outLen + sizeof( r ) + sizeof( int ) * 2 * MAX_SEG_COUNT > SEGMENT_CACHE_BUFFER_SIZE )
+			{
+				fwrite( out, 1, outLen, fp ) ;
+				written += outLen ;
+				outLen = 0 ;
+			}
+			if ( r.chrId != prevChrId )
+			{
+				if ( offsets[ r.chrId ] != -1 )
+					h.sorted = 0 ;
+				else
+					offsets[ r.chrId ] = written + outLen ;
+				prevChrId = r.chrId ;
+			}
+			memcpy( out + outLen, &r, sizeof( r ) ) ;
+			int *coord = (int *)( out + outLen + sizeof( r ) ) ;
+			for ( i = 0 ; i < segCnt ; ++i )
+			{
+				coord[2 * i] = segments[i].a ;
+				coord[2 * i + 1] = segments[i].b ;
+			}
+			outLen += sizeof( r ) + sizeof( int ) * 2 * segCnt ;
+			writtenCnt += r.primaryCnt ;
+		}
+		fwrite( out, 1, outLen, fp ) ;
+		written += outLen ;
+		delete[] out ;
+		memset( &r, 0, sizeof( r ) ) ;
+		r.chrId = -1 ;
+		r.primaryCnt = totalReadCnt - writtenCnt ;
+		fwrite( &r, sizeof( r ), 1, fp ) ;
+
+		for ( i = 0 ; i < header->n_targets ; ++i )
+			if ( offsets[i] == -1 )
+				offsets[i] = written ;
+		fseek( fp, 0, SEEK_SET ) ;
+		fwrite( &h, sizeof( h ), 1, fp ) ;
+		fseek( fp, offsetTable, SEEK_SET ) ;
+		fwrite( offsets, sizeof( int64_t ), header->n_targets, fp ) ;
+		delete[] offsets ;
+		if ( fclose( fp ) )
+		{
+			fprintf( stderr, "Failed to write %s.\n", file ) ;
+			exit( 1 ) ;
+		}
+		Rewind() ;
+	}
+
+	// Whether SeekRegion() can be used: a BAM file with an index, or a segment cache with sorted records.
+	bool CanSeekRegion()
+	{
+		if ( fpCache )
+			return cacheHeader.sorted != 0 ;
+		if ( index == NULL && ( fpSam->type & 1 ) )
+			index = bam_index_load( fileName ) ;
+		return index != NULL ;
+	}
+
+	// Restrict the following Next() calls to the alignments overlapping [start, end] of chromosome chrId,
+	// using the BAM index or the target offsets of the segment cache. The regions can be visited in any order. 
+	// Rewind() goes back to reading the whole file, and totalReadCnt is not updated in the region mode.
+	void SeekRegion( int chrId, int start, int end )
+	{
+		if ( !CanSeekRegion() )
+		{
+			fprintf( stderr, "Can not load the index of %s.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+		if ( fpCache )
+		{
+			int64_t offset ;
+			if ( fseek( fpCache, cacheOffsetTable + sizeof( int64_t ) * chrId, SEEK_SET ) 
+				|| fread( &offset, sizeof( offset ), 1, fpCache ) != 1 
+				|| fseek( fpCache, offset, SEEK_SET ) )
+			{
+				fprintf( stderr, "The segment cache %s is truncated.\n", fileName ) ;
+				exit( 1 ) ;
+			}
+			cacheBufferLen = cacheBufferPos = 0 ;
+		}
+		else
+		{
+			if ( iter )
+				bam_iter_destroy( iter ) ;
+			iter = bam_iter_query( index, chrId, start, end + 1 ) ;
+		}
+		regionChrId = chrId ;
+		regionStart = start ;
+		regionEnd = end ;
+		ResetBatch() ;
+		atBegin = true ;
+		atEnd = false ;
 	}
 
 	bool IsOpened()
@@ -136,146 +829,44 @@ public:
 
 	int Next()
 	{
-		int i ;
-		int start = 0, len = 0 ;
-		uint32_t *rawCigar ;
-
-		if ( atBegin == true )
+		if ( atBegin == true && regionChrId == -1 )
 			totalReadCnt = 0 ;
 
 		atBegin = false ;
-		while ( 1 )
-		{
-			while ( 1 )
-			{
-				if ( b )
-					bam_destroy1( b ) ;
-				b = bam_init1() ;
-
-				if ( samread( fpSam, b ) <= 0 )
-				{
-					atEnd = true ;
-					return 0 ;
-				}
+		if ( batch == NULL )
+			AllocateBatch() ;
 
-				if ( ( b->core.flag & 0x900 ) == 0 )
-					++totalReadCnt ;
-				
-				if ( b->core.flag & 0xC )
-					continue ;
-
-				//if ( ( b->core.flag & 0x900 ) == 0 )
-					break ;
-			}
-			
-			// to many repeat.
-			if ( bam_aux_get( b, "NH" ) )
-			{
-				if ( bam_aux2i( bam_aux_get( b, "NH" ) ) >= 5 )
-					continue ;
-			}
-
-			// Compute the exons segments from the reads
-			segCnt = 0 ;
-			start = b->core.pos ; //+ 1 ;
-			rawCigar = bam1_cigar( b ) ; 
-			// Check whether the query length is compatible with the read
-			if ( bam_cigar2qlen( &b->core, rawCigar ) != b->core.l_qseq ) 
-				continue ;
-
-			bool clipMiddle = false ;
-			int clipSum = 0 ;
-			hasClipHead = hasClipTail = false ;
-			len = 0 ;
-			segmentsSum = 0 ;
-			for ( i = 0 ; i < b->core.n_cigar ; ++i )
-			{
-				int op = rawCigar[i] & BAM_CIGAR_MASK ;
-				int num = rawCigar[i] >> BAM_CIGAR_SHIFT ;
-
-				switch ( op )
-				{
-					case BAM_CMATCH:
-					case BAM_CDEL:
-						len += num ; break ;
-					case BAM_CSOFT_CLIP:
-					case BAM_CHARD_CLIP:
-					case BAM_CPAD:
-					{
-						if ( i == 0 )
-							hasClipHead = true ;
-						else if ( i == b->core.n_cigar - 1 )
-							hasClipTail = true ;
-						else 
-							clipMiddle = true ;
-					
-						clipSum += num ;
-					}
-					case BAM_CINS:
-						num = 0 ; break ;
-					case BAM_CREF_SKIP:
-						{
-							segments[ segCnt ].a = start ;
-							segments[ segCnt ].b = start + len - 1 ;
-							++segCnt ;
-							segmentsSum += len ;
-							start = start + len + num ;
-							len = 0 ;
-						} break ;
-					default:
-						len += num ; break ;
-				}
-			}
-			if ( clipMiddle ) // should never happend
-				continue ;
-
-			if ( clipSum >= 2 && !allowClip )
-				continue ;
-
-			if ( len > 0 )
-			{
-				segments[ segCnt ].a = start ;
-				segments[ segCnt ].b = start + len - 1 ;
-				++segCnt ;
-				segmentsSum += len ;
-			}
-			/*if ( !strcmp( bam1_qname( b ), "chr1:109656301-109749401W:ENST00000490758.2:381:1480:1090:1290:X" ) )
-			{
-				for ( i = 0 ; i < segCnt ; ++i )
-					printf( "(%d %d) ", segments[i].a, segments[i].b ) ;
-				printf( "\n" ) ;
-			}*/
-			
-			// Check whether the mates are compatible
-			//int mChrId = b->core.mtid ;
-			int64_t mPos = b->core.mpos ;
-
-			if ( b->core.mtid == b->core.tid )
-			{
-				for ( i = 0 ; i < segCnt - 1 ; ++i )
-				{
-					if ( mPos >= segments[i].b && mPos <= segments[i + 1].a )
-						break ;
-				}
-				if ( i < segCnt - 1 )
-					continue ;
-			}
-			
-			break ;
+		++batch->cur ;
+		if ( batch->cur >= batch->cnt && ( fpCache ? FillBatchFromCache() : FillBatch() ) == 0 )
+		{
+			if ( regionChrId == -1 )
+				totalReadCnt += batch->pendingPrimaryCnt ;
+			batch->pendingPrimaryCnt = 0 ;
+			atEnd = true ;
+			return 0 ;
 		}
 
+		int k = batch->cur ;
+		b = batch->records[k] ;
+		if ( regionChrId == -1 ) // reads of overlapping regions would be counted more than once.
+			totalReadCnt += batch->primaryCnt[k] ;
+		segments = batch->segmentPool + batch->segOffset[k] ;
+		segCnt = batch->segCnt[k] ;
+		segmentsSum = batch->segmentsSum[k] ;
+		hasClipHead = ( batch->clip[k] & 1 ) != 0 ;
+		hasClipTail = ( batch->clip[k] & 2 ) != 0 ;
 		return 1 ;
 	}
 
 
 	int GetChromId()
 	{
-		return b->core.tid ; 
+		return batch->tid[ batch->cur ] ; 
 	}
 
 	char* GetChromName( int tid )
 	{
-		return fpSam->header->target_name[ tid ] ; 
+		return header->target_name[ tid ] ; 
 	}
 
 	int GetChromIdFromName( const char *s )
@@ -291,32 +882,33 @@ public:
 
 	int GetChromLength( int tid )
 	{
-		return fpSam->header->target_len[ tid ] ;
+		return header->target_len[ tid ] ;
 	}
 
 	int GetChromCount()
 	{
-		return fpSam->header->n_targets ;
+		return header->n_targets ;
 	}
 
 	void GetMatePosition( int &chrId, int64_t &pos )
 	{
-		if ( b->core.flag & 0x8 )
+		int k = batch->cur ;
+		if ( batch->flag[k] & 0x8 )
 		{
 			chrId = -1 ;
 			pos = -1 ;
 		}
 		else
 		{
-			chrId = b->core.mtid ;
-			pos = b->core.mpos ; //+ 1 ;
+			chrId = batch->mtid[k] ;
+			pos = batch->mpos[k] ; //+ 1 ;
 		}
 	}
 
 	int GetRepeatPosition( int &chrId, int64_t &pos )
 	{
 		// Look at the CC field.
-		if ( !bam_aux_get( b, "CC" ) || !bam_aux_get( b, "CP" ) )
+		if ( fpCache || !bam_aux_get( b, "CC" ) || !bam_aux_get( b, "CP" ) )
 		{
 			chrId = -1 ;
 			pos = -1 ;
@@ -331,12 +923,12 @@ public:
 
 	void GetFileName( char *buffer )
 	{
-		strcpy( buffer, fileName ) ;
+		strcpy( buffer, sourceFileName ) ;
 	}
 
 	int GetReadLength()
 	{
-		return b->core.l_qseq ;
+		return batch->qlen[ batch->cur ] ;
 	}
 
 	int GetRefCoverLength()
@@ -346,45 +938,49 @@ public:
 
 	bool IsFirstMate()
 	{
-		if ( b->core.flag & 0x40 )
+		if ( batch->flag[ batch->cur ] & 0x40 )
 			return true ;
 		return false ;
 	}
 
 	bool IsReverse()
 	{
-		if ( b->core.flag & 0x10 )	
+		if ( batch->flag[ batch->cur ] & 0x10 )	
 			return true ;
 		return false ;
 	}
 
 	bool IsMateReverse()
 	{
-		if ( b->core.flag & 0x20 )
+		if ( batch->flag[ batch->cur ] & 0x20 )
 			return true ;
 		return false ;
 	}
 
+	// For a segment cache, the id is the hash of the read id followed by its mate suffix.
 	char *GetReadId()
 	{
+		if ( fpCache )
+		{
+			int k = batch->cur ;
+			sprintf( readId, "%016llx%s", (unsigned long long)batch->mateKey[k], batch->mateSuffix[k] ) ;
+			return readId ;
+		}
 		return bam1_qname( b ) ;
 	}
 
 	bool IsUnique()
 	{
-		if ( bam_aux_get( b, "NH" ) )
-		{
-			if ( bam_aux2i( bam_aux_get( b, "NH" ) ) > 1 )
-				return false ;
-		}	
-		if ( IsSupplementary() && GetFieldZ( (char *)"XZ" ) != NULL )
+		if ( batch->nh[ batch->cur ] > 1 )
+			return false ;
+		if ( IsSupplementary() && ( batch->cacheBits[ batch->cur ] & SEGMENT_CACHE_HAS_XZ ) )
 			return false ;
 		return true ;
 	}
 
 	bool IsPrimary()
 	{
-		if ( ( b->core.flag & 0x900 ) == 0 )
+		if ( ( batch->flag[ batch->cur ] & 0x900 ) == 0 )
 			return true ;
 		else
 			return false ;
@@ -395,19 +991,21 @@ public:
 	{
 		if ( segCnt == 1 )
 			return 0 ;
-		if ( bam_aux_get( b, "XS" ) )
-		{
-			if ( bam_aux2A( bam_aux_get( b, "XS" ) ) == '-' )
-				return -1 ;	
-			else
-				return 1 ;
-		}
-		else
+		char xs = batch->xs[ batch->cur ] ;
+		if ( xs == 0 )
 			return 0 ;
+		else if ( xs == '-' )
+			return -1 ;
+		else
+			return 1 ;
 	}
 
-	int GetFieldI( char *f )
+	int GetFieldI( const char *f )
 	{
+		if ( f[0] == 'N' && f[1] == 'M' && f[2] == '\0' ) // already decoded in the batch.
+			return batch->nm[ batch->cur ] ;
+		if ( fpCache )
+			return -1 ;
 		if ( bam_aux_get( b, f ) )
 		{
 			return bam_aux2i( bam_aux_get( b, f ) ) ;
@@ -415,8 +1013,15 @@ public:
 		return -1 ;
 	}
 
-	char *GetFieldZ( char *f )
+	// A segment cache only knows whether there is an SA field, and returns an empty string for it.
+	char *GetFieldZ( const char *f )
 	{
+		if ( fpCache )
+		{
+			if ( !strcmp( f, "SA" ) && ( batch->cacheBits[ batch->cur ] & SEGMENT_CACHE_HAS_SA ) )
+				return (char *)"" ;
+			return NULL ;
+		}
 		if ( bam_aux_get( b, f ) )
 		{
 			return bam_aux2Z( bam_aux_get( b, f ) ) ;
@@ -426,16 +1031,12 @@ public:
 	
 	int GetNumberOfHits()
 	{
-		if ( bam_aux_get( b, "NH" ) )
-		{
-			return bam_aux2i( bam_aux_get( b, "NH" ) ) ;
-		}	
-		return 1 ;
+		return batch->nh[ batch->cur ] ;
 	}
 	
 	bool IsSupplementary()
 	{
-		if ( ( b->core.flag & 0x800 ) == 0 )
+		if ( ( batch->flag[ batch->cur ] & 0x800 ) == 0 )
 			return false ;
 		else
 			return true ;
@@ -454,21 +1055,41 @@ public:
 	bool IsGCRich( bool threshold = 0.9 )
 	{
 		int i = 0 ;
-		int gcCnt = 0 ;
+		int otherCnt = 0 ;
+		if ( fpCache )
+			return ( batch->cacheBits[ batch->cur ] & SEGMENT_CACHE_GC_RICH ) != 0 ;
+		double need = threshold * b->core.l_qseq ;
+		uint8_t *seq = bam1_seq( b ) ;
 		for ( i = 0 ; i < b->core.l_qseq ; ++i )
 		{
-			int bit = bam1_seqi( bam1_seq( b ), i ) ;
-			if ( bit == 2 || bit == 4 )
-				++gcCnt ;		
+			int bit = bam1_seqi( seq, i ) ;
+			if ( bit != 2 && bit != 4 )
+			{
+				++otherCnt ;
+				if ( b->core.l_qseq - otherCnt < need ) // can not reach the threshold any more.
+					return false ;
+			}
 		}
-		if ( gcCnt >= threshold * b->core.l_qseq )
+		if ( b->core.l_qseq - otherCnt >= need )
 			return true ;
+		return false ;
 	}
 
+	// A segment cache returns the information sampled by GetGeneralInfo( true ) when the cache was written.
 	void GetGeneralInfo( bool stopEarly = false )
 	{
 		int i, k ;
 
+		if ( fpCache )
+		{
+			readLen = cacheHeader.readLen ;
+			fragLen = cacheHeader.fragLen ;
+			fragStdev = cacheHeader.fragStdev ;
+			matePaired = cacheHeader.matePaired != 0 ;
+			totalReadCnt += cacheHeader.sampledReadCnt ;
+			return ;
+		}
+
 		const int sampleMax = 1000000 ;
 		int *lens = new int[sampleMax] ;
 		int *mateDiff = new int[sampleMax] ;
@@ -476,14 +1097,15 @@ public:
 		int mateDiffCnt = 0 ;
 		bool end = false ;
 		
+		// Reuse the batch buffer, any decoded batch becomes invalid.
+		if ( batch == NULL )
+			AllocateBatch() ;
+		ResetBatch() ;
+		b = batch->records[0] ;
 		while ( 1 )
 		{
 			while ( 1 )
 			{
-				if ( b )
-					bam_destroy1( b ) ;
-				b = bam_init1() ;
-
 				if ( samread( fpSam, b ) <= 0 )
 				{
 					end = true ;
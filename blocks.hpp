@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <math.h>
 #include <set>
+#include <algorithm>
 #include <inttypes.h>
 
 #include "defs.h"
@@ -59,6 +60,13 @@ struct _block
 	int *next ;
 } ;
 
+// The longest alignment stretch from a candidate splice site, filled while streaming the alignments.
+struct _spliceStretch
+{
+	int64_t key ; // chrId and position
+	int64_t value ;
+} ;
+
 // adjacent graph
 struct _adj
 {
@@ -141,11 +149,8 @@ class Blocks
 			int i, j ;
 			if ( exonBlocks[tag].depth != NULL )
 			{	
-				// Convert the increment and decrement into actual depth.
 				int len = exonBlocks[tag].end - exonBlocks[tag].start + 1 ;
 				int *depth = exonBlocks[tag].depth ;
-				for ( i = 1 ; i < len ; ++i )
-					depth[i] = depth[i - 1] + depth[i] ;
 
 				struct _block island ; // the portion created by the hollow.
 				island.start = island.end = -1 ;
@@ -326,6 +331,136 @@ class Blocks
 					newExonBlocks.push_back( island ) ;
 			}
 		}
+
+		// The per-base coverage of the raw blocks is collected while BuildExonBlocks streams the alignments, 
+		// so ComputeDepth does not need to go through the alignments again.
+		std::vector<struct _pair> pendingSegments ; // segments that may still overlap unfinished raw blocks.
+		int pendingChrId ;
+		int pendingLimit ;
+		int coverageTag ; // the first raw block whose coverage is not allocated yet.
+		std::vector<struct _block> rawExonBlocks ; // the blocks before SplitBlocks, holding the coverage.
+		std::vector<struct _spliceStretch> leftStretch, rightStretch ; 
+
+		int64_t StretchKey( int chrId, int64_t pos )
+		{
+			return ( (int64_t)chrId << 32 ) | pos ;
+		}
+
+		void InitStretch( std::vector<struct _splitSite> &sites, int type, std::vector<struct _spliceStretch> &stretch )
+		{
+			int i, k ;
+			int size = sites.size() ;
+			stretch.clear() ;
+			for ( i = 0 ; i < size ; ++i )
+			{
+				if ( sites[i].type != type || sites[i].chrId < 0 )
+					continue ;
+				struct _spliceStretch ns ;
+				ns.key = StretchKey( sites[i].chrId, sites[i].pos ) ;
+				ns.value = -1 ;
+				stretch.push_back( ns ) ;
+			}
+			std::sort( stretch.begin(), stretch.end(), CompSpliceStretch ) ;
+			size = stretch.size() ;
+			k = 0 ;
+			for ( i = 0 ; i < size ; ++i )
+			{
+				if ( k > 0 && stretch[i].key == stretch[k - 1].key )
+					continue ;
+				stretch[k] = stretch[i] ;
+				++k ;
+			}
+			stretch.resize( k ) ;
+		}
+
+		int SearchStretch( std::vector<struct _spliceStretch> &stretch, int chrId, int64_t pos )
+		{
+			int64_t key = StretchKey( chrId, pos ) ;
+			int l = 0, r = (int)stretch.size() - 1 ;
+			while ( l <= r )
+			{
+				int m = ( l + r ) / 2 ;
+				if ( stretch[m].key == key )
+					return m ;
+				else if ( stretch[m].key < key )
+					l = m + 1 ;
+				else
+					r = m - 1 ;
+			}
+			return -1 ;
+		}
+
+		static bool CompSpliceStretch( const struct _spliceStretch &a, const struct _spliceStretch &b )
+		{
+			return a.key < b.key ;
+		}
+
+		// Add the pending segments to the raw blocks that can not change anymore, 
+		// which are the ones ending before readStart - 1. readStart==-1 means the chromosome is finished.
+		void FinishCoverage( int64_t readStart )
+		{
+			int i, j, k ;
+			int blockCnt = exonBlocks.size() ;
+			int from = coverageTag ;
+			int to ;
+			for ( to = from ; to < blockCnt ; ++to )
+				if ( readStart != -1 && exonBlocks[to].end >= readStart - 1 )
+					break ;
+
+			for ( j = from ; j < to ; ++j )
+			{
+				int len = exonBlocks[j].end - exonBlocks[j].start + 1 ;
+				exonBlocks[j].depth = new int[len + 1] ;
+				memset( exonBlocks[j].depth, 0, sizeof( int ) * ( len + 1 ) ) ;
+			}
+
+			// Segments ending before keepFrom can not reach the unfinished blocks or the future ones.
+			int64_t keepFrom = readStart ;
+			if ( to < blockCnt && exonBlocks[to].start < keepFrom )
+				keepFrom = exonBlocks[to].start ;
+			int size = pendingSegments.size() ;
+			k = 0 ;
+			for ( i = 0 ; i < size ; ++i )
+			{
+				struct _pair seg = pendingSegments[i] ;
+				int l = from, r = to ;
+				while ( l < r )
+				{
+					int m = ( l + r ) / 2 ;
+					if ( exonBlocks[m].end < seg.a )
+						l = m + 1 ;
+					else
+						r = m ;
+				}
+				for ( j = l ; j < to && exonBlocks[j].start <= seg.b ; ++j )
+				{
+					int64_t s, e ;
+					if ( Overlap( seg.a, seg.b, exonBlocks[j].start, exonBlocks[j].end, s, e ) == 0 )
+						continue ;
+					int *depth = exonBlocks[j].depth ;
+					++depth[s - exonBlocks[j].start] ;
+					--depth[e - exonBlocks[j].start + 1] ; 
+				}
+				if ( readStart != -1 && seg.b >= keepFrom )
+				{
+					pendingSegments[k] = seg ;
+					++k ;
+				}
+			}
+			pendingSegments.resize( k ) ;
+			pendingLimit = 2 * k > ( 1 << 16 ) ? 2 * k : ( 1 << 16 ) ;
+
+			// Convert the increment and decrement into actual depth.
+			for ( j = from ; j < to ; ++j )
+			{
+				int len = exonBlocks[j].end - exonBlocks[j].start + 1 ;
+				int *depth = exonBlocks[j].depth ;
+				for ( i = 1 ; i < len ; ++i )
+					depth[i] = depth[i - 1] + depth[i] ;
+			}
+			coverageTag = to ;
+		}
+
 	public:
 		std::vector<struct _block> exonBlocks ;
 
@@ -351,15 +486,31 @@ class Blocks
 			return block.depthSum / (double)( block.end - block.start + 1 ) ;
 		}
 
-		int BuildExonBlocks( Alignments &alignments )
+		// Also collects the coverage of the blocks, and the longest alignment stretches from the splice sites.
+		int BuildExonBlocks( Alignments &alignments, std::vector<struct _splitSite> &splitSites )
 		{
 			int tag = 0 ;
+			InitStretch( splitSites, 1, leftStretch ) ;
+			InitStretch( splitSites, 2, rightStretch ) ;
+			pendingSegments.clear() ;
+			pendingChrId = -1 ;
+			pendingLimit = 1 << 16 ;
+			coverageTag = 0 ;
 			while ( alignments.Next() )
 			{
 				int i, j, k ;
 				int segCnt = alignments.segCnt ;
 				struct _pair *segments = alignments.segments ;
 				int eid = 0 ; // the exonblock id that the segment update
+				int chrId = alignments.GetChromId() ;
+
+				if ( chrId != pendingChrId )
+				{
+					FinishCoverage( -1 ) ;
+					pendingChrId = chrId ;
+				}
+				else if ( (int)pendingSegments.size() >= pendingLimit )
+					FinishCoverage( segments[0].a ) ;
 				
 				// locate the first exonblock that beyond the start of the read.
 				while ( tag < (int)exonBlocks.size() && ( exonBlocks[tag].end < segments[0].a - 1 
@@ -549,7 +700,19 @@ class Blocks
 						exonBlocks.pop_back() ;
 					}*/
 				}
+
+				for ( i = 0 ; i < segCnt ; ++i )
+				{
+					pendingSegments.push_back( segments[i] ) ;
+					k = SearchStretch( leftStretch, chrId, segments[i].a ) ;
+					if ( k != -1 && segments[i].b > leftStretch[k].value )
+						leftStretch[k].value = segments[i].b ;
+					k = SearchStretch( rightStretch, chrId, segments[i].b ) ;
+					if ( k != -1 && ( rightStretch[k].value == -1 || segments[i].a < rightStretch[k].value ) )
+						rightStretch[k].value = segments[i].a ;
+				}
 			}
+			FinishCoverage( -1 ) ;
 			/*for ( int i = 0 ; i < (int)exonBlocks.size() ; ++i )
 			  {
 			  printf( "%d %d\n", exonBlocks[i].start, exonBlocks[i].end ) ;
@@ -565,9 +728,9 @@ class Blocks
 					
 					exonBlocks[i].leftType = 0 ;
 					exonBlocks[i].rightType = 0 ;
-					exonBlocks[i].depth = NULL ;
 					exonBlocks[i].nextCnt = 0 ;
 					exonBlocks[i].prevCnt = 0 ;
+					exonBlocks[i].next = exonBlocks[i].prev = NULL ;
 					exonBlocks[i].leftStrand = '.' ;
 					exonBlocks[i].rightStrand = '.' ;
 				}
@@ -575,6 +738,25 @@ class Blocks
 			return exonBlocks.size() ;
 		}
 
+		// Move the blocks that BuildExonBlocks built on each chromosome separately to the end of this object.
+		// chrBlocks[i] should hold the chromosomes after the ones in chrBlocks[i - 1].
+		int AppendExonBlocks( Blocks *chrBlocks, int cnt )
+		{
+			int i ;
+			for ( i = 0 ; i < cnt ; ++i )
+			{
+				exonBlocks.insert( exonBlocks.end(), chrBlocks[i].exonBlocks.begin(), chrBlocks[i].exonBlocks.end() ) ;
+				leftStretch.insert( leftStretch.end(), chrBlocks[i].leftStretch.begin(), chrBlocks[i].leftStretch.end() ) ;
+				rightStretch.insert( rightStretch.end(), chrBlocks[i].rightStretch.begin(), chrBlocks[i].rightStretch.end() ) ;
+				chrBlocks[i].exonBlocks.clear() ;
+				chrBlocks[i].leftStretch.clear() ;
+				chrBlocks[i].rightStretch.clear() ;
+			}
+			if ( exonBlocks.size() > 0 )
+				BuildBlockChrIdOffset() ;
+			return exonBlocks.size() ;
+		}
+
 		void FilterSplitSitesInRegions( std::vector<struct _splitSite> &sites )
 		{
 			int i, j, k ;
@@ -965,7 +1147,7 @@ class Blocks
 
 		void SplitBlocks( Alignments &alignments, std::vector< struct _splitSite > &splitSites )	
 		{
-			std::vector<struct _block> rawExonBlocks = exonBlocks ;
+			rawExonBlocks = exonBlocks ;
 			int i, j ;
 			int tag = 0 ;
 			int bsize = rawExonBlocks.size() ; 
@@ -1056,64 +1238,64 @@ class Blocks
 			BuildBlockChrIdOffset() ;
 		}
 
-		void ComputeDepth( Alignments &alignments ) 
+		void ComputeDepth() 
 		{
-			// Go through the alignment list again to fill in the depthSum;
+			// Fill in the depth and depthSum from the coverage of the raw blocks.
 			int i ;
 			int j ;
 			int tag = 0 ;
 			int blockCnt = exonBlocks.size() ;
+			int rawCnt = rawExonBlocks.size() ;
 
 			std::vector<struct _block> newExonBlocks ;
-			while ( alignments.Next() )
+			for ( i = 0 ; i < blockCnt ; ++i )
 			{
-				int segCnt = alignments.segCnt ;
-				struct _pair *segments = alignments.segments ;
-
-				while ( tag < blockCnt && ( exonBlocks[tag].chrId < alignments.GetChromId() || 
-							( exonBlocks[tag].chrId == alignments.GetChromId() && exonBlocks[tag].end < segments[0].a ) ) )
+				while ( tag < rawCnt && ( rawExonBlocks[tag].chrId != exonBlocks[i].chrId || 
+							rawExonBlocks[tag].end < exonBlocks[i].start ) )
 				{
-					AdjustAndCreateExonBlocks( tag, newExonBlocks ) ;
+					delete[] rawExonBlocks[tag].depth ;
+					rawExonBlocks[tag].depth = NULL ;
 					++tag ;
 				}
-				for ( i = 0 ; i < segCnt ; ++i )
-				{
-					for ( j = tag ; j < blockCnt && ( exonBlocks[j].chrId == alignments.GetChromId() && exonBlocks[j].start <= segments[i].b ) ; ++j )
-					{
-						int64_t s = -1, e = -1 ;
-						exonBlocks[j].depthSum += Overlap( segments[i].a, segments[i].b, exonBlocks[j].start, exonBlocks[j].end, s, e ) ; 
-						if ( s == -1 )
-							continue ;
 
-						if ( exonBlocks[j].depth == NULL )
-						{
-							int len = exonBlocks[j].end - exonBlocks[j].start + 1 ;
-							exonBlocks[j].depth = new int[len + 1] ;
-							memset( exonBlocks[j].depth, 0, sizeof( int ) * ( len + 1 ) ) ;
-							exonBlocks[j].leftSplice = exonBlocks[j].start ;
-							exonBlocks[j].rightSplice = exonBlocks[j].end ;
-						}
-						int *depth = exonBlocks[j].depth ;
-						++depth[s - exonBlocks[j].start] ;
-						--depth[e - exonBlocks[j].start + 1] ; // notice the +1 here, since the decrease of coverage actually happens at next base.
+				int len = exonBlocks[i].end - exonBlocks[i].start + 1 ;
+				int *coverage = rawExonBlocks[tag].depth + ( exonBlocks[i].start - rawExonBlocks[tag].start ) ;
+				int64_t depthSum = 0 ;
+				for ( j = 0 ; j < len ; ++j )
+					depthSum += coverage[j] ;
+				exonBlocks[i].depthSum = depthSum ;
 
-						// record the longest alignment stretch support the splice site.
-						if ( exonBlocks[j].leftType == 1 && segments[i].a == exonBlocks[j].start 
-							&& e > exonBlocks[j].leftSplice )
-						{
-							exonBlocks[j].leftSplice = e ;	
-						}
-						if ( exonBlocks[j].rightType == 2 && segments[i].b == exonBlocks[j].end 
-							&& s < exonBlocks[j].rightSplice )
-						{
-							exonBlocks[j].rightSplice = s ;	
-						}
+				if ( depthSum > 0 )
+				{
+					exonBlocks[i].depth = new int[len] ;
+					memcpy( exonBlocks[i].depth, coverage, sizeof( int ) * len ) ;
+					exonBlocks[i].leftSplice = exonBlocks[i].start ;
+					exonBlocks[i].rightSplice = exonBlocks[i].end ;
+
+					// record the longest alignment stretch support the splice site.
+					int k ;
+					if ( exonBlocks[i].leftType == 1 
+						&& ( k = SearchStretch( leftStretch, exonBlocks[i].chrId, exonBlocks[i].start ) ) != -1 
+						&& leftStretch[k].value != -1 )
+					{
+						int64_t e = leftStretch[k].value < exonBlocks[i].end ? leftStretch[k].value : exonBlocks[i].end ;
+						if ( e > exonBlocks[i].leftSplice )
+							exonBlocks[i].leftSplice = e ;
+					}
+					if ( exonBlocks[i].rightType == 2 
+						&& ( k = SearchStretch( rightStretch, exonBlocks[i].chrId, exonBlocks[i].end ) ) != -1 
+						&& rightStretch[k].value != -1 )
+					{
+						int64_t s = rightStretch[k].value > exonBlocks[i].start ? rightStretch[k].value : exonBlocks[i].start ;
+						if ( s < exonBlocks[i].rightSplice )
+							exonBlocks[i].rightSplice = s ;
 					}
 				}
+				AdjustAndCreateExonBlocks( i, newExonBlocks ) ;
 			}
-
-			for ( ; tag < blockCnt ; ++tag )
-				AdjustAndCreateExonBlocks( tag, newExonBlocks ) ;
+			for ( ; tag < rawCnt ; ++tag )
+				delete[] rawExonBlocks[tag].depth ;
+			rawExonBlocks.clear() ;
 			exonBlocks.clear() ;
 
 			// Due to multi-alignment, we may skip some alignments that determines leftSplice and
@@ -22,6 +22,7 @@ char usage[] = "./classes [OPTIONS]:\n"
 	"\t-f FLOAT: filter the transcript from the gene if its abundance is lower than the given number percent of the most abundant one. (default: 0.05)\n"
 	"\t-d FLOAT: filter the transcript whose average read depth is less than the given number. (default: 2.5)\n"
 	"\t--ls STRING: path to the file of the list of single-sample subexon files. (default: not used)\n"
+	"\t--depthMatrix STRING: path to the depth matrix from combine-subexons, used instead of --ls. (default: not used)\n"
 	"\t--hasMateIdSuffix: the read id has suffix such as .1, .2 for a mate pair. (default: false)\n"
 	"\t--maxDpConstraintSize: the maximum number of subexons a constraint can cover in dynamic programming. (default: 7; -1 for inf)\n"
 	"\t--primaryParalog: use primary alignment to retain paralog genes instead of unique alignments. (default: not used)\n"
@@ -35,6 +36,7 @@ static struct option long_options[] =
 		{ "hasMateIdSuffix", no_argument, 0, 10002 },
 		{ "primaryParalog", no_argument, 0, 10003 },
 		{ "maxDpConstraintSize", required_argument, 0, 10004 },
+		{ "depthMatrix", required_argument, 0, 10005 },
 		{ (char *)0, 0, 0, 0} 
 	} ;
 
@@ -45,17 +47,6 @@ struct _getAlignmentsInfoThreadArg
 	int tid ;
 } ;
 
-struct _getConstraintsThreadArg
-{
-	std::vector<Constraints> *pMultiSampleConstraints ;	
-	int numThreads ;
-	int tid ;
-
-	struct _subexon *subexons ;
-	int seCnt ;
-	int start, end ;
-} ;
-
 void *GetAlignmentsInfo_Thread( void *pArg )
 {
 	int i ;
@@ -76,22 +67,6 @@ void *GetAlignmentsInfo_Thread( void *pArg )
 }
 
 
-void *GetConstraints_Thread( void *pArg )
-{
-	int i ;
-	struct _getConstraintsThreadArg &arg = *( (struct _getConstraintsThreadArg *)pArg ) ;
-	std::vector<Constraints> &multiSampleConstraints = *( arg.pMultiSampleConstraints ) ;
-	int tid = arg.tid ;
-	int numThreads = arg.numThreads ;
-	int size = multiSampleConstraints.size() ;
-	for ( i = 0 ; i < size ; ++i )
-	{
-		if ( i % numThreads == tid )
-			multiSampleConstraints[i].BuildConstraints( arg.subexons, arg.seCnt, arg.start, arg.end ) ;
-	}
-	pthread_exit( NULL ) ;
-}
-
 int main( int argc, char *argv[] )
 {
 	int i, j ;
@@ -191,6 +166,10 @@ int main( int argc, char *argv[] )
 		{
 			maxDpConstraintSize = atoi(optarg) ;
 		}
+		else if ( c == 10005 ) // the depth matrix of the samples.
+		{
+			subexonCorrelation.InitializeDepthMatrix( optarg ) ;
+		}
 		else
 		{
 			printf( "%s", usage ) ;
@@ -302,27 +281,17 @@ int main( int argc, char *argv[] )
 	{
 		--numThreads ; // one thread is used for read in the data.
 		
-		// Allocate memory
+		// The worker threads live through the whole run. A gene waits in the queue until a worker
+		// takes it, so a few genes are read ahead and the most expensive one can start first.
+		GeneWorkQueue workQueue( 2 * numThreads, alignmentFiles ) ;
 		struct _transcriptDeciderThreadArg *pArgs = new struct _transcriptDeciderThreadArg[ numThreads ] ;
-		pthread_mutex_t ftLock ;
-		int *freeThreads ;
-		int ftCnt ;
-		pthread_cond_t fullWorkCond ;
 		pthread_attr_t pthreadAttr ;
 		pthread_t *threads ;
-		pthread_t *getConstraintsThreads ;
-		bool *initThreads ;
 
-		pthread_mutex_init( &ftLock, NULL ) ;
-		pthread_cond_init( &fullWorkCond, NULL ) ;
 		pthread_attr_init( &pthreadAttr ) ;
 		pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
 
 		threads = new pthread_t[ numThreads ] ;
-		getConstraintsThreads = new pthread_t[ numThreads ] ;
-		initThreads = new bool[numThreads] ;
-		freeThreads = new int[ numThreads ] ;
-		ftCnt = numThreads ;
 		for ( i = 0 ; i < numThreads ; ++i )
 		{
 			pArgs[i].tid = i ;
@@ -333,130 +302,53 @@ int main( int argc, char *argv[] )
 			pArgs[i].classifierThreshold = classifierThreshold ;
 			pArgs[i].txptMinReadDepth = txptMinReadDepth ;
 			pArgs[i].alignments = &alignmentFiles[0] ;
-			//pArgs[i].constraints = new std::vector<Constraints> ;
 			pArgs[i].outputHandler = &outputHandler ;
-
-			freeThreads[i] = i ;
-			pArgs[i].freeThreads = freeThreads ;
-			pArgs[i].ftCnt = &ftCnt ;
-			pArgs[i].ftLock = &ftLock ;
-			pArgs[i].fullWorkCond = &fullWorkCond ;
-			
-			for ( j = 0 ; j < sampleCnt ; ++j )
-			{
-				Constraints constraints( &alignmentFiles[j] ) ;
-				pArgs[i].constraints.push_back( constraints ) ;
-			}
-
-			initThreads[i] = false ;
+			pArgs[i].workQueue = &workQueue ;
+			pthread_create( &threads[i], &pthreadAttr, TranscriptDeciderSolve_Wrapper, &pArgs[i] ) ;
 		}
 
-
 		// Read in and distribute the work
 		int giCnt = subexonGraph.geneIntervals.size() ;
 		for ( i = 0 ; i < giCnt ; ++i )
 		{
 			struct _geneInterval gi = subexonGraph.geneIntervals[i] ;
-			struct _subexon *intervalSubexons = new struct _subexon[ gi.endIdx - gi.startIdx + 1 ] ;
+			int seCnt = gi.endIdx - gi.startIdx + 1 ;
+			struct _subexon *intervalSubexons = new struct _subexon[ seCnt ] ;
 			subexonGraph.ExtractSubexons( gi.startIdx, gi.endIdx, intervalSubexons ) ;
-			subexonCorrelation.ComputeCorrelation( intervalSubexons, gi.endIdx - gi.startIdx + 1, alignmentFiles[0] ) ;
-			printf( "%d: %d %s %d %d. Free threads: %d/%d\n", i, gi.endIdx - gi.startIdx + 1, 
+			subexonCorrelation.ComputeCorrelation( intervalSubexons, seCnt, alignmentFiles[0] ) ;
+			printf( "%d: %d %s %d %d. Free threads: %d/%d\n", i, seCnt, 
 					alignmentFiles[0].GetChromName( intervalSubexons[0].chrId ), 
-					gi.start + 1, gi.end + 1, ftCnt, numThreads + 1 ) ;	
+					gi.start + 1, gi.end + 1, workQueue.GetIdleCount(), numThreads + 1 ) ;	
 			fflush( stdout ) ;
 			
-			int gctCnt = ftCnt ;
-			if ( gctCnt > 1 && sampleCnt > 1 )
-			{
-				gctCnt = ( gctCnt < sampleCnt ? gctCnt : sampleCnt ) ;	
-				struct _getConstraintsThreadArg *args = new struct _getConstraintsThreadArg[ gctCnt ] ;
-				for ( j = 0 ; j < gctCnt ; ++j )
-				{
-					args[j].pMultiSampleConstraints = &multiSampleConstraints ;
-					args[j].numThreads = gctCnt ;
-					args[j].tid = j ;
-					args[j].subexons = intervalSubexons ;
-					args[j].seCnt = gi.endIdx - gi.startIdx + 1 ;
-					args[j].start = gi.start ; args[j].end = gi.end ;
-					pthread_create( &getConstraintsThreads[j], &pthreadAttr, GetConstraints_Thread, &args[j] ) ;
-				}
-
-
-				
-				for ( j = 0 ; j < gctCnt ; ++j )
-					pthread_join( getConstraintsThreads[j], NULL ) ;		
-
-				delete[] args ;
-			}
-			else
-			{
-				for ( j = 0 ; j < sampleCnt ; ++j )
-					multiSampleConstraints[j].BuildConstraints( intervalSubexons, gi.endIdx - gi.startIdx + 1, gi.start, gi.end ) ;	
-			}
+			workQueue.BuildConstraints( multiSampleConstraints, intervalSubexons, seCnt, gi.start, gi.end ) ;
 			
-			// Search for the free queue.
-			int tag = -1 ; // get the working thread.
-			pthread_mutex_lock( &ftLock ) ;
-			if ( ftCnt == 0 )
-			{
-				pthread_cond_wait( &fullWorkCond, &ftLock ) ;	
-			}
-			tag = freeThreads[ ftCnt - 1 ] ;
-			--ftCnt ;
-			pthread_mutex_unlock( &ftLock ) ;
-			
-			if ( initThreads[tag] )
-				pthread_join( threads[tag], NULL ) ; // Make sure the chosen thread exits.
-			
-			// Assign the subexons, the constraints and correlation content.
-			pArgs[tag].subexons = new struct _subexon[gi.endIdx - gi.startIdx + 1] ;
-			pArgs[tag].seCnt = gi.endIdx - gi.startIdx + 1 ;
-			for ( j = 0 ; j < pArgs[tag].seCnt ; ++j )
-			{
-				pArgs[tag].subexons[j] = intervalSubexons[j] ;
-				int cnt = intervalSubexons[j].prevCnt ;
-				pArgs[tag].subexons[j].prev = new int[cnt] ;
-				memcpy( pArgs[tag].subexons[j].prev, intervalSubexons[j].prev, sizeof( int ) * cnt ) ;
-				cnt = intervalSubexons[j].nextCnt ;
-				pArgs[tag].subexons[j].next = new int[cnt] ;
-				memcpy( pArgs[tag].subexons[j].next, intervalSubexons[j].next, sizeof( int ) * cnt ) ;
-			}
-
+			// Hand the subexons, the constraints and correlation content of the gene over to the queue.
+			// They are not touched here afterwards, so no copy is needed, and the worker releases the subexons.
+			// The swaps give us the buffers the work held for its previous gene.
+			struct _geneWork *work = workQueue.GetFreeWork() ;
+			int64_t constraintCnt = 0 ;
+			work->id = i ;
+			work->subexons = intervalSubexons ;
+			work->seCnt = seCnt ;
 			for ( j = 0 ; j < sampleCnt ; ++j )
 			{
-				pArgs[tag].constraints[j].Assign( multiSampleConstraints[ j ] ) ;
+				constraintCnt += multiSampleConstraints[j].constraints.size() ;
+				work->constraints[j].Swap( multiSampleConstraints[ j ] ) ;
 			}
-			pArgs[tag].subexonCorrelation.Assign( subexonCorrelation ) ;
-			pthread_create( &threads[tag], &pthreadAttr, TranscriptDeciderSolve_Wrapper, &pArgs[tag] ) ;
-			initThreads[tag] = true ;
-			for ( j = 0 ; j < gi.endIdx - gi.startIdx + 1 ; ++j )
-			{
-				delete[] intervalSubexons[j].prev ;
-				delete[] intervalSubexons[j].next ;
-			}
-			delete[] intervalSubexons ;
+			work->subexonCorrelation.Swap( subexonCorrelation ) ;
+			work->cost = seCnt * ( constraintCnt + 1 ) ;
+			workQueue.AddWork( work ) ;
 		}
+		workQueue.Finish() ;
 
 		for ( i = 0 ; i < numThreads ; ++i )
-		{
-			if ( initThreads[i] )
-				pthread_join( threads[i], NULL ) ;
-		}
+			pthread_join( threads[i], NULL ) ;
 
 		// Release memory
-		for ( i = 0 ; i < numThreads ; ++i )
-		{
-			std::vector<Constraints>().swap( pArgs[i].constraints ) ;
-		}
 		delete []pArgs ;
 		pthread_attr_destroy( &pthreadAttr ) ;
-		pthread_mutex_destroy( &ftLock ) ;
-		pthread_cond_destroy( &fullWorkCond ) ;
-
 		delete[] threads ;
-		delete[] getConstraintsThreads ;
-		delete[] initThreads ;
-		delete[] freeThreads ;
 	} // end of else for multi-thread.
 
 	outputHandler.OutputCommandInfo( argc, argv ) ; 
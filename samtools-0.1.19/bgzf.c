@@ -210,33 +210,34 @@ static int deflate_block(BGZF *fp, int block_length)
 	return comp_size;
 }
 
-// Inflate the block in fp->compressed_block into fp->uncompressed_block
-static int inflate_block(BGZF* fp, int block_length)
+static int bgzf_uncompress(void *dst, const void *src, int block_length)
 {
 	z_stream zs;
 	zs.zalloc = NULL;
 	zs.zfree = NULL;
-	zs.next_in = fp->compressed_block + 18;
+	zs.next_in = (Bytef*)src + 18;
 	zs.avail_in = block_length - 16;
-	zs.next_out = fp->uncompressed_block;
+	zs.next_out = dst;
 	zs.avail_out = BGZF_MAX_BLOCK_SIZE;
 
-	if (inflateInit2(&zs, -15) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
+	if (inflateInit2(&zs, -15) != Z_OK) return -1;
 	if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
 		inflateEnd(&zs);
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
-	if (inflateEnd(&zs) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
 		return -1;
 	}
+	if (inflateEnd(&zs) != Z_OK) return -1;
 	return zs.total_out;
 }
 
+// Inflate the block in fp->compressed_block into fp->uncompressed_block
+static int inflate_block(BGZF* fp, int block_length)
+{
+	int ret;
+	if ((ret = bgzf_uncompress(fp->uncompressed_block, fp->compressed_block, block_length)) < 0)
+		fp->errcode |= BGZF_ERR_ZLIB;
+	return ret;
+}
+
 static int check_header(const uint8_t *header)
 {
 	return (header[0] == 31 && header[1] == 139 && header[2] == 8 && (header[3] & 4) != 0
@@ -304,34 +305,47 @@ static int load_block_from_cache(BGZF *fp, int64_t block_address) {return 0;}
 static void cache_block(BGZF *fp, int size) {}
 #endif
 
+// Read the compressed block at the current file position into _dst; return its size, 0 at the end of file or -1 on error
+static int read_compressed(_bgzf_file_t fpr, void *_dst, int *errcode)
+{
+	uint8_t *dst = (uint8_t*)_dst;
+	int count, block_length, remaining;
+	count = _bgzf_read(fpr, dst, BLOCK_HEADER_LENGTH);
+	if (count == 0) return 0; // no data read
+	if (count != BLOCK_HEADER_LENGTH || !check_header(dst)) {
+		*errcode |= BGZF_ERR_HEADER;
+		return -1;
+	}
+	block_length = unpackInt16(&dst[16]) + 1; // +1 because when writing this number, we used "-1"
+	remaining = block_length - BLOCK_HEADER_LENGTH;
+	count = _bgzf_read(fpr, &dst[BLOCK_HEADER_LENGTH], remaining);
+	if (count != remaining) {
+		*errcode |= BGZF_ERR_IO;
+		return -1;
+	}
+	return block_length;
+}
+
+static int mt_read_block(BGZF *fp);
+static int64_t next_block_address(BGZF *fp);
+
 int bgzf_read_block(BGZF *fp)
 {
-	uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
-	int count, size = 0, block_length, remaining;
+	int count, size, errcode = 0;
 	int64_t block_address;
+	if (fp->mt) return mt_read_block(fp);
 	block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
 	if (fp->cache_size && load_block_from_cache(fp, block_address)) return 0;
-	count = _bgzf_read(fp->fp, header, sizeof(header));
-	if (count == 0) { // no data read
-		fp->block_length = 0;
-		return 0;
-	}
-	if (count != sizeof(header) || !check_header(header)) {
-		fp->errcode |= BGZF_ERR_HEADER;
+	size = read_compressed((_bgzf_file_t)fp->fp, fp->compressed_block, &errcode);
+	if (size < 0) {
+		fp->errcode |= errcode;
 		return -1;
 	}
-	size = count;
-	block_length = unpackInt16((uint8_t*)&header[16]) + 1; // +1 because when writing this number, we used "-1"
-	compressed_block = (uint8_t*)fp->compressed_block;
-	memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
-	remaining = block_length - BLOCK_HEADER_LENGTH;
-	count = _bgzf_read(fp->fp, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
-	if (count != remaining) {
-		fp->errcode |= BGZF_ERR_IO;
-		return -1;
+	if (size == 0) {
+		fp->block_length = 0;
+		return 0;
 	}
-	size += count;
-	if ((count = inflate_block(fp, block_length)) < 0) return -1;
+	if ((count = inflate_block(fp, size)) < 0) return -1;
 	if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
 	fp->block_address = block_address;
 	fp->block_length = count;
@@ -361,7 +375,7 @@ ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length)
 		bytes_read += copy_length;
 	}
 	if (fp->block_offset == fp->block_length) {
-		fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+		fp->block_address = next_block_address(fp);
 		fp->block_offset = fp->block_length = 0;
 	}
 	return bytes_read;
@@ -416,12 +430,176 @@ static void *mt_worker(void *data)
 	return 0;
 }
 
+/* Reading: n_threads workers take turns to read the next compressed block
+ * from the file (under the lock, so blocks are claimed in file order) and
+ * inflate it outside the lock into a ring of n_blks slots. bgzf_read_block()
+ * hands the slots over in order by swapping the uncompressed buffers. */
+
+typedef struct {
+	int64_t address; // file offset of the compressed block
+	int length, errcode, ready;
+	void *cblock, *ublock;
+} rslot_t;
+
+typedef struct {
+	BGZF *fp;
+	int n_threads, n_blks;
+	int64_t head, tail; // slots [head, tail) are claimed, in file order
+	int64_t next_address; // file offset of the next block to claim
+	int busy, eof, done;
+	rslot_t *slot;
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_ready;
+} rmtaux_t;
+
+static void *mt_reader(void *data)
+{
+	rmtaux_t *mt = (rmtaux_t*)data;
+	pthread_mutex_lock(&mt->lock);
+	for (;;) {
+		rslot_t *p;
+		int size;
+		while (!mt->done && (mt->eof || mt->tail - mt->head == mt->n_blks))
+			pthread_cond_wait(&mt->cv_work, &mt->lock);
+		if (mt->done) break;
+		p = &mt->slot[mt->tail % mt->n_blks];
+		p->errcode = p->ready = 0;
+		p->address = mt->next_address;
+		size = read_compressed((_bgzf_file_t)mt->fp->fp, p->cblock, &p->errcode);
+		if (size <= 0) { // stop reading ahead at the end of file or at the first bad block
+			mt->eof = 1;
+			if (size < 0) {
+				p->ready = 1;
+				++mt->tail;
+			}
+			pthread_cond_broadcast(&mt->cv_ready);
+			continue;
+		}
+		mt->next_address += size;
+		++mt->tail; ++mt->busy;
+		pthread_mutex_unlock(&mt->lock);
+		if ((p->length = bgzf_uncompress(p->ublock, p->cblock, size)) < 0)
+			p->errcode |= BGZF_ERR_ZLIB;
+		pthread_mutex_lock(&mt->lock);
+		p->ready = 1; --mt->busy;
+		pthread_cond_broadcast(&mt->cv_ready);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+static int mt_read_init(BGZF *fp, int n_threads, int n_sub_blks)
+{
+	int i;
+	rmtaux_t *mt;
+	pthread_attr_t attr;
+	mt = calloc(1, sizeof(rmtaux_t));
+	mt->fp = fp;
+	mt->n_threads = n_threads;
+	mt->n_blks = n_threads * n_sub_blks;
+	mt->slot = calloc(mt->n_blks, sizeof(rslot_t));
+	for (i = 0; i < mt->n_blks; ++i) {
+		mt->slot[i].cblock = malloc(BGZF_MAX_BLOCK_SIZE);
+		mt->slot[i].ublock = malloc(BGZF_MAX_BLOCK_SIZE);
+	}
+	mt->next_address = _bgzf_tell((_bgzf_file_t)fp->fp); // a partially consumed block stays in fp
+	mt->tid = calloc(mt->n_threads, sizeof(pthread_t));
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cv_work, 0);
+	pthread_cond_init(&mt->cv_ready, 0);
+	fp->mt = mt;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (i = 0; i < mt->n_threads; ++i)
+		pthread_create(&mt->tid[i], &attr, mt_reader, mt);
+	return 0;
+}
+
+static void mt_read_destroy(rmtaux_t *mt)
+{
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	mt->done = 1;
+	pthread_cond_broadcast(&mt->cv_work);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0);
+	for (i = 0; i < mt->n_blks; ++i) {
+		free(mt->slot[i].cblock);
+		free(mt->slot[i].ublock);
+	}
+	free(mt->slot); free(mt->tid);
+	pthread_cond_destroy(&mt->cv_work);
+	pthread_cond_destroy(&mt->cv_ready);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+static int mt_read_block(BGZF *fp)
+{
+	rmtaux_t *mt = (rmtaux_t*)fp->mt;
+	rslot_t *p;
+	void *tmp;
+	int ret = 0;
+	pthread_mutex_lock(&mt->lock);
+	while (mt->head == mt->tail? !mt->eof : !mt->slot[mt->head % mt->n_blks].ready)
+		pthread_cond_wait(&mt->cv_ready, &mt->lock);
+	if (mt->head == mt->tail) { // no data read
+		fp->block_length = 0;
+	} else if ((p = &mt->slot[mt->head % mt->n_blks])->errcode) {
+		fp->errcode |= p->errcode;
+		ret = -1;
+	} else {
+		tmp = fp->uncompressed_block;
+		fp->uncompressed_block = p->ublock;
+		p->ublock = tmp;
+		if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
+		fp->block_address = p->address;
+		fp->block_length = p->length;
+		++mt->head;
+		pthread_cond_signal(&mt->cv_work);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return ret;
+}
+
+// Drop the blocks read ahead and restart the workers from block_address
+static int mt_read_seek(BGZF *fp, int64_t block_address)
+{
+	rmtaux_t *mt = (rmtaux_t*)fp->mt;
+	int ret = 0;
+	pthread_mutex_lock(&mt->lock);
+	while (mt->busy) pthread_cond_wait(&mt->cv_ready, &mt->lock);
+	mt->head = mt->tail = 0;
+	mt->eof = 0;
+	if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
+		mt->eof = 1; // keep the workers idle; the next read reports end of file
+		ret = -1;
+	}
+	mt->next_address = block_address;
+	pthread_cond_broadcast(&mt->cv_work);
+	pthread_mutex_unlock(&mt->lock);
+	return ret;
+}
+
+static int64_t next_block_address(BGZF *fp)
+{
+	rmtaux_t *mt = (rmtaux_t*)fp->mt;
+	int64_t address;
+	if (mt == 0) return _bgzf_tell((_bgzf_file_t)fp->fp);
+	pthread_mutex_lock(&mt->lock);
+	address = mt->head < mt->tail? mt->slot[mt->head % mt->n_blks].address : mt->next_address;
+	pthread_mutex_unlock(&mt->lock);
+	return address;
+}
+
 int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
 {
 	int i;
 	mtaux_t *mt;
 	pthread_attr_t attr;
-	if (!fp->is_write || fp->mt || n_threads <= 1) return -1;
+	if (fp->mt || n_threads <= 1) return -1;
+	if (!fp->is_write) return mt_read_init(fp, n_threads, n_sub_blks);
 	mt = calloc(1, sizeof(mtaux_t));
 	mt->n_threads = n_threads;
 	mt->n_blks = n_threads * n_sub_blks;
@@ -581,7 +759,7 @@ int bgzf_close(BGZF* fp)
 			return -1;
 		}
 		if (fp->mt) mt_destroy(fp->mt);
-	}
+	} else if (fp->mt) mt_read_destroy(fp->mt);
 	ret = fp->is_write? fclose(fp->fp) : _bgzf_close(fp->fp);
 	if (ret != 0) return -1;
 	free(fp->uncompressed_block);
@@ -601,11 +779,17 @@ int bgzf_check_EOF(BGZF *fp)
 	static uint8_t magic[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
 	uint8_t buf[28];
 	off_t offset;
+	int ret = 0;
+	rmtaux_t *mt = fp->is_write? 0 : (rmtaux_t*)fp->mt;
+	if (mt) pthread_mutex_lock(&mt->lock); // the reading threads share the file position
 	offset = _bgzf_tell((_bgzf_file_t)fp->fp);
-	if (_bgzf_seek(fp->fp, -28, SEEK_END) < 0) return 0;
-	_bgzf_read(fp->fp, buf, 28);
-	_bgzf_seek(fp->fp, offset, SEEK_SET);
-	return (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	if (_bgzf_seek(fp->fp, -28, SEEK_END) >= 0) {
+		_bgzf_read(fp->fp, buf, 28);
+		_bgzf_seek(fp->fp, offset, SEEK_SET);
+		ret = (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	}
+	if (mt) pthread_mutex_unlock(&mt->lock);
+	return ret;
 }
 
 int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
@@ -619,7 +803,7 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
 	}
 	block_offset = pos & 0xFFFF;
 	block_address = pos >> 16;
-	if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
+	if (fp->mt? mt_read_seek(fp, block_address) < 0 : _bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
 		fp->errcode |= BGZF_ERR_IO;
 		return -1;
 	}
@@ -650,7 +834,7 @@ int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+        fp->block_address = next_block_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -664,13 +848,14 @@ int bgzf_getc(BGZF *fp)
 int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 {
 	int l, state = 0;
-	unsigned char *buf = (unsigned char*)fp->uncompressed_block;
+	unsigned char *buf;
 	str->l = 0;
 	do {
 		if (fp->block_offset >= fp->block_length) {
 			if (bgzf_read_block(fp) != 0) { state = -2; break; }
 			if (fp->block_length == 0) { state = -1; break; }
 		}
+		buf = (unsigned char*)fp->uncompressed_block; // the reading threads may hand over a different buffer
 		for (l = fp->block_offset; l < fp->block_length && buf[l] != delim; ++l);
 		if (l < fp->block_length) state = 1;
 		l -= fp->block_offset;
@@ -683,7 +868,7 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 		str->l += l;
 		fp->block_offset += l + 1;
 		if (fp->block_offset >= fp->block_length) {
-			fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+			fp->block_address = next_block_address(fp);
 			fp->block_offset = 0;
 			fp->block_length = 0;
 		} 
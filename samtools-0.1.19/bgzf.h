@@ -192,11 +192,14 @@ extern "C" {
 	int bgzf_read_block(BGZF *fp);
 
 	/**
-	 * Enable multi-threading (only effective on writing)
+	 * Enable multi-threading
 	 *
-	 * @param fp          BGZF file handler; must be opened for writing
-	 * @param n_threads   #threads used for writing
-	 * @param n_sub_blks  #blocks processed by each thread; a value 64-256 is recommended
+	 * On reading, n_threads workers read ahead and inflate up to n_threads*n_sub_blks
+	 * blocks in parallel while the caller consumes them in file order.
+	 *
+	 * @param fp          BGZF file handler
+	 * @param n_threads   #threads used for writing or for inflating on reading
+	 * @param n_sub_blks  #blocks processed by each thread; a value 64-256 is recommended for writing
 	 */
 	int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
 